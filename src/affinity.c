@@ -0,0 +1,235 @@
+////////////////////////////////////////////////////////////////////////
+//
+// Copyright 2015 PMC-Sierra, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you
+// may not use this file except in compliance with the License. You may
+// obtain a copy of the License at
+// http://www.apache.org/licenses/LICENSE-2.0 Unless required by
+// applicable law or agreed to in writing, software distributed under the
+// License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+// CONDITIONS OF ANY KIND, either express or implied. See the License for
+// the specific language governing permissions and limitations under the
+// License.
+//
+////////////////////////////////////////////////////////////////////////
+
+////////////////////////////////////////////////////////////////////////
+//
+//   Author: Logan Gunthorpe
+//
+//   Description:
+//     Thread pinning and NUMA node lookup for the pipeline threads.
+//
+////////////////////////////////////////////////////////////////////////
+
+#include "affinity.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <pthread.h>
+
+#include <limits.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+static const char *role_names[] = {
+    [AFFINITY_READER] = "reader",
+    [AFFINITY_SUBMIT] = "submit",
+    [AFFINITY_COMPLETE] = "complete",
+    [AFFINITY_WRITER] = "writer",
+};
+
+static cpu_set_t role_sets[AFFINITY_NUM_ROLES];
+static int role_have[AFFINITY_NUM_ROLES];
+
+static int parse_cpulist(const char *list, cpu_set_t *set)
+{
+    const char *p = list;
+
+    CPU_ZERO(set);
+
+    while (*p && *p != '\n') {
+        char *end;
+        long lo = strtol(p, &end, 10);
+        if (end == p || lo < 0)
+            return -1;
+
+        long hi = lo;
+        p = end;
+        if (*p == '-') {
+            p++;
+            hi = strtol(p, &end, 10);
+            if (end == p || hi < lo)
+                return -1;
+            p = end;
+        }
+
+        if (hi >= CPU_SETSIZE)
+            return -1;
+
+        for (long c = lo; c <= hi; c++)
+            CPU_SET(c, set);
+
+        if (*p == ',')
+            p++;
+        else if (*p && *p != '\n')
+            return -1;
+    }
+
+    return CPU_COUNT(set) ? 0 : -1;
+}
+
+int affinity_node_cpus(int node, cpu_set_t *set)
+{
+    char path[PATH_MAX];
+    char buf[4096];
+
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist",
+             node);
+
+    FILE *f = fopen(path, "r");
+    if (f == NULL)
+        return -1;
+
+    char *line = fgets(buf, sizeof(buf), f);
+    fclose(f);
+
+    if (line == NULL)
+        return -1;
+
+    return parse_cpulist(buf, set);
+}
+
+int affinity_parse(const char *list, cpu_set_t *set)
+{
+    if (strncmp(list, "node:", 5) == 0) {
+        char *end;
+        long node = strtol(&list[5], &end, 10);
+        if (end == &list[5] || *end || node < 0)
+            return -1;
+
+        return affinity_node_cpus(node, set);
+    }
+
+    return parse_cpulist(list, set);
+}
+
+static int read_node(const char *dir)
+{
+    char path[PATH_MAX + sizeof("/numa_node")];
+    int node;
+
+    snprintf(path, sizeof(path), "%s/numa_node", dir);
+
+    FILE *f = fopen(path, "r");
+    if (f == NULL)
+        return -2;
+
+    if (fscanf(f, "%d", &node) != 1)
+        node = -1;
+
+    fclose(f);
+    return node;
+}
+
+int affinity_path_node(const char *path)
+{
+    struct stat st;
+    char link[PATH_MAX];
+    char dir[PATH_MAX];
+
+    if (stat(path, &st))
+        return -1;
+
+    if (S_ISCHR(st.st_mode))
+        snprintf(link, sizeof(link), "/sys/dev/char/%u:%u",
+                 major(st.st_rdev), minor(st.st_rdev));
+    else if (S_ISBLK(st.st_mode))
+        snprintf(link, sizeof(link), "/sys/dev/block/%u:%u",
+                 major(st.st_rdev), minor(st.st_rdev));
+    else
+        snprintf(link, sizeof(link), "/sys/dev/block/%u:%u",
+                 major(st.st_dev), minor(st.st_dev));
+
+    if (realpath(link, dir) == NULL)
+        return -1;
+
+    // The numa_node attribute lives on the PCI device which is some
+    // way up the tree from a partition, namespace or AFU.
+    while (strcmp(dir, "/sys/devices") != 0) {
+        int node = read_node(dir);
+        if (node != -2)
+            return node;
+
+        char *slash = strrchr(dir, '/');
+        if (slash == NULL || slash == dir)
+            break;
+        *slash = 0;
+    }
+
+    return -1;
+}
+
+void affinity_set(enum affinity_role role, const cpu_set_t *set)
+{
+    role_sets[role] = *set;
+    role_have[role] = 1;
+}
+
+int affinity_is_set(enum affinity_role role)
+{
+    return role_have[role];
+}
+
+void affinity_pin(enum affinity_role role)
+{
+    if (!role_have[role])
+        return;
+
+    int ret = pthread_setaffinity_np(pthread_self(), sizeof(role_sets[role]),
+                                     &role_sets[role]);
+    if (ret)
+        fprintf(stderr, "Unable to pin %s thread: %s\n", role_names[role],
+                strerror(ret));
+}
+
+void affinity_format(const cpu_set_t *set, char *buf, size_t len)
+{
+    size_t n = 0;
+
+    buf[0] = 0;
+
+    for (int c = 0; c < CPU_SETSIZE && n < len; c++) {
+        if (!CPU_ISSET(c, set))
+            continue;
+
+        int hi = c;
+        while (hi + 1 < CPU_SETSIZE && CPU_ISSET(hi + 1, set))
+            hi++;
+
+        if (hi == c)
+            n += snprintf(&buf[n], len - n, "%s%d", n ? "," : "", c);
+        else
+            n += snprintf(&buf[n], len - n, "%s%d-%d", n ? "," : "", c, hi);
+
+        c = hi;
+    }
+}
+
+void affinity_json(struct json *j)
+{
+    char buf[256];
+
+    json_obj_start(j, "affinity");
+    for (int i = 0; i < AFFINITY_NUM_ROLES; i++) {
+        if (!role_have[i])
+            continue;
+
+        affinity_format(&role_sets[i], buf, sizeof(buf));
+        json_str(j, role_names[i], buf);
+    }
+    json_obj_end(j);
+}
@@ -0,0 +1,65 @@
+////////////////////////////////////////////////////////////////////////
+//
+// Copyright 2015 PMC-Sierra, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you
+// may not use this file except in compliance with the License. You may
+// obtain a copy of the License at
+// http://www.apache.org/licenses/LICENSE-2.0 Unless required by
+// applicable law or agreed to in writing, software distributed under the
+// License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+// CONDITIONS OF ANY KIND, either express or implied. See the License for
+// the specific language governing permissions and limitations under the
+// License.
+//
+////////////////////////////////////////////////////////////////////////
+
+////////////////////////////////////////////////////////////////////////
+//
+//   Author: Logan Gunthorpe
+//
+//   Description:
+//     Thread pinning and NUMA node lookup for the pipeline threads.
+//
+////////////////////////////////////////////////////////////////////////
+
+#ifndef AFFINITY_H
+#define AFFINITY_H
+
+#include "json.h"
+
+#include <sched.h>
+#include <stddef.h>
+
+enum affinity_role {
+    AFFINITY_READER,
+    AFFINITY_SUBMIT,
+    AFFINITY_COMPLETE,
+    AFFINITY_WRITER,
+    AFFINITY_NUM_ROLES,
+};
+
+// Parse a list of CPUs in the kernel's cpulist format (eg. "0-3,8") or
+// "node:N" for every CPU on NUMA node N. Returns -1 on error.
+int affinity_parse(const char *list, cpu_set_t *set);
+
+// Returns the NUMA node the device behind path is attached to. path
+// may be a character device (eg. the CAPI card), a block device or
+// any file on a block device. Returns -1 if the node isn't known.
+int affinity_path_node(const char *path);
+
+int affinity_node_cpus(int node, cpu_set_t *set);
+
+// Set the CPUs the threads of a role pin themselves to. This must be
+// done before the threads are started.
+void affinity_set(enum affinity_role role, const cpu_set_t *set);
+int affinity_is_set(enum affinity_role role);
+
+// Called by each thread as it starts. Does nothing if no CPUs were
+// set for the role.
+void affinity_pin(enum affinity_role role);
+
+void affinity_format(const cpu_set_t *set, char *buf, size_t len);
+void affinity_json(struct json *j);
+
+#endif
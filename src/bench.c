@@ -0,0 +1,732 @@
+////////////////////////////////////////////////////////////////////////
+//
+// Copyright 2015 PMC-Sierra, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you
+// may not use this file except in compliance with the License. You may
+// obtain a copy of the License at
+// http://www.apache.org/licenses/LICENSE-2.0 Unless required by
+// applicable law or agreed to in writing, software distributed under the
+// License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+// CONDITIONS OF ANY KIND, either express or implied. See the License for
+// the specific language governing permissions and limitations under the
+// License.
+//
+////////////////////////////////////////////////////////////////////////
+
+////////////////////////////////////////////////////////////////////////
+//
+//   Author: Logan Gunthorpe
+//
+//   Description:
+//     Benchmark each stage of the textswap pipeline in isolation (the
+//     search kernel, the reorder ring, the read engine and the write
+//     engine) as well as the full pipeline. Every benchmark is run
+//     a number of times after a warmup and the median and spread of
+//     the rates are reported in a format that can be diffed against
+//     (or compared with) a baseline.
+//
+////////////////////////////////////////////////////////////////////////
+
+#include "textswap.h"
+#include "readthrd.h"
+#include "writethrd.h"
+#include "reorder.h"
+#include "stats.h"
+#include "version.h"
+
+#include <libcxl.h>
+#include <capi/capi.h>
+#include <capi/proc.h>
+#include <capi/wqueue.h>
+#include <capi/wqueue_emul.h>
+#include <capi/worker.h>
+#include <capi/macro.h>
+
+#include <argconfig/argconfig.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <errno.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <limits.h>
+#include <math.h>
+
+const char program_desc[]  =
+    "Run repeatable benchmarks of the textswap pipeline stages";
+
+struct config {
+    char *device;
+    int software;
+    char *phrase;
+    char *benches;
+    char *dir;
+    unsigned long size;
+    unsigned long chunk;
+    unsigned queue_len;
+    unsigned read_threads;
+    unsigned write_threads;
+    unsigned reps;
+    unsigned warmup;
+    char *output;
+    char *baseline;
+    unsigned threshold;
+    int verbose;
+};
+
+static const struct config defaults = {
+    .device        = "/dev/cxl/afu0.0d",
+    .phrase        = "GoPower8",
+    .benches       = "kernel,reorder,read,write,pipeline",
+    .dir           = "/dev/shm",
+    .size          = 64 << 20,
+    .chunk         = 8192,
+    .queue_len     = 8,
+    .read_threads  = 4,
+    .write_threads = 4,
+    .reps          = 5,
+    .warmup        = 1,
+    .threshold     = 5,
+};
+
+static const struct argconfig_commandline_options command_line_options[] = {
+    {"B",          "LIST", CFG_STRING, &defaults.benches, required_argument, NULL},
+    {"bench",      "LIST", CFG_STRING, &defaults.benches, required_argument,
+            "comma separated benchmarks to run (kernel,reorder,read,write,pipeline)"},
+    {"b",          "FILE", CFG_STRING, &defaults.baseline, required_argument, NULL},
+    {"baseline",   "FILE", CFG_STRING, &defaults.baseline, required_argument,
+            "compare the medians with a previous result file"},
+    {"c",          "NUM",  CFG_LONG_SUFFIX, &defaults.chunk, required_argument, NULL},
+    {"chunk",      "NUM",  CFG_LONG_SUFFIX, &defaults.chunk, required_argument,
+            "chunk size for reading files and pushing to AFU (bytes)"},
+    {"d",          "STRING", CFG_STRING, &defaults.device, required_argument, NULL},
+    {"device",     "STRING", CFG_STRING, &defaults.device, required_argument,
+            "the /dev/ path to the CAPI device"},
+    {"dir",        "DIR",  CFG_STRING, &defaults.dir, required_argument,
+            "directory (ideally tmpfs) to create the test files in"},
+    {"n",          "NUM",  CFG_POSITIVE, &defaults.reps, required_argument, NULL},
+    {"reps",       "NUM",  CFG_POSITIVE, &defaults.reps, required_argument,
+            "number of measured repetitions of each benchmark"},
+    {"o",          "FILE", CFG_STRING, &defaults.output, required_argument, NULL},
+    {"output",     "FILE", CFG_STRING, &defaults.output, required_argument,
+            "write the results to FILE to use as a baseline later"},
+    {"p",          "STRING", CFG_STRING, &defaults.phrase, required_argument, NULL},
+    {"phrase",     "STRING", CFG_STRING, &defaults.phrase, required_argument,
+            "the ASCII phrase to search for"},
+    {"q",          "NUM",  CFG_POSITIVE, &defaults.queue_len, required_argument, NULL},
+    {"queue",      "NUM",  CFG_POSITIVE, &defaults.queue_len, required_argument,
+            "number of wed queue entries"},
+    {"r",          "NUM",  CFG_POSITIVE, &defaults.read_threads, required_argument, NULL},
+    {"read-threads", "NUM", CFG_POSITIVE, &defaults.read_threads, required_argument,
+            "number of read threads"},
+    {"s",          "NUM",  CFG_LONG_SUFFIX, &defaults.size, required_argument, NULL},
+    {"size",       "NUM",  CFG_LONG_SUFFIX, &defaults.size, required_argument,
+            "amount of data processed by each repetition"},
+    {"S",          "", CFG_NONE, &defaults.software, no_argument, NULL},
+    {"software",   "", CFG_NONE, &defaults.software, no_argument,
+            "use sotfware emulation"},
+    {"threshold",  "PCT", CFG_POSITIVE, &defaults.threshold, required_argument,
+            "report a regression if a median drops by more than PCT percent"},
+    {"w",          "NUM",  CFG_POSITIVE, &defaults.write_threads, required_argument, NULL},
+    {"write-threads", "NUM", CFG_POSITIVE, &defaults.write_threads, required_argument,
+            "number of write threads"},
+    {"warmup",     "NUM",  CFG_POSITIVE, &defaults.warmup, required_argument,
+            "number of unmeasured repetitions to run first"},
+    {"v",          "", CFG_INCREMENT, NULL, no_argument, NULL},
+    {"verbose",    "", CFG_INCREMENT, &defaults.verbose, no_argument,
+            "be verbose"},
+    {0}
+};
+
+struct bench_ctx {
+    const struct config *cfg;
+    char *haystack;
+    unsigned needles;
+    char infile[PATH_MAX];
+    char outfile[PATH_MAX];
+};
+
+struct bench {
+    const char *name;
+    const char *unit;
+
+    // Returns the elapsed seconds (or a negative value on failure) and
+    // the amount of work done, in bytes or items, in *work.
+    double (*run)(struct bench_ctx *ctx, double *work);
+};
+
+struct result {
+    const char *name;
+    const char *unit;
+    unsigned reps;
+    double median, p10, p90, min, max;
+};
+
+static void gen_haystack(struct bench_ctx *ctx)
+{
+    const struct config *cfg = ctx->cfg;
+    size_t plen = strlen(cfg->phrase);
+
+    for (size_t i = 0; i < cfg->size; i++) {
+        unsigned char x;
+        do {
+            x = rand() % 256;
+        } while (!isalnum(x));
+        ctx->haystack[i] = x;
+    }
+
+    // One needle per MiB, away from the ends of the haystack
+    for (size_t pos = 4096; pos + plen < cfg->size; pos += 1 << 20) {
+        memcpy(&ctx->haystack[pos], cfg->phrase, plen);
+        ctx->needles++;
+    }
+}
+
+static int write_haystack(struct bench_ctx *ctx)
+{
+    int fd = open(ctx->infile, O_WRONLY | O_CREAT | O_TRUNC, 0664);
+    if (fd < 0) {
+        fprintf(stderr, "Unable to open '%s': %s\n", ctx->infile,
+                strerror(errno));
+        return -1;
+    }
+
+    const char *p = ctx->haystack;
+    size_t len = ctx->cfg->size;
+    while (len) {
+        ssize_t ret = write(fd, p, len);
+        if (ret < 0) {
+            perror("Writing haystack");
+            close(fd);
+            return -1;
+        }
+        p += ret;
+        len -= ret;
+    }
+
+    close(fd);
+    return 0;
+}
+
+static int start_wqueue(struct bench_ctx *ctx)
+{
+    if (wqueue_init(ctx->cfg->device, &MMIO->wq, ctx->cfg->queue_len)) {
+        perror("Initializing wqueue");
+        return -1;
+    }
+
+    textswap_set_phrase(wqueue_afu(), ctx->cfg->phrase);
+    return 0;
+}
+
+static double bench_kernel(struct bench_ctx *ctx, double *work)
+{
+    const struct config *cfg = ctx->cfg;
+    static struct proc *proc;
+
+    if (proc == NULL)
+        proc = proc_init();
+
+    char temp[16] = {0};
+    size_t plen = strlen(cfg->phrase);
+    memcpy(temp, cfg->phrase, plen < sizeof(temp) ? plen : sizeof(temp));
+    uint64_t *d = (uint64_t *) temp;
+    proc_mmio_write64(proc, &MMIO->text_search[0], d[0]);
+    proc_mmio_write64(proc, &MMIO->text_search[8], d[1]);
+
+    int32_t *res = malloc(cfg->chunk * sizeof(*res));
+    if (res == NULL) {
+        perror("Allocating result buffer");
+        return -1;
+    }
+
+    unsigned long matches = 0;
+    double start = stats_now();
+
+    for (size_t off = 0; off < cfg->size; off += cfg->chunk) {
+        size_t len = cfg->size - off;
+        if (len > cfg->chunk)
+            len = cfg->chunk;
+
+        int dirty;
+        size_t dst_len;
+        proc_run(proc, 0, &ctx->haystack[off], res, len, 0, &dirty, &dst_len);
+
+        for (size_t i = 0; i < dst_len / sizeof(*res); i++) {
+            if (res[i] == INT32_MAX)
+                break;
+            matches++;
+        }
+    }
+
+    double elapsed = stats_now() - start;
+    free(res);
+
+    if (matches != ctx->needles) {
+        fprintf(stderr, "kernel: found %lu matches, expected %u\n",
+                matches, ctx->needles);
+        return -1;
+    }
+
+    *work = cfg->size;
+    return elapsed;
+}
+
+struct reorder_bench {
+    struct worker worker;
+    struct reorder reorder;
+    unsigned next;
+    unsigned count;
+};
+
+static void *reorder_thread(void *arg)
+{
+    struct reorder_bench *rb = container_of(arg, struct reorder_bench, worker);
+    unsigned idx;
+
+    while ((idx = __sync_fetch_and_add(&rb->next, 1)) < rb->count)
+        reorder_put(&rb->reorder, idx, (void *) (uintptr_t) (idx + 1));
+
+    worker_finish_thread(&rb->worker);
+    return NULL;
+}
+
+static double bench_reorder(struct bench_ctx *ctx, double *work)
+{
+    const struct config *cfg = ctx->cfg;
+    struct reorder_bench rb = {
+        .count = cfg->size / cfg->chunk,
+    };
+    double elapsed = -1;
+
+    if (reorder_init(&rb.reorder, cfg->read_threads * 2)) {
+        perror("Initializing reorder ring");
+        return -1;
+    }
+
+    double start = stats_now();
+    if (worker_start(&rb.worker, cfg->read_threads, reorder_thread)) {
+        perror("Starting reorder threads");
+        goto out;
+    }
+
+    for (unsigned i = 0; i < rb.count; i++) {
+        uintptr_t x = (uintptr_t) reorder_get(&rb.reorder);
+        if (x != i + 1) {
+            fprintf(stderr, "reorder: got item %zu, expected %u\n",
+                    (size_t) x - 1, i);
+            exit(EPIPE);
+        }
+    }
+
+    worker_join(&rb.worker);
+    elapsed = stats_now() - start;
+    worker_free(&rb.worker);
+
+    *work = rb.count;
+
+out:
+    reorder_destroy(&rb.reorder);
+    return elapsed;
+}
+
+static double bench_read(struct bench_ctx *ctx, double *work)
+{
+    const struct config *cfg = ctx->cfg;
+
+    struct readthrd *rt = readthrd_start(ctx->infile, cfg->read_threads,
+                                         READTHREAD_DISCARD, NULL);
+    if (rt == NULL) {
+        perror("Starting Read Threads");
+        return -1;
+    }
+
+    double start = stats_now();
+    *work = readthrd_run(rt, cfg->chunk, 0, 0);
+    readthrd_join(rt);
+    double elapsed = stats_now() - start;
+
+    readthrd_free(rt);
+    return elapsed;
+}
+
+static double bench_write(struct bench_ctx *ctx, double *work)
+{
+    const struct config *cfg = ctx->cfg;
+    unsigned count = (cfg->size + cfg->chunk - 1) / cfg->chunk;
+    struct readthrd_item **items = calloc(count, sizeof(*items));
+    double elapsed = -1;
+
+    if (items == NULL) {
+        perror("Allocating items");
+        return -1;
+    }
+
+    // The items are filled in up front so only the trip through the
+    // wqueue and the write threads is measured.
+    for (unsigned i = 0; i < count; i++) {
+        struct readthrd_item *it = malloc(sizeof(*it));
+        if (it == NULL || (it->buf = capi_alloc(cfg->chunk)) == NULL) {
+            perror("Allocating items");
+            exit(1);
+        }
+
+        it->pool = NULL;
+        it->budget = NULL;
+        it->pack = NULL;
+        it->contig = i > 0;
+        it->index = i;
+        it->offset = (size_t) i * cfg->chunk;
+        it->bytes = cfg->chunk;
+        it->real_bytes = cfg->size - it->offset;
+        if (it->real_bytes > cfg->chunk)
+            it->real_bytes = cfg->chunk;
+        it->last = i == count - 1;
+        memcpy(it->buf, &ctx->haystack[it->offset], it->real_bytes);
+        items[i] = it;
+    }
+
+    if (start_wqueue(ctx))
+        goto free_items;
+
+    struct writethrd *wt = writethrd_start(ctx->outfile, "", cfg->write_threads,
+                                           WRITETHREAD_COPY |
+                                           WRITETHREAD_ALWAYS_WRITE |
+                                           WRITETHREAD_TRUNCATE, NULL);
+    if (wt == NULL) {
+        perror("Starting Write Threads");
+        goto wqueue_cleanup;
+    }
+
+    double start = stats_now();
+    for (unsigned i = 0; i < count; i++) {
+        struct wqueue_item witem = {
+            .flags = WQ_PROC_MEMCPY_FLAG | WQ_ALWAYS_WRITE_FLAG,
+            .src = items[i]->buf,
+            .dst = items[i]->buf,
+            .src_len = items[i]->bytes,
+            .opaque = items[i],
+        };
+
+        if (items[i]->last)
+            witem.flags |= WQ_LAST_ITEM_FLAG;
+
+        // The write threads own the item once it is pushed
+        items[i] = NULL;
+        wqueue_push(&witem);
+    }
+
+    writethrd_join(wt);
+    elapsed = stats_now() - start;
+    writethrd_free(wt);
+
+    *work = cfg->size;
+
+wqueue_cleanup:
+    wqueue_cleanup();
+free_items:
+    for (unsigned i = 0; i < count; i++) {
+        if (items[i] == NULL)
+            continue;
+        free(items[i]->buf);
+        free(items[i]);
+    }
+    free(items);
+    return elapsed;
+}
+
+static double bench_pipeline(struct bench_ctx *ctx, double *work)
+{
+    const struct config *cfg = ctx->cfg;
+    double elapsed = -1;
+
+    if (start_wqueue(ctx))
+        return -1;
+
+    struct writethrd *wt = writethrd_start(ctx->infile, "", cfg->write_threads,
+                                           WRITETHREAD_SEARCH_ONLY, NULL);
+    if (wt == NULL) {
+        perror("Starting Write Threads");
+        goto wqueue_cleanup;
+    }
+
+    struct readthrd *rt = readthrd_start(ctx->infile, cfg->read_threads, 0,
+                                         NULL);
+    if (rt == NULL) {
+        perror("Starting Read Threads");
+        writethrd_cancel(wt);
+        writethrd_free(wt);
+        goto wqueue_cleanup;
+    }
+
+    double start = stats_now();
+    *work = readthrd_run(rt, cfg->chunk, 0, 0);
+    readthrd_join(rt);
+    writethrd_join(wt);
+    elapsed = stats_now() - start;
+
+    if (writethrd_matches(wt) != ctx->needles) {
+        fprintf(stderr, "pipeline: found %lu matches, expected %u\n",
+                writethrd_matches(wt), ctx->needles);
+        elapsed = -1;
+    }
+
+    readthrd_free(rt);
+    writethrd_free(wt);
+
+wqueue_cleanup:
+    wqueue_cleanup();
+    return elapsed;
+}
+
+static const struct bench benches[] = {
+    {"kernel",   "MiB/s",    bench_kernel},
+    {"reorder",  "Mitems/s", bench_reorder},
+    {"read",     "MiB/s",    bench_read},
+    {"write",    "MiB/s",    bench_write},
+    {"pipeline", "MiB/s",    bench_pipeline},
+    {0}
+};
+
+static int cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *) a;
+    double y = *(const double *) b;
+
+    return (x > y) - (x < y);
+}
+
+static double percentile(const double *sorted, unsigned n, double p)
+{
+    double rank = p / 100 * (n - 1);
+    unsigned lo = floor(rank);
+    unsigned hi = ceil(rank);
+
+    return sorted[lo] + (sorted[hi] - sorted[lo]) * (rank - lo);
+}
+
+static int run_bench(struct bench_ctx *ctx, const struct bench *b,
+                     struct result *res)
+{
+    const struct config *cfg = ctx->cfg;
+    unsigned total = cfg->warmup + cfg->reps;
+    double rates[cfg->reps];
+    double scale = strcmp(b->unit, "MiB/s") == 0 ? 1 << 20 : 1e6;
+
+    for (unsigned i = 0; i < total; i++) {
+        double work = 0;
+        double elapsed = b->run(ctx, &work);
+        if (elapsed < 0)
+            return -1;
+
+        double rate = elapsed > 0 ? work / elapsed / scale : 0;
+        if (cfg->verbose)
+            fprintf(stderr, "  %-10s %s %2u: %10.2f %s\n", b->name,
+                    i < cfg->warmup ? "warmup" : "rep   ",
+                    i < cfg->warmup ? i : i - cfg->warmup, rate, b->unit);
+
+        if (i >= cfg->warmup)
+            rates[i - cfg->warmup] = rate;
+    }
+
+    qsort(rates, cfg->reps, sizeof(*rates), cmp_double);
+
+    res->name = b->name;
+    res->unit = b->unit;
+    res->reps = cfg->reps;
+    res->median = percentile(rates, cfg->reps, 50);
+    res->p10 = percentile(rates, cfg->reps, 10);
+    res->p90 = percentile(rates, cfg->reps, 90);
+    res->min = rates[0];
+    res->max = rates[cfg->reps - 1];
+
+    return 0;
+}
+
+static void print_header(FILE *f, const struct config *cfg)
+{
+    fprintf(f, "# textswap bench %s: size=%lu chunk=%lu queue=%u "
+            "read_threads=%u write_threads=%u warmup=%u software=%d\n",
+            VERSION, cfg->size, cfg->chunk, cfg->queue_len,
+            cfg->read_threads, cfg->write_threads, cfg->warmup,
+            cfg->software);
+    fprintf(f, "# %-10s %-9s %4s %10s %10s %10s %10s %10s\n", "name", "unit",
+            "reps", "median", "p10", "p90", "min", "max");
+}
+
+static void print_result(FILE *f, const struct result *r)
+{
+    fprintf(f, "%-12s %-9s %4u %10.2f %10.2f %10.2f %10.2f %10.2f\n",
+            r->name, r->unit, r->reps, r->median, r->p10, r->p90,
+            r->min, r->max);
+}
+
+static int write_results(const char *fpath, const struct config *cfg,
+                         const struct result *res, int count)
+{
+    FILE *f = fopen(fpath, "w");
+    if (f == NULL) {
+        fprintf(stderr, "Unable to open '%s': %s\n", fpath, strerror(errno));
+        return -1;
+    }
+
+    print_header(f, cfg);
+    for (int i = 0; i < count; i++)
+        print_result(f, &res[i]);
+
+    if (fclose(f)) {
+        perror("Writing results");
+        return -1;
+    }
+
+    return 0;
+}
+
+static int compare_baseline(const char *fpath, const struct config *cfg,
+                            const struct result *res, int count)
+{
+    FILE *f = fopen(fpath, "r");
+    if (f == NULL) {
+        fprintf(stderr, "Unable to open '%s': %s\n", fpath, strerror(errno));
+        return -1;
+    }
+
+    int regressions = 0;
+    char line[256];
+
+    printf("\nCompared with %s:\n", fpath);
+    while (fgets(line, sizeof(line), f) != NULL) {
+        char name[32];
+        double median;
+
+        if (line[0] == '#' ||
+            sscanf(line, "%31s %*s %*u %lf", name, &median) != 2)
+            continue;
+
+        for (int i = 0; i < count; i++) {
+            if (strcmp(res[i].name, name) != 0)
+                continue;
+
+            double change = median > 0 ?
+                (res[i].median - median) / median * 100 : 0;
+            int bad = change < -(double) cfg->threshold;
+            regressions += bad;
+
+            printf("  %-10s %10.2f -> %10.2f %-9s %+7.1f%%%s\n", name,
+                   median, res[i].median, res[i].unit, change,
+                   bad ? "  REGRESSION" : "");
+        }
+    }
+
+    fclose(f);
+    return regressions;
+}
+
+static const struct bench *find_bench(const char *name, size_t len)
+{
+    for (const struct bench *b = benches; b->name; b++)
+        if (strlen(b->name) == len && strncmp(b->name, name, len) == 0)
+            return b;
+
+    return NULL;
+}
+
+int main (int argc, char *argv[])
+{
+    int ret = 0;
+    struct config cfg;
+    struct bench_ctx ctx = {.cfg = &cfg};
+    struct result res[sizeof(benches) / sizeof(*benches)];
+    const struct bench *selected[sizeof(benches) / sizeof(*benches)];
+    int count = 0;
+
+    argconfig_parse(argc, argv, program_desc, command_line_options,
+                    &defaults, &cfg, sizeof(cfg));
+
+    for (const char *p = cfg.benches; *p; ) {
+        size_t len = strcspn(p, ",");
+        const struct bench *b = find_bench(p, len);
+        if (b == NULL) {
+            fprintf(stderr, "Unknown benchmark '%.*s'\n", (int) len, p);
+            return 1;
+        }
+
+        if (count < sizeof(selected) / sizeof(*selected))
+            selected[count++] = b;
+
+        p += len;
+        if (*p == ',')
+            p++;
+    }
+
+    if (cfg.chunk == 0 || cfg.chunk & (CAPI_CACHELINE_BYTES-1)) {
+        fprintf(stderr, "Chunk must be a multiple of the cache line size (%d)\n",
+                CAPI_CACHELINE_BYTES);
+        return 1;
+    }
+
+    if (cfg.size < cfg.chunk) {
+        fprintf(stderr, "Size must be at least one chunk\n");
+        return 1;
+    }
+
+    if (cfg.software)
+        wqueue_emul_init();
+
+    snprintf(ctx.infile, sizeof(ctx.infile), "%s/textswap_bench.%d.dat",
+             cfg.dir, getpid());
+    snprintf(ctx.outfile, sizeof(ctx.outfile), "%s/textswap_bench.%d.out",
+             cfg.dir, getpid());
+
+    ctx.haystack = malloc(cfg.size);
+    if (ctx.haystack == NULL) {
+        perror("Allocating haystack");
+        return 1;
+    }
+
+    srand(1);
+    gen_haystack(&ctx);
+
+    if (write_haystack(&ctx)) {
+        ret = 1;
+        goto free_haystack;
+    }
+
+    print_header(stdout, &cfg);
+    for (int i = 0; i < count; i++) {
+        if (run_bench(&ctx, selected[i], &res[i])) {
+            fprintf(stderr, "Benchmark '%s' failed!\n", selected[i]->name);
+            ret = 2;
+            goto remove_files;
+        }
+
+        print_result(stdout, &res[i]);
+    }
+
+    if (cfg.output != NULL && write_results(cfg.output, &cfg, res, count))
+        ret = 1;
+
+    if (cfg.baseline != NULL) {
+        int regressions = compare_baseline(cfg.baseline, &cfg, res, count);
+        if (regressions < 0)
+            ret = 1;
+        else if (regressions > 0)
+            ret = 3;
+    }
+
+remove_files:
+    unlink(ctx.infile);
+    unlink(ctx.outfile);
+
+free_haystack:
+    free(ctx.haystack);
+
+    return ret;
+}
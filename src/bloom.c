@@ -0,0 +1,432 @@
+////////////////////////////////////////////////////////////////////////
+//
+// Copyright 2015 PMC-Sierra, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you
+// may not use this file except in compliance with the License. You may
+// obtain a copy of the License at
+// http://www.apache.org/licenses/LICENSE-2.0 Unless required by
+// applicable law or agreed to in writing, software distributed under the
+// License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+// CONDITIONS OF ANY KIND, either express or implied. See the License for
+// the specific language governing permissions and limitations under the
+// License.
+//
+////////////////////////////////////////////////////////////////////////
+
+////////////////////////////////////////////////////////////////////////
+//
+//   Author: Logan Gunthorpe
+//
+//   Description:
+//     Sidecar of per-chunk Bloom filters over the trigrams of a file,
+//     built while the file is searched, which later searches use to
+//     skip the chunks that can't hold their phrase.
+//
+////////////////////////////////////////////////////////////////////////
+
+#include "bloom.h"
+#include "ngblocks.h"
+
+#include <capi/macro.h>
+
+#include <unistd.h>
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+// A filter gets a bit per byte of its chunk, an eighth of the input in
+// all, up to MAX_BITS (2 Mbit). Chunks over 2 MiB get less than a bit
+// per byte and more false positives.
+#define MIN_BITS 512
+#define MAX_BITS (1 << 21)
+
+// Stored in host byte order, like the result cache
+struct bloom_header {
+    char magic[8];
+    uint64_t dev;
+    uint64_t ino;
+    uint64_t size;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    uint32_t filter_bits;
+    uint32_t hashes;
+    uint64_t nblocks;
+};
+
+struct block_info {
+    struct ngblock_info info;
+    unsigned char *filter;
+};
+
+struct bloom {
+    char *input;
+    struct stat st;
+    int loaded;
+
+    uint32_t filter_bits;
+    size_t filter_bytes;
+
+    struct ngblocks blocks;
+
+    // All the filters of a loaded sidecar, in one piece
+    unsigned char *filters;
+
+    unsigned long skipped;
+    size_t skipped_bytes;
+};
+
+static struct block_info *block(struct bloom *bf, size_t i)
+{
+    return container_of(ngblocks_get(&bf->blocks, i), struct block_info,
+                        info);
+}
+
+static uint64_t gram_hash(const unsigned char *b)
+{
+    uint64_t h = b[0] | b[1] << 8 | b[2] << 16;
+
+    h *= 0x9e3779b97f4a7c15ULL;
+    h ^= h >> 32;
+    h *= 0xbf58476d1ce4e5b9ULL;
+
+    return h;
+}
+
+// The bits of each trigram come from separate slices of its hash
+static uint32_t hash_bit(uint64_t h, int i, uint32_t bits)
+{
+    return (h >> (i * 21)) & (bits - 1);
+}
+
+static void set_gram(unsigned char *filter, uint32_t bits, uint64_t h)
+{
+    for (int i = 0; i < BLOOM_HASHES; i++) {
+        uint32_t bit = hash_bit(h, i, bits);
+        filter[bit / 8] |= 1 << (bit % 8);
+    }
+}
+
+static int has_gram(const unsigned char *filter, uint32_t bits, uint64_t h)
+{
+    for (int i = 0; i < BLOOM_HASHES; i++) {
+        uint32_t bit = hash_bit(h, i, bits);
+        if (!(filter[bit / 8] & (1 << (bit % 8))))
+            return 0;
+    }
+
+    return 1;
+}
+
+static struct bloom *alloc_bloom(uint32_t filter_bits)
+{
+    struct bloom *bf = calloc(1, sizeof(*bf));
+    if (bf == NULL)
+        return NULL;
+
+    bf->filter_bits = filter_bits;
+    bf->filter_bytes = filter_bits / 8;
+
+    if (ngblocks_init(&bf->blocks, sizeof(struct block_info))) {
+        free(bf);
+        return NULL;
+    }
+
+    return bf;
+}
+
+struct bloom *bloom_new(const char *input, const struct stat *st,
+                        size_t chunk_size)
+{
+    uint32_t bits = MIN_BITS;
+    while (bits < chunk_size && bits < MAX_BITS)
+        bits *= 2;
+
+    struct bloom *bf = alloc_bloom(bits);
+    if (bf == NULL)
+        return NULL;
+
+    bf->st = *st;
+    bf->input = strdup(input);
+    if (bf->input == NULL) {
+        bloom_free(bf);
+        return NULL;
+    }
+
+    return bf;
+}
+
+static int load(struct bloom *bf, FILE *f, const struct stat *st)
+{
+    struct bloom_header hdr;
+    struct stat fst;
+
+    if (fread(&hdr, sizeof(hdr), 1, f) != 1 ||
+        memcmp(hdr.magic, BLOOM_MAGIC, sizeof(hdr.magic)) != 0 ||
+        hdr.hashes != BLOOM_HASHES || hdr.filter_bits < MIN_BITS ||
+        hdr.filter_bits > MAX_BITS ||
+        (hdr.filter_bits & (hdr.filter_bits - 1)) ||
+        fstat(fileno(f), &fst) ||
+        fst.st_size != sizeof(hdr) + hdr.nblocks *
+            (sizeof(struct ngblock) + hdr.filter_bits / 8)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (hdr.dev != st->st_dev || hdr.ino != st->st_ino ||
+        hdr.size != st->st_size || hdr.mtime_sec != st->st_mtim.tv_sec ||
+        hdr.mtime_nsec != st->st_mtim.tv_nsec) {
+        errno = ESTALE;
+        return -1;
+    }
+
+    bf->filter_bits = hdr.filter_bits;
+    bf->filter_bytes = hdr.filter_bits / 8;
+
+    // The filters all point into one buffer from here on
+    bf->loaded = 1;
+
+    bf->filters = malloc(hdr.nblocks * bf->filter_bytes + 1);
+    if (bf->filters == NULL)
+        return -1;
+
+    for (size_t i = 0; i < hdr.nblocks; i++) {
+        struct block_info bi = {
+            .info.seen = 1,
+            .filter = &bf->filters[i * bf->filter_bytes],
+        };
+
+        if (fread(&bi.info.b, sizeof(bi.info.b), 1, f) != 1)
+            goto short_read;
+        if (ngblocks_store(&bf->blocks, i, &bi.info))
+            return -1;
+    }
+
+    if (fread(bf->filters, bf->filter_bytes, hdr.nblocks, f) != hdr.nblocks)
+        goto short_read;
+
+    return 0;
+
+short_read:
+    errno = EINVAL;
+    return -1;
+}
+
+struct bloom *bloom_open(const char *fpath, const struct stat *st)
+{
+    int err;
+    struct bloom *bf = alloc_bloom(MIN_BITS);
+    if (bf == NULL)
+        return NULL;
+
+    FILE *f = fopen(fpath, "rb");
+    if (f == NULL)
+        goto free_bloom;
+
+    if (load(bf, f, st)) {
+        fclose(f);
+        goto free_bloom;
+    }
+
+    fclose(f);
+    return bf;
+
+free_bloom:
+    // Keep the reason it couldn't be used
+    err = errno;
+    bloom_free(bf);
+    errno = err;
+    return NULL;
+}
+
+void bloom_free(struct bloom *bf)
+{
+    if (bf == NULL) return;
+
+    if (!bf->loaded)
+        for (size_t i = 0; i < bf->blocks.nblocks; i++)
+            free(block(bf, i)->filter);
+
+    ngblocks_destroy(&bf->blocks);
+    free(bf->filters);
+    free(bf->input);
+    free(bf);
+}
+
+int bloom_loaded(struct bloom *bf)
+{
+    return bf->loaded;
+}
+
+void bloom_visit(void *arg, struct readthrd_item *item)
+{
+    struct bloom *bf = arg;
+    const unsigned char *buf = item->buf;
+    size_t len = item->real_bytes;
+
+    if (!len || item->pack)
+        return;
+
+    struct block_info bi = {0};
+    ngblock_info_init(&bi.info, item);
+
+    bi.filter = calloc(1, bf->filter_bytes);
+    if (bi.filter == NULL)
+        goto nomem;
+
+    for (size_t i = 0; i + 3 <= len; i++)
+        set_gram(bi.filter, bf->filter_bits, gram_hash(&buf[i]));
+
+    if (ngblocks_store(&bf->blocks, item->index, &bi.info))
+        goto nomem;
+
+    return;
+
+nomem:
+    perror("Building bloom filters");
+    exit(ENOMEM);
+}
+
+static void add_crossing(void *arg, struct ngblock_info *info,
+                         const unsigned char *gram)
+{
+    struct bloom *bf = arg;
+
+    set_gram(container_of(info, struct block_info, info)->filter,
+             bf->filter_bits, gram_hash(gram));
+}
+
+int bloom_save(struct bloom *bf, const char *fpath)
+{
+    struct bloom_header hdr;
+    struct stat st;
+    char *tmp;
+
+    // Filters of a file that changed under the search would be wrong
+    if (stat(bf->input, &st) || st.st_size != bf->st.st_size ||
+        st.st_mtim.tv_sec != bf->st.st_mtim.tv_sec ||
+        st.st_mtim.tv_nsec != bf->st.st_mtim.tv_nsec)
+        return 0;
+
+    if (ngblocks_finish(&bf->blocks, add_crossing, bf))
+        return -1;
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, BLOOM_MAGIC, sizeof(hdr.magic));
+    hdr.dev = bf->st.st_dev;
+    hdr.ino = bf->st.st_ino;
+    hdr.size = bf->st.st_size;
+    hdr.mtime_sec = bf->st.st_mtim.tv_sec;
+    hdr.mtime_nsec = bf->st.st_mtim.tv_nsec;
+    hdr.filter_bits = bf->filter_bits;
+    hdr.hashes = BLOOM_HASHES;
+    hdr.nblocks = bf->blocks.nblocks;
+
+    if (asprintf(&tmp, "%s.%d", fpath, getpid()) < 0)
+        return -1;
+
+    // Written aside and renamed so a search never sees half a sidecar
+    FILE *f = fopen(tmp, "wb");
+    if (f == NULL)
+        goto free_tmp;
+
+    if (fwrite(&hdr, sizeof(hdr), 1, f) != 1)
+        goto close_file;
+
+    for (size_t i = 0; i < hdr.nblocks; i++)
+        if (fwrite(&block(bf, i)->info.b, sizeof(struct ngblock), 1, f) != 1)
+            goto close_file;
+
+    for (size_t i = 0; i < hdr.nblocks; i++)
+        if (fwrite(block(bf, i)->filter, bf->filter_bytes, 1, f) != 1)
+            goto close_file;
+
+    if (fclose(f) || rename(tmp, fpath))
+        goto unlink_tmp;
+
+    free(tmp);
+    return 0;
+
+close_file:
+    fclose(f);
+unlink_tmp:
+    unlink(tmp);
+free_tmp:
+    free(tmp);
+    return -1;
+}
+
+ssize_t bloom_query(struct bloom *bf, const char *phrase,
+                    struct readthrd_range **ranges)
+{
+    const unsigned char *p = (const unsigned char *) phrase;
+    size_t plen = strlen(phrase);
+    size_t ngrams = plen < 3 ? 0 : plen - 2;
+    size_t nblocks = bf->blocks.nblocks;
+    struct ngranges r;
+
+    if (ngranges_init(&r, nblocks, phrase))
+        return -1;
+
+    uint64_t *hashes = malloc((ngrams + 1) * sizeof(*hashes));
+    if (hashes == NULL) {
+        free(r.ranges);
+        return -1;
+    }
+
+    for (size_t i = 0; i < ngrams; i++)
+        hashes[i] = gram_hash(&p[i]);
+
+    size_t bytes = 0;
+    for (size_t b = 0; b < nblocks; b++) {
+        struct block_info *bi = block(bf, b);
+        struct block_info *next = NULL;
+        if (b + 1 < nblocks && block(bf, b + 1)->info.b.contig)
+            next = block(bf, b + 1);
+
+        // A match starting in this chunk could have its last trigrams
+        // in the next one
+        int cand = 1;
+        for (size_t i = 0; i < ngrams && cand; i++)
+            cand = has_gram(bi->filter, bf->filter_bits, hashes[i]) ||
+                (next && has_gram(next->filter, bf->filter_bits, hashes[i]));
+
+        ngranges_add(&r, &bi->info.b, cand);
+        bytes += bi->info.b.bytes;
+    }
+
+    bf->skipped = nblocks - r.candidates;
+    bf->skipped_bytes = bytes - r.candidate_bytes;
+
+    free(hashes);
+    *ranges = r.ranges;
+    return r.count;
+}
+
+void bloom_print(struct bloom *bf, FILE *out)
+{
+    size_t nblocks = bf->blocks.nblocks;
+
+    if (!bf->loaded) {
+        fprintf(out, "Bloom Filters: built for %zu chunks\n", nblocks);
+        return;
+    }
+
+    fprintf(out, "Chunks Skipped: %lu of %zu (%.1f%%, %zu bytes not read)\n",
+            bf->skipped, nblocks,
+            nblocks ? 100.0 * bf->skipped / nblocks : 0.0,
+            bf->skipped_bytes);
+}
+
+void bloom_json(struct bloom *bf, struct json *j)
+{
+    if (bf == NULL) return;
+
+    json_obj_start(j, "bloom");
+    json_bool(j, "built", !bf->loaded);
+    json_uint(j, "chunks", bf->blocks.nblocks);
+    json_uint(j, "skipped_chunks", bf->skipped);
+    json_uint(j, "skipped_bytes", bf->skipped_bytes);
+    json_obj_end(j);
+}
@@ -0,0 +1,74 @@
+////////////////////////////////////////////////////////////////////////
+//
+// Copyright 2015 PMC-Sierra, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you
+// may not use this file except in compliance with the License. You may
+// obtain a copy of the License at
+// http://www.apache.org/licenses/LICENSE-2.0 Unless required by
+// applicable law or agreed to in writing, software distributed under the
+// License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+// CONDITIONS OF ANY KIND, either express or implied. See the License for
+// the specific language governing permissions and limitations under the
+// License.
+//
+////////////////////////////////////////////////////////////////////////
+
+////////////////////////////////////////////////////////////////////////
+//
+//   Author: Logan Gunthorpe
+//
+//   Description:
+//     Sidecar of per-chunk Bloom filters over the trigrams of a file,
+//     built while the file is searched, which later searches use to
+//     skip the chunks that can't hold their phrase.
+//
+////////////////////////////////////////////////////////////////////////
+
+#ifndef BLOOM_H
+#define BLOOM_H
+
+#include "readthrd.h"
+
+#include <sys/stat.h>
+#include <stdio.h>
+#include <stdint.h>
+
+#define BLOOM_MAGIC "TSBLM001"
+
+// Bits set per trigram
+#define BLOOM_HASHES 3
+
+// Load the sidecar of the input with the given stat. Returns NULL with
+// errno set to ENOENT if there isn't one, or ESTALE if the input has
+// changed since it was built, and a full search should rebuild it.
+struct bloom *bloom_open(const char *fpath, const struct stat *st);
+
+// Start a new sidecar for the input. The filters are filled in by the
+// read threads (bloom_visit is the readthrd visit callback) as the
+// whole input is read.
+struct bloom *bloom_new(const char *input, const struct stat *st,
+                        size_t chunk_size);
+void bloom_visit(void *arg, struct readthrd_item *item);
+
+// Write a new sidecar once the input has been read. Nothing is written
+// if the input changed during the search.
+int bloom_save(struct bloom *bf, const char *fpath);
+
+void bloom_free(struct bloom *bf);
+
+// Whether the sidecar was loaded (and can be queried) or is being
+// built
+int bloom_loaded(struct bloom *bf);
+
+// Find the byte ranges to search for phrase: the runs of chunks whose
+// filters hold every trigram of it, extended to take in the matches
+// running into the next chunk. Returns the number of ranges (in
+// *ranges, to be freed) or -1 on error.
+ssize_t bloom_query(struct bloom *bf, const char *phrase,
+                    struct readthrd_range **ranges);
+
+void bloom_print(struct bloom *bf, FILE *out);
+void bloom_json(struct bloom *bf, struct json *j);
+
+#endif
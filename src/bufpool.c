@@ -0,0 +1,328 @@
+////////////////////////////////////////////////////////////////////////
+//
+// Copyright 2015 PMC-Sierra, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you
+// may not use this file except in compliance with the License. You may
+// obtain a copy of the License at
+// http://www.apache.org/licenses/LICENSE-2.0 Unless required by
+// applicable law or agreed to in writing, software distributed under the
+// License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+// CONDITIONS OF ANY KIND, either express or implied. See the License for
+// the specific language governing permissions and limitations under the
+// License.
+//
+////////////////////////////////////////////////////////////////////////
+
+////////////////////////////////////////////////////////////////////////
+//
+//   Author: Logan Gunthorpe
+//
+//   Description:
+//     Pool of pre-faulted, fixed size chunk buffers carved out of a
+//     single (optionally huge page backed) mapping.
+//
+////////////////////////////////////////////////////////////////////////
+
+#include "bufpool.h"
+
+#include <argconfig/suffix.h>
+
+#include <sys/mman.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT 26
+#endif
+
+#define HUGE_2M (2UL << 20)
+#define HUGE_1G (1UL << 30)
+
+// Every buffer starts on a 4K boundary, which also covers the CAPI
+// cacheline alignment
+#define BUF_ALIGN 4096
+
+struct bufpool {
+    char *region;
+    size_t region_len;
+    size_t buf_size;
+    unsigned count;
+
+    enum bufpool_pages pages;
+    size_t page_size;
+
+    void **free_list;
+    unsigned nfree;
+    unsigned min_free;
+    unsigned long waits;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+};
+
+static const char *pages_names[] = {
+    [BUFPOOL_PAGES_4K] = "4k",
+    [BUFPOOL_PAGES_THP] = "thp",
+    [BUFPOOL_PAGES_2M] = "2M",
+    [BUFPOOL_PAGES_1G] = "1G",
+    [BUFPOOL_PAGES_AUTO] = "auto",
+};
+
+int bufpool_parse_pages(const char *name)
+{
+    for (int i = 0; i < sizeof(pages_names) / sizeof(*pages_names); i++)
+        if (strcasecmp(name, pages_names[i]) == 0)
+            return i;
+
+    return -1;
+}
+
+static size_t round_up(size_t x, size_t align)
+{
+    return (x + align - 1) / align * align;
+}
+
+static void *map_hugetlb(size_t *len, size_t page_size, int shift)
+{
+    *len = round_up(*len, page_size);
+
+    // hugetlb pages are reserved at mmap time so this fails cleanly
+    // (instead of with a SIGBUS later) if there aren't enough of them
+    void *p = mmap(NULL, *len, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_POPULATE |
+                   (shift << MAP_HUGE_SHIFT), -1, 0);
+
+    return p == MAP_FAILED ? NULL : p;
+}
+
+// Returns the number of bytes of the mapping containing addr that are
+// backed by transparent huge pages.
+static size_t thp_bytes(void *addr)
+{
+    FILE *f = fopen("/proc/self/smaps", "r");
+    if (f == NULL)
+        return 0;
+
+    char line[512];
+    unsigned long start, end;
+    size_t kb = 0;
+    int in = 0;
+
+    while (fgets(line, sizeof(line), f)) {
+        if (sscanf(line, "%lx-%lx ", &start, &end) == 2) {
+            in = (uintptr_t) addr >= start && (uintptr_t) addr < end;
+            continue;
+        }
+
+        if (in && sscanf(line, "AnonHugePages: %zu kB", &kb) == 1)
+            break;
+    }
+
+    fclose(f);
+    return kb * 1024;
+}
+
+static void *map_thp(size_t *len, size_t *page_size)
+{
+    *len = round_up(*len, HUGE_2M);
+
+    // Over allocate so the region can be aligned to a huge page
+    size_t map_len = *len + HUGE_2M;
+    char *p = mmap(NULL, map_len, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED)
+        return NULL;
+
+    char *aligned = (char *) round_up((uintptr_t) p, HUGE_2M);
+    if (aligned != p)
+        munmap(p, aligned - p);
+    munmap(aligned + *len, p + map_len - (aligned + *len));
+
+    if (madvise(aligned, *len, MADV_HUGEPAGE)) {
+        munmap(aligned, *len);
+        return NULL;
+    }
+
+    // Fault everything in now that the kernel knows to use huge pages
+    long small = sysconf(_SC_PAGESIZE);
+    for (size_t i = 0; i < *len; i += small)
+        aligned[i] = 0;
+
+    *page_size = thp_bytes(aligned) ? HUGE_2M : small;
+
+    return aligned;
+}
+
+static void *map_small(size_t *len, size_t *page_size)
+{
+    *page_size = sysconf(_SC_PAGESIZE);
+    *len = round_up(*len, *page_size);
+
+    void *p = mmap(NULL, *len, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+
+    return p == MAP_FAILED ? NULL : p;
+}
+
+static int map_region(struct bufpool *p, size_t len, enum bufpool_pages pages)
+{
+    if (pages == BUFPOOL_PAGES_AUTO)
+        pages = BUFPOOL_PAGES_2M;
+
+    switch (pages) {
+    case BUFPOOL_PAGES_1G:
+        p->region_len = len;
+        p->region = map_hugetlb(&p->region_len, HUGE_1G, 30);
+        if (p->region != NULL) {
+            p->pages = BUFPOOL_PAGES_1G;
+            p->page_size = HUGE_1G;
+            return 0;
+        }
+        // fall through
+    case BUFPOOL_PAGES_2M:
+        p->region_len = len;
+        p->region = map_hugetlb(&p->region_len, HUGE_2M, 21);
+        if (p->region != NULL) {
+            p->pages = BUFPOOL_PAGES_2M;
+            p->page_size = HUGE_2M;
+            return 0;
+        }
+        // fall through
+    case BUFPOOL_PAGES_THP:
+        p->region_len = len;
+        p->region = map_thp(&p->region_len, &p->page_size);
+        if (p->region != NULL) {
+            p->pages = p->page_size == HUGE_2M ? BUFPOOL_PAGES_THP :
+                BUFPOOL_PAGES_4K;
+            return 0;
+        }
+        // fall through
+    default:
+        p->region_len = len;
+        p->region = map_small(&p->region_len, &p->page_size);
+        p->pages = BUFPOOL_PAGES_4K;
+        return p->region == NULL ? -1 : 0;
+    }
+}
+
+struct bufpool *bufpool_new(size_t buf_size, unsigned count,
+                            enum bufpool_pages pages)
+{
+    struct bufpool *p = calloc(1, sizeof(*p));
+    if (p == NULL)
+        return NULL;
+
+    p->buf_size = round_up(buf_size, BUF_ALIGN);
+    p->count = count;
+
+    p->free_list = calloc(count, sizeof(*p->free_list));
+    if (p->free_list == NULL)
+        goto error_out;
+
+    if (map_region(p, p->buf_size * count, pages))
+        goto error_list_out;
+
+    if (pthread_mutex_init(&p->mutex, NULL))
+        goto error_unmap_out;
+
+    if (pthread_cond_init(&p->cond, NULL))
+        goto error_mutex_out;
+
+    // Hand out the buffers in address order
+    for (unsigned i = 0; i < count; i++)
+        p->free_list[i] = p->region + (size_t) (count - i - 1) * p->buf_size;
+    p->nfree = p->min_free = count;
+
+    return p;
+
+error_mutex_out:
+    pthread_mutex_destroy(&p->mutex);
+error_unmap_out:
+    munmap(p->region, p->region_len);
+error_list_out:
+    free(p->free_list);
+error_out:
+    free(p);
+    return NULL;
+}
+
+void bufpool_free(struct bufpool *p)
+{
+    if (p == NULL) return;
+
+    pthread_cond_destroy(&p->cond);
+    pthread_mutex_destroy(&p->mutex);
+    munmap(p->region, p->region_len);
+    free(p->free_list);
+    free(p);
+}
+
+void *bufpool_get(struct bufpool *p)
+{
+    pthread_mutex_lock(&p->mutex);
+
+    if (p->nfree == 0)
+        p->waits++;
+
+    while (p->nfree == 0)
+        pthread_cond_wait(&p->cond, &p->mutex);
+
+    void *buf = p->free_list[--p->nfree];
+    if (p->nfree < p->min_free)
+        p->min_free = p->nfree;
+
+    pthread_mutex_unlock(&p->mutex);
+
+    return buf;
+}
+
+void bufpool_put(struct bufpool *p, void *buf)
+{
+    pthread_mutex_lock(&p->mutex);
+    p->free_list[p->nfree++] = buf;
+    pthread_cond_signal(&p->cond);
+    pthread_mutex_unlock(&p->mutex);
+}
+
+const char *bufpool_pages_name(struct bufpool *p)
+{
+    return pages_names[p->pages];
+}
+
+size_t bufpool_page_size(struct bufpool *p)
+{
+    return p->page_size;
+}
+
+void bufpool_print(struct bufpool *p, FILE *out)
+{
+    long long size = p->buf_size;
+    long long page = p->page_size;
+    const char *size_suffix = suffix_binary_get(&size);
+    const char *page_suffix = suffix_binary_get(&page);
+
+    fprintf(out, "Buffers:\n  %u x %lld%sB on %lld%sB %s pages, "
+            "peak %u in use, %lu waits\n", p->count, size, size_suffix,
+            page, page_suffix,
+            p->pages == BUFPOOL_PAGES_THP ? "transparent huge" :
+            p->pages == BUFPOOL_PAGES_4K ? "regular" : "hugetlb",
+            p->count - p->min_free, p->waits);
+}
+
+void bufpool_json(struct bufpool *p, struct json *j)
+{
+    if (p == NULL) return;
+
+    json_obj_start(j, "buffers");
+    json_uint(j, "count", p->count);
+    json_uint(j, "size", p->buf_size);
+    json_str(j, "pages", pages_names[p->pages]);
+    json_uint(j, "page_size", p->page_size);
+    json_uint(j, "peak", p->count - p->min_free);
+    json_uint(j, "waits", p->waits);
+    json_obj_end(j);
+}
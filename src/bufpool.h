@@ -0,0 +1,64 @@
+////////////////////////////////////////////////////////////////////////
+//
+// Copyright 2015 PMC-Sierra, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you
+// may not use this file except in compliance with the License. You may
+// obtain a copy of the License at
+// http://www.apache.org/licenses/LICENSE-2.0 Unless required by
+// applicable law or agreed to in writing, software distributed under the
+// License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+// CONDITIONS OF ANY KIND, either express or implied. See the License for
+// the specific language governing permissions and limitations under the
+// License.
+//
+////////////////////////////////////////////////////////////////////////
+
+////////////////////////////////////////////////////////////////////////
+//
+//   Author: Logan Gunthorpe
+//
+//   Description:
+//     Pool of pre-faulted, fixed size chunk buffers carved out of a
+//     single (optionally huge page backed) mapping.
+//
+////////////////////////////////////////////////////////////////////////
+
+#ifndef BUFPOOL_H
+#define BUFPOOL_H
+
+#include "json.h"
+
+#include <stdio.h>
+#include <stddef.h>
+
+enum bufpool_pages {
+    BUFPOOL_PAGES_4K,
+    BUFPOOL_PAGES_THP,
+    BUFPOOL_PAGES_2M,
+    BUFPOOL_PAGES_1G,
+    BUFPOOL_PAGES_AUTO,
+};
+
+// Returns -1 if the name is not recognized
+int bufpool_parse_pages(const char *name);
+
+// Try to back the pool with the requested pages. If they aren't
+// available fall back to the next smaller kind (1G, 2M, THP then
+// regular pages); the kind actually used is reported by
+// bufpool_pages_name() and bufpool_page_size(). AUTO starts at 2M.
+struct bufpool *bufpool_new(size_t buf_size, unsigned count,
+                            enum bufpool_pages pages);
+void bufpool_free(struct bufpool *p);
+
+// Blocks until a buffer is free
+void *bufpool_get(struct bufpool *p);
+void bufpool_put(struct bufpool *p, void *buf);
+
+const char *bufpool_pages_name(struct bufpool *p);
+size_t bufpool_page_size(struct bufpool *p);
+
+void bufpool_print(struct bufpool *p, FILE *out);
+void bufpool_json(struct bufpool *p, struct json *j);
+
+#endif
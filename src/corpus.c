@@ -0,0 +1,439 @@
+////////////////////////////////////////////////////////////////////////
+//
+// Copyright 2015 PMC-Sierra, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you
+// may not use this file except in compliance with the License. You may
+// obtain a copy of the License at
+// http://www.apache.org/licenses/LICENSE-2.0 Unless required by
+// applicable law or agreed to in writing, software distributed under the
+// License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+// CONDITIONS OF ANY KIND, either express or implied. See the License for
+// the specific language governing permissions and limitations under the
+// License.
+//
+////////////////////////////////////////////////////////////////////////
+
+////////////////////////////////////////////////////////////////////////
+//
+//   Author: Logan Gunthorpe
+//
+//   Description:
+//     Haystack corpus generators: random bytes, printable noise,
+//     Zipfian words and syslog/JSON log lines, optionally sprinkled
+//     with near miss variants of the needle.
+//
+////////////////////////////////////////////////////////////////////////
+
+#include "corpus.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#define GOLDEN 0x9E3779B97F4A7C15ULL
+
+// Number of distinct words in the vocabulary and the exponent of the
+// Zipf distribution they are drawn with (roughly that of English text).
+#define VOCAB_SIZE  8192
+#define ZIPF_S      1.07
+#define MAX_WORD    16
+
+// Seeds the synthetic part of the vocabulary so it is the same for
+// every haystack.
+#define VOCAB_KEY   0x766F636162ULL
+#define NEAR_MISS_KEY 0x6E6561726D697373ULL
+
+static const char *mode_names[] = {
+    [CORPUS_RANDOM] = "random",
+    [CORPUS_PRINTABLE] = "printable",
+    [CORPUS_WORDS] = "words",
+    [CORPUS_SYSLOG] = "syslog",
+    [CORPUS_JSON] = "json",
+};
+
+static const char *common_words[] = {
+    "the", "of", "and", "to", "a", "in", "is", "it", "you", "that",
+    "he", "was", "for", "on", "are", "with", "as", "his", "they", "be",
+    "at", "one", "have", "this", "from", "or", "had", "by", "not", "word",
+    "but", "what", "some", "we", "can", "out", "other", "were", "all",
+    "there", "when", "up", "use", "your", "how", "said", "an", "each",
+    "she", "which", "do", "their", "time", "if", "will", "way", "about",
+    "many", "then", "them", "write", "would", "like", "so", "these", "her",
+    "long", "make", "thing", "see", "him", "two", "has", "look", "more",
+    "day", "could", "go", "come", "did", "number", "sound", "no", "most",
+    "people", "my", "over", "know", "water", "than", "call", "first",
+    "who", "may", "down", "side", "been", "now", "find", "any", "new",
+    "work", "part", "take", "get", "place", "made", "live", "where",
+    "after", "back", "little", "only", "round", "man", "year", "came",
+    "show", "every", "good", "me", "give", "our", "under", "name", "very",
+    "through", "just", "form", "sentence", "great", "think", "say",
+    "help", "low", "line", "differ", "turn", "cause", "much", "mean",
+    "before", "move", "right", "boy", "old", "too", "same", "tell",
+    "does", "set", "three", "want", "air", "well", "also", "play",
+    "small", "end", "put", "home", "read", "hand", "port", "large",
+    "spell", "add", "even", "land", "here", "must", "big", "high", "such",
+    "request", "error", "server", "client", "connection", "timeout",
+    "user", "session", "failed", "started", "stopped", "received",
+    "sent", "bytes", "file", "disk", "memory", "process", "thread",
+};
+
+static const char *onsets[] = {
+    "b", "c", "d", "f", "g", "h", "j", "k", "l", "m", "n", "p", "r", "s",
+    "t", "v", "w", "y", "z", "br", "ch", "cl", "cr", "dr", "fl", "gr",
+    "pl", "pr", "sh", "sl", "sp", "st", "str", "th", "tr", "wh", "",
+};
+
+static const char *nuclei[] = {
+    "a", "e", "i", "o", "u", "ai", "ea", "ee", "io", "ou", "oo", "y",
+};
+
+static const char *codas[] = {
+    "", "", "", "n", "r", "s", "t", "l", "nd", "ng", "st", "ck", "rt",
+    "m", "x", "sh", "th",
+};
+
+static const char *hosts[] = {
+    "node01", "node02", "node03", "node04", "node05", "node06", "node07",
+    "node08", "db01", "db02", "web01", "web02", "web03", "cache01",
+};
+
+static const char *services[] = {
+    "sshd", "kernel", "systemd", "cron", "nginx", "postgres", "dockerd",
+    "kubelet", "rsyslogd", "NetworkManager",
+};
+
+static const char *months[] = {
+    "Jan", "Feb", "Mar", "Apr", "May", "Jun",
+    "Jul", "Aug", "Sep", "Oct", "Nov", "Dec",
+};
+
+#define ARRAY_SIZE(x) (sizeof(x) / sizeof(*(x)))
+
+struct corpus {
+    enum corpus_mode mode;
+    const char *phrase;
+    size_t plen;
+    uint64_t near_miss;
+
+    char words[VOCAB_SIZE][MAX_WORD];
+    unsigned char word_len[VOCAB_SIZE];
+    double cdf[VOCAB_SIZE];
+};
+
+struct rng {
+    uint64_t key;
+    uint64_t ctr;
+};
+
+static uint64_t rng_next(struct rng *r)
+{
+    return corpus_mix64(r->key + ++r->ctr * GOLDEN);
+}
+
+static unsigned rng_below(struct rng *r, unsigned n)
+{
+    return rng_next(r) % n;
+}
+
+static double rng_double(struct rng *r)
+{
+    return (rng_next(r) >> 11) * (1.0 / (1ULL << 53));
+}
+
+struct out {
+    char *buf;
+    size_t len;
+    size_t pos;
+};
+
+static void emit(struct out *o, const char *s, size_t n)
+{
+    if (n > o->len - o->pos)
+        n = o->len - o->pos;
+
+    memcpy(o->buf + o->pos, s, n);
+    o->pos += n;
+}
+
+static void emit_str(struct out *o, const char *s)
+{
+    emit(o, s, strlen(s));
+}
+
+int corpus_parse_mode(const char *name)
+{
+    for (int i = 0; i < ARRAY_SIZE(mode_names); i++)
+        if (strcmp(name, mode_names[i]) == 0)
+            return i;
+
+    return -1;
+}
+
+const char *corpus_mode_name(enum corpus_mode mode)
+{
+    return mode_names[mode];
+}
+
+static void build_vocab(struct corpus *c)
+{
+    struct rng r = {.key = VOCAB_KEY};
+    int n = 0;
+
+    for (; n < ARRAY_SIZE(common_words); n++) {
+        strncpy(c->words[n], common_words[n], MAX_WORD - 1);
+        c->word_len[n] = strlen(c->words[n]);
+    }
+
+    while (n < VOCAB_SIZE) {
+        char w[MAX_WORD * 4] = "";
+        int syllables = 1 + rng_below(&r, 3);
+
+        for (int i = 0; i < syllables; i++) {
+            strcat(w, onsets[rng_below(&r, ARRAY_SIZE(onsets))]);
+            strcat(w, nuclei[rng_below(&r, ARRAY_SIZE(nuclei))]);
+            strcat(w, codas[rng_below(&r, ARRAY_SIZE(codas))]);
+        }
+
+        if (strlen(w) >= MAX_WORD)
+            continue;
+
+        strcpy(c->words[n], w);
+        c->word_len[n] = strlen(w);
+        n++;
+    }
+
+    double total = 0;
+    for (int i = 0; i < VOCAB_SIZE; i++) {
+        total += 1.0 / pow(i + 1, ZIPF_S);
+        c->cdf[i] = total;
+    }
+
+    for (int i = 0; i < VOCAB_SIZE; i++)
+        c->cdf[i] /= total;
+}
+
+struct corpus *corpus_new(enum corpus_mode mode, const char *phrase,
+                          double near_miss)
+{
+    struct corpus *c = malloc(sizeof(*c));
+    if (c == NULL)
+        return NULL;
+
+    c->mode = mode;
+    c->phrase = phrase;
+    c->plen = strlen(phrase);
+
+    if (c->plen < 2 || near_miss <= 0)
+        c->near_miss = 0;
+    else if (near_miss >= 1)
+        c->near_miss = UINT64_MAX;
+    else
+        c->near_miss = near_miss * 18446744073709551616.0;
+
+    if (mode >= CORPUS_WORDS)
+        build_vocab(c);
+
+    return c;
+}
+
+void corpus_free(struct corpus *c)
+{
+    free(c);
+}
+
+// A near miss shares at least half of the phrase as a prefix and then
+// differs in the next character. Half of them carry on with the rest
+// of the phrase so the mismatch is a single substituted character.
+static size_t near_miss(const struct corpus *c, struct rng *r, char *buf)
+{
+    size_t min = (c->plen + 1) / 2;
+    size_t k = min + rng_below(r, c->plen - min);
+
+    memcpy(buf, c->phrase, k);
+
+    char x = c->phrase[k];
+    if ((x | 0x20) >= 'a' && (x | 0x20) <= 'z')
+        x ^= 0x20;
+    else
+        x = x == '~' ? '!' : x + 1;
+    buf[k] = x;
+
+    if (rng_next(r) & 1) {
+        memcpy(buf + k + 1, c->phrase + k + 1, c->plen - k - 1);
+        return c->plen;
+    }
+
+    return k + 1;
+}
+
+static int is_near_miss(const struct corpus *c, struct rng *r)
+{
+    return c->near_miss && rng_next(r) < c->near_miss;
+}
+
+static void make_printable(uint64_t *x)
+{
+    *x &= ~0x8080808080808080ULL;
+
+    char *c = (char *) x;
+    for (int i = 0; i < sizeof(*x); i++) {
+        if (c[i] < '\n')
+            c[i] = '\n';
+        else if (c[i] < ' ')
+            c[i] = ' ';
+        else if (c[i] > 0x7e)
+            c[i] = ' ';
+    }
+}
+
+static void fill_random(const struct corpus *c, uint64_t key, char *buf,
+                        size_t len)
+{
+    size_t words = (len + sizeof(uint64_t) - 1) / sizeof(uint64_t);
+
+    for (size_t i = 0; i < words; i++) {
+        uint64_t x = corpus_mix64(key + i * GOLDEN);
+        if (c->mode == CORPUS_PRINTABLE)
+            make_printable(&x);
+
+        size_t n = len - i * sizeof(x);
+        memcpy(buf + i * sizeof(x), &x, n < sizeof(x) ? n : sizeof(x));
+    }
+
+    if (!c->near_miss)
+        return;
+
+    // Near misses use their own stream so a given seed produces the
+    // same noise regardless of the rate.
+    struct rng r = {.key = key ^ NEAR_MISS_KEY};
+    char tmp[c->plen];
+    for (size_t i = 0; i < words; i++) {
+        if (!is_near_miss(c, &r))
+            continue;
+
+        struct out o = {.buf = buf, .len = len, .pos = i * sizeof(uint64_t)};
+        emit(&o, tmp, near_miss(c, &r, tmp));
+    }
+}
+
+static void emit_word(const struct corpus *c, struct rng *r, struct out *o,
+                      int capital)
+{
+    char tmp[c->plen > MAX_WORD ? c->plen : MAX_WORD];
+
+    if (is_near_miss(c, r)) {
+        emit(o, tmp, near_miss(c, r, tmp));
+        return;
+    }
+
+    double u = rng_double(r);
+    size_t lo = 0, hi = VOCAB_SIZE - 1;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (c->cdf[mid] < u)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    memcpy(tmp, c->words[lo], c->word_len[lo]);
+    if (capital)
+        tmp[0] &= ~0x20;
+    emit(o, tmp, c->word_len[lo]);
+}
+
+static void emit_message(const struct corpus *c, struct rng *r, struct out *o)
+{
+    int words = 4 + rng_below(r, 13);
+
+    for (int i = 0; i < words; i++) {
+        if (i)
+            emit(o, " ", 1);
+        emit_word(c, r, o, 0);
+    }
+}
+
+static void fill_words(const struct corpus *c, struct rng *r, struct out *o)
+{
+    while (o->pos < o->len) {
+        int words = 4 + rng_below(r, 16);
+
+        for (int i = 0; i < words; i++) {
+            if (i)
+                emit_str(o, rng_below(r, 12) ? " " : ", ");
+            emit_word(c, r, o, i == 0);
+        }
+
+        emit_str(o, rng_below(r, 8) ? ". " : ".\n");
+    }
+}
+
+static void fill_syslog(const struct corpus *c, struct rng *r, struct out *o)
+{
+    char tmp[128];
+    unsigned t = rng_below(r, 365 * 86400);
+
+    while (o->pos < o->len) {
+        t += rng_below(r, 3);
+
+        snprintf(tmp, sizeof(tmp), "%s %2u %02u:%02u:%02u %s %s[%u]: ",
+                 months[t / (31 * 86400) % 12], 1 + t / 86400 % 28,
+                 t / 3600 % 24, t / 60 % 60, t % 60,
+                 hosts[rng_below(r, ARRAY_SIZE(hosts))],
+                 services[rng_below(r, ARRAY_SIZE(services))],
+                 100 + rng_below(r, 32000));
+        emit_str(o, tmp);
+        emit_message(c, r, o);
+        emit(o, "\n", 1);
+    }
+}
+
+static void fill_json(const struct corpus *c, struct rng *r, struct out *o)
+{
+    static const char *levels[] = {
+        "info", "info", "info", "info", "info", "info", "debug", "debug",
+        "warn", "error",
+    };
+    char tmp[160];
+    uint64_t t = 1600000000000ULL + rng_next(r) % 100000000000ULL;
+
+    while (o->pos < o->len) {
+        t += rng_below(r, 1000);
+
+        snprintf(tmp, sizeof(tmp),
+                 "{\"ts\":%llu.%03u,\"level\":\"%s\",\"host\":\"%s\","
+                 "\"service\":\"%s\",\"pid\":%u,\"msg\":\"",
+                 (unsigned long long) t / 1000, (unsigned) (t % 1000),
+                 levels[rng_below(r, ARRAY_SIZE(levels))],
+                 hosts[rng_below(r, ARRAY_SIZE(hosts))],
+                 services[rng_below(r, ARRAY_SIZE(services))],
+                 100 + rng_below(r, 32000));
+        emit_str(o, tmp);
+        emit_message(c, r, o);
+        emit_str(o, "\"}\n");
+    }
+}
+
+void corpus_fill(const struct corpus *c, uint64_t key, char *buf, size_t len)
+{
+    struct rng r = {.key = key};
+    struct out o = {.buf = buf, .len = len};
+
+    switch (c->mode) {
+    case CORPUS_RANDOM:
+    case CORPUS_PRINTABLE:
+        fill_random(c, key, buf, len);
+        break;
+    case CORPUS_WORDS:
+        fill_words(c, &r, &o);
+        break;
+    case CORPUS_SYSLOG:
+        fill_syslog(c, &r, &o);
+        break;
+    case CORPUS_JSON:
+        fill_json(c, &r, &o);
+        break;
+    }
+}
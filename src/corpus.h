@@ -0,0 +1,69 @@
+////////////////////////////////////////////////////////////////////////
+//
+// Copyright 2015 PMC-Sierra, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you
+// may not use this file except in compliance with the License. You may
+// obtain a copy of the License at
+// http://www.apache.org/licenses/LICENSE-2.0 Unless required by
+// applicable law or agreed to in writing, software distributed under the
+// License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+// CONDITIONS OF ANY KIND, either express or implied. See the License for
+// the specific language governing permissions and limitations under the
+// License.
+//
+////////////////////////////////////////////////////////////////////////
+
+////////////////////////////////////////////////////////////////////////
+//
+//   Author: Logan Gunthorpe
+//
+//   Description:
+//     Haystack corpus generators: random bytes, printable noise,
+//     Zipfian words and syslog/JSON log lines, optionally sprinkled
+//     with near miss variants of the needle.
+//
+////////////////////////////////////////////////////////////////////////
+
+#ifndef CORPUS_H
+#define CORPUS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+enum corpus_mode {
+    CORPUS_RANDOM,
+    CORPUS_PRINTABLE,
+    CORPUS_WORDS,
+    CORPUS_SYSLOG,
+    CORPUS_JSON,
+};
+
+// Counter based generator: the value for any (key, counter) pair can
+// be computed directly so every block can be generated independently.
+static inline uint64_t corpus_mix64(uint64_t z)
+{
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+struct corpus;
+
+// Returns -1 if the name is not recognized
+int corpus_parse_mode(const char *name);
+const char *corpus_mode_name(enum corpus_mode mode);
+
+// near_miss is the probability that any given word (or 8 byte word
+// in the random modes) is replaced with a variant of the phrase that
+// shares a prefix with it but never matches. The phrase must be at
+// least two characters long for near misses to be generated.
+struct corpus *corpus_new(enum corpus_mode mode, const char *phrase,
+                          double near_miss);
+void corpus_free(struct corpus *c);
+
+// Fill buf with len bytes of the corpus. The output only depends on
+// the key so blocks can be generated in any order.
+void corpus_fill(const struct corpus *c, uint64_t key, char *buf, size_t len);
+
+#endif
@@ -0,0 +1,329 @@
+////////////////////////////////////////////////////////////////////////
+//
+// Copyright 2015 PMC-Sierra, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you
+// may not use this file except in compliance with the License. You may
+// obtain a copy of the License at
+// http://www.apache.org/licenses/LICENSE-2.0 Unless required by
+// applicable law or agreed to in writing, software distributed under the
+// License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+// CONDITIONS OF ANY KIND, either express or implied. See the License for
+// the specific language governing permissions and limitations under the
+// License.
+//
+////////////////////////////////////////////////////////////////////////
+
+////////////////////////////////////////////////////////////////////////
+//
+//   Author: Logan Gunthorpe
+//
+//   Description:
+//     In process sampler which periodically reads the per thread CPU
+//     time, context switches and page faults from /proc/self/task and
+//     writes them out as a time series labelled by pipeline role.
+//
+////////////////////////////////////////////////////////////////////////
+
+#include "cpusample.h"
+#include "stats.h"
+
+#include <sys/types.h>
+#include <sys/syscall.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+
+#define MAX_THREADS 256
+
+struct role {
+    pid_t tid;
+    const char *role;
+    int index;
+};
+
+static struct role roles[MAX_THREADS];
+static int num_roles;
+static pthread_mutex_t roles_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+struct task_sample {
+    pid_t tid;
+    unsigned long utime, stime;
+    unsigned long vcsw, ivcsw;
+    unsigned long minflt, majflt;
+};
+
+struct cpusample {
+    FILE *out;
+    unsigned interval_ms;
+    double start;
+    double last_time;
+    long clk_tck;
+    long page_size;
+
+    struct task_sample last[MAX_THREADS];
+    int num_last;
+
+    int stop;
+    pthread_t thrd;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+};
+
+void cpusample_register(const char *role, int index)
+{
+    pid_t tid = syscall(SYS_gettid);
+
+    pthread_mutex_lock(&roles_mutex);
+    if (num_roles < MAX_THREADS) {
+        roles[num_roles].tid = tid;
+        roles[num_roles].role = role;
+        roles[num_roles].index = index;
+        num_roles++;
+    }
+    pthread_mutex_unlock(&roles_mutex);
+}
+
+static const struct role *find_role(pid_t tid)
+{
+    static const struct role main_role = {.role = "main"};
+    static const struct role other_role = {.role = "other"};
+    const struct role *ret = &other_role;
+
+    if (tid == getpid())
+        return &main_role;
+
+    pthread_mutex_lock(&roles_mutex);
+    // Search backwards so a recycled tid finds its newest owner
+    for (int i = num_roles - 1; i >= 0; i--) {
+        if (roles[i].tid == tid) {
+            ret = &roles[i];
+            break;
+        }
+    }
+    pthread_mutex_unlock(&roles_mutex);
+
+    return ret;
+}
+
+static int read_task(pid_t tid, struct task_sample *s)
+{
+    char path[64];
+    char buf[1024];
+
+    s->tid = tid;
+
+    snprintf(path, sizeof(path), "/proc/self/task/%d/stat", tid);
+    FILE *f = fopen(path, "r");
+    if (f == NULL)
+        return -1;
+
+    size_t n = fread(buf, 1, sizeof(buf) - 1, f);
+    fclose(f);
+    buf[n] = 0;
+
+    // The command name may contain spaces so skip past its last ')'
+    char *p = strrchr(buf, ')');
+    if (p == NULL ||
+        sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %lu %*u %lu %*u %lu %lu",
+               &s->minflt, &s->majflt, &s->utime, &s->stime) != 4)
+        return -1;
+
+    snprintf(path, sizeof(path), "/proc/self/task/%d/status", tid);
+    f = fopen(path, "r");
+    if (f == NULL)
+        return -1;
+
+    s->vcsw = s->ivcsw = 0;
+    while (fgets(buf, sizeof(buf), f) != NULL) {
+        sscanf(buf, "voluntary_ctxt_switches: %lu", &s->vcsw);
+        sscanf(buf, "nonvoluntary_ctxt_switches: %lu", &s->ivcsw);
+    }
+    fclose(f);
+
+    return 0;
+}
+
+static unsigned long read_rss(struct cpusample *cs)
+{
+    unsigned long size, resident = 0;
+
+    FILE *f = fopen("/proc/self/statm", "r");
+    if (f == NULL)
+        return 0;
+
+    if (fscanf(f, "%lu %lu", &size, &resident) != 2)
+        resident = 0;
+    fclose(f);
+
+    return resident * cs->page_size;
+}
+
+static struct task_sample *find_last(struct cpusample *cs, pid_t tid)
+{
+    for (int i = 0; i < cs->num_last; i++)
+        if (cs->last[i].tid == tid)
+            return &cs->last[i];
+
+    return NULL;
+}
+
+// Threads that already exist when sampling starts are measured from
+// here, not from their creation, so the first interval only shows what
+// they did during it
+static void baseline(struct cpusample *cs)
+{
+    DIR *d = opendir("/proc/self/task");
+    if (d == NULL)
+        return;
+
+    struct dirent *de;
+    while ((de = readdir(d)) != NULL && cs->num_last < MAX_THREADS) {
+        pid_t tid = atoi(de->d_name);
+        if (tid > 0 && !read_task(tid, &cs->last[cs->num_last]))
+            cs->num_last++;
+    }
+    closedir(d);
+}
+
+static void sample(struct cpusample *cs)
+{
+    static const struct task_sample zero;
+    struct task_sample cur[MAX_THREADS];
+    int num_cur = 0;
+
+    double now = stats_now();
+    double dt = now - cs->last_time;
+    double t = now - cs->start;
+    cs->last_time = now;
+
+    DIR *d = opendir("/proc/self/task");
+    if (d == NULL)
+        return;
+
+    struct dirent *de;
+    while ((de = readdir(d)) != NULL && num_cur < MAX_THREADS) {
+        pid_t tid = atoi(de->d_name);
+        if (tid <= 0 || read_task(tid, &cur[num_cur]))
+            continue;
+
+        struct task_sample *s = &cur[num_cur++];
+        const struct task_sample *l = find_last(cs, tid);
+        // A thread started since the last sample did all its work in
+        // this interval
+        if (l == NULL)
+            l = &zero;
+
+        const struct role *r = find_role(tid);
+        double ticks = cs->clk_tck * dt;
+
+        fprintf(cs->out, "%8.2f  %-16s %3d %7d %6.1f %6.1f %7lu %7lu %7lu %7lu\n",
+                t, r->role, r->index, tid,
+                100. * (s->utime - l->utime) / ticks,
+                100. * (s->stime - l->stime) / ticks,
+                s->vcsw - l->vcsw, s->ivcsw - l->ivcsw,
+                s->minflt - l->minflt, s->majflt - l->majflt);
+    }
+    closedir(d);
+
+    fprintf(cs->out, "%8.2f  %-16s %3s %7d %6s %6s %7s %7s %7s %7s  %lu\n",
+            t, "process", "-", getpid(), "-", "-", "-", "-", "-", "-",
+            read_rss(cs));
+    fflush(cs->out);
+
+    memcpy(cs->last, cur, num_cur * sizeof(*cur));
+    cs->num_last = num_cur;
+}
+
+static void *sample_thread(void *arg)
+{
+    struct cpusample *cs = arg;
+    struct timespec deadline;
+
+    cpusample_register("cpusample", 0);
+
+    clock_gettime(CLOCK_REALTIME, &deadline);
+
+    pthread_mutex_lock(&cs->mutex);
+    while (!cs->stop) {
+        deadline.tv_nsec += (cs->interval_ms % 1000) * 1000000L;
+        deadline.tv_sec += cs->interval_ms / 1000 +
+            deadline.tv_nsec / 1000000000L;
+        deadline.tv_nsec %= 1000000000L;
+
+        while (!cs->stop &&
+               pthread_cond_timedwait(&cs->cond, &cs->mutex, &deadline) != ETIMEDOUT);
+
+        if (!cs->stop)
+            sample(cs);
+    }
+    pthread_mutex_unlock(&cs->mutex);
+
+    return NULL;
+}
+
+struct cpusample *cpusample_start(const char *fpath, unsigned interval_ms)
+{
+    struct cpusample *cs = calloc(1, sizeof(*cs));
+    if (cs == NULL)
+        return NULL;
+
+    cs->out = fopen(fpath, "w");
+    if (cs->out == NULL) {
+        fprintf(stderr, "Unable to open '%s': %s\n", fpath, strerror(errno));
+        goto error_out;
+    }
+
+    cs->interval_ms = interval_ms ? interval_ms : 1;
+    cs->clk_tck = sysconf(_SC_CLK_TCK);
+    cs->page_size = sysconf(_SC_PAGESIZE);
+    cs->start = cs->last_time = stats_now();
+    baseline(cs);
+
+    fprintf(cs->out, "#%7s  %-16s %3s %7s %6s %6s %7s %7s %7s %7s  %s\n",
+            "TIME", "ROLE", "IDX", "TID", "USR%", "SYS%", "VCSW", "IVCSW",
+            "MINFLT", "MAJFLT", "RSS");
+
+    if (pthread_mutex_init(&cs->mutex, NULL))
+        goto error_close_out;
+
+    if (pthread_cond_init(&cs->cond, NULL))
+        goto error_mutex_out;
+
+    if (pthread_create(&cs->thrd, NULL, sample_thread, cs))
+        goto error_cond_out;
+
+    return cs;
+
+error_cond_out:
+    pthread_cond_destroy(&cs->cond);
+error_mutex_out:
+    pthread_mutex_destroy(&cs->mutex);
+error_close_out:
+    fclose(cs->out);
+error_out:
+    free(cs);
+    return NULL;
+}
+
+void cpusample_stop(struct cpusample *cs)
+{
+    if (cs == NULL) return;
+
+    pthread_mutex_lock(&cs->mutex);
+    cs->stop = 1;
+    pthread_cond_signal(&cs->cond);
+    pthread_mutex_unlock(&cs->mutex);
+
+    pthread_join(cs->thrd, NULL);
+    pthread_cond_destroy(&cs->cond);
+    pthread_mutex_destroy(&cs->mutex);
+    fclose(cs->out);
+    free(cs);
+}
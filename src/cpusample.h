@@ -0,0 +1,39 @@
+////////////////////////////////////////////////////////////////////////
+//
+// Copyright 2015 PMC-Sierra, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you
+// may not use this file except in compliance with the License. You may
+// obtain a copy of the License at
+// http://www.apache.org/licenses/LICENSE-2.0 Unless required by
+// applicable law or agreed to in writing, software distributed under the
+// License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+// CONDITIONS OF ANY KIND, either express or implied. See the License for
+// the specific language governing permissions and limitations under the
+// License.
+//
+////////////////////////////////////////////////////////////////////////
+
+////////////////////////////////////////////////////////////////////////
+//
+//   Author: Logan Gunthorpe
+//
+//   Description:
+//     In process sampler which periodically reads the per thread CPU
+//     time, context switches and page faults from /proc/self/task and
+//     writes them out as a time series labelled by pipeline role.
+//
+////////////////////////////////////////////////////////////////////////
+
+#ifndef CPUSAMPLE_H
+#define CPUSAMPLE_H
+
+// Label the calling thread. The role string must remain valid for the
+// life of the process. Threads which never register are reported as
+// "other".
+void cpusample_register(const char *role, int index);
+
+struct cpusample *cpusample_start(const char *fpath, unsigned interval_ms);
+void cpusample_stop(struct cpusample *cs);
+
+#endif
@@ -0,0 +1,248 @@
+////////////////////////////////////////////////////////////////////////
+//
+// Copyright 2015 PMC-Sierra, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you
+// may not use this file except in compliance with the License. You may
+// obtain a copy of the License at
+// http://www.apache.org/licenses/LICENSE-2.0 Unless required by
+// applicable law or agreed to in writing, software distributed under the
+// License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+// CONDITIONS OF ANY KIND, either express or implied. See the License for
+// the specific language governing permissions and limitations under the
+// License.
+//
+////////////////////////////////////////////////////////////////////////
+
+////////////////////////////////////////////////////////////////////////
+//
+//   Author: Logan Gunthorpe
+//
+//   Description:
+//     List of the input files to scan in one session, built from the
+//     command line, directory trees and file lists.
+//
+////////////////////////////////////////////////////////////////////////
+
+#include "filelist.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <dirent.h>
+
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+
+void filelist_init(struct filelist *fl)
+{
+    memset(fl, 0, sizeof(*fl));
+}
+
+void filelist_free(struct filelist *fl)
+{
+    for (unsigned i = 0; i < fl->count; i++)
+        free(fl->files[i].path);
+
+    free(fl->files);
+    filelist_init(fl);
+}
+
+static int append(struct filelist *fl, const char *path, size_t size)
+{
+    if (fl->count == fl->alloc) {
+        unsigned alloc = fl->alloc ? fl->alloc * 2 : 64;
+        struct filelist_file *files = realloc(fl->files,
+                                              alloc * sizeof(*files));
+        if (files == NULL)
+            return -1;
+
+        fl->files = files;
+        fl->alloc = alloc;
+    }
+
+    struct filelist_file *f = &fl->files[fl->count];
+    f->path = strdup(path);
+    if (f->path == NULL)
+        return -1;
+
+    f->size = size;
+    f->matches = 0;
+
+    fl->count++;
+    fl->total_size += size;
+    return 0;
+}
+
+static int cmp_names(const void *a, const void *b)
+{
+    return strcmp(*(char * const *) a, *(char * const *) b);
+}
+
+// Like grep -r, unreadable entries below the top directory are
+// skipped with a warning rather than failing the whole scan
+static int add_dir(struct filelist *fl, const char *path, int top)
+{
+    DIR *dir = opendir(path);
+    if (dir == NULL && top) {
+        fprintf(stderr, "Unable to open '%s': %s\n", path, strerror(errno));
+        return -1;
+    } else if (dir == NULL) {
+        fprintf(stderr, "Skipping '%s': %s\n", path, strerror(errno));
+        return 0;
+    }
+
+    char **names = NULL;
+    size_t count = 0, alloc = 0;
+    struct dirent *de;
+    int ret = -1;
+
+    while ((de = readdir(dir)) != NULL) {
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+            continue;
+
+        if (count == alloc) {
+            alloc = alloc ? alloc * 2 : 64;
+            char **n = realloc(names, alloc * sizeof(*names));
+            if (n == NULL)
+                goto out;
+            names = n;
+        }
+
+        names[count] = strdup(de->d_name);
+        if (names[count] == NULL)
+            goto out;
+        count++;
+    }
+
+    // readdir's order depends on the filesystem, scan in name order
+    // so the results are the same everywhere
+    qsort(names, count, sizeof(*names), cmp_names);
+
+    ret = 0;
+    for (size_t i = 0; i < count && !ret; i++) {
+        char *p;
+        if (asprintf(&p, "%s/%s", path, names[i]) < 0) {
+            ret = -1;
+            break;
+        }
+
+        // Symlinked directories aren't followed so a loop can't be
+        // walked forever, symlinked files are scanned.
+        struct stat ls, st;
+        if (lstat(p, &ls) || stat(p, &st)) {
+            fprintf(stderr, "Skipping '%s': %s\n", p, strerror(errno));
+        } else if (S_ISDIR(st.st_mode)) {
+            if (!S_ISLNK(ls.st_mode))
+                ret = add_dir(fl, p, 0);
+        } else if (S_ISREG(st.st_mode)) {
+            ret = append(fl, p, st.st_size);
+        }
+
+        free(p);
+    }
+
+out:
+    for (size_t i = 0; i < count; i++)
+        free(names[i]);
+    free(names);
+    closedir(dir);
+    return ret;
+}
+
+int filelist_add(struct filelist *fl, const char *path)
+{
+    struct stat st;
+
+    // stdin is streamed, on its own
+    if (strcmp(path, "-") == 0) {
+        fl->special = 1;
+        return append(fl, path, 0);
+    }
+
+    if (stat(path, &st)) {
+        fprintf(stderr, "Unable to open '%s': %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    if (S_ISDIR(st.st_mode)) {
+        fl->expanded = 1;
+        return add_dir(fl, path, 1);
+    }
+
+    if (!S_ISREG(st.st_mode))
+        fl->special = 1;
+
+    return append(fl, path, st.st_size);
+}
+
+int filelist_read(struct filelist *fl, const char *list)
+{
+    FILE *f = stdin;
+    char *line = NULL;
+    size_t len = 0;
+    ssize_t rd;
+    int ret = 0;
+
+    if (strcmp(list, "-") != 0) {
+        f = fopen(list, "r");
+        if (f == NULL) {
+            fprintf(stderr, "Unable to open '%s': %s\n", list,
+                    strerror(errno));
+            return -1;
+        }
+    }
+
+    fl->expanded = 1;
+
+    while ((rd = getline(&line, &len, f)) > 0) {
+        if (line[rd - 1] == '\n')
+            line[--rd] = 0;
+        if (!rd)
+            continue;
+
+        if (filelist_add(fl, line)) {
+            ret = -1;
+            break;
+        }
+    }
+
+    free(line);
+    if (f != stdin)
+        fclose(f);
+
+    return ret;
+}
+
+void filelist_print_matches(struct filelist *fl, FILE *out)
+{
+    unsigned with = 0;
+
+    for (unsigned i = 0; i < fl->count; i++)
+        if (fl->files[i].matches)
+            with++;
+
+    fprintf(out, "Files: %u (%u with matches)\n", fl->count, with);
+
+    for (unsigned i = 0; i < fl->count; i++)
+        if (fl->files[i].matches)
+            fprintf(out, "  %s: %lu\n", fl->files[i].path,
+                    fl->files[i].matches);
+}
+
+void filelist_json(struct filelist *fl, struct json *j)
+{
+    json_uint(j, "files_scanned", fl->count);
+
+    json_arr_start(j, "files");
+    for (unsigned i = 0; i < fl->count; i++) {
+        if (!fl->files[i].matches)
+            continue;
+
+        json_obj_start(j, NULL);
+        json_str(j, "path", fl->files[i].path);
+        json_uint(j, "matches", fl->files[i].matches);
+        json_obj_end(j);
+    }
+    json_arr_end(j);
+}
@@ -0,0 +1,73 @@
+////////////////////////////////////////////////////////////////////////
+//
+// Copyright 2015 PMC-Sierra, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you
+// may not use this file except in compliance with the License. You may
+// obtain a copy of the License at
+// http://www.apache.org/licenses/LICENSE-2.0 Unless required by
+// applicable law or agreed to in writing, software distributed under the
+// License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+// CONDITIONS OF ANY KIND, either express or implied. See the License for
+// the specific language governing permissions and limitations under the
+// License.
+//
+////////////////////////////////////////////////////////////////////////
+
+////////////////////////////////////////////////////////////////////////
+//
+//   Author: Logan Gunthorpe
+//
+//   Description:
+//     List of the input files to scan in one session, built from the
+//     command line, directory trees and file lists.
+//
+////////////////////////////////////////////////////////////////////////
+
+#ifndef FILELIST_H
+#define FILELIST_H
+
+#include "json.h"
+
+#include <stdio.h>
+#include <stddef.h>
+
+struct filelist_file {
+    char *path;
+    size_t size;
+
+    // Only updated by the writethrd's completion thread
+    unsigned long matches;
+};
+
+struct filelist {
+    struct filelist_file *files;
+    unsigned count;
+    unsigned alloc;
+    size_t total_size;
+
+    // Set once a directory or file list has been added, the files can
+    // then no longer be treated as a single input
+    int expanded;
+
+    // Set if stdin, a block device or other special file was added,
+    // it can only be scanned on its own
+    int special;
+};
+
+void filelist_init(struct filelist *fl);
+void filelist_free(struct filelist *fl);
+
+// Add a regular file or, recursively and in name order, every regular
+// file under a directory. Returns -1 if path can't be added.
+int filelist_add(struct filelist *fl, const char *path);
+
+// Add every path listed, one per line, in the file list ("-" for
+// stdin).
+int filelist_read(struct filelist *fl, const char *list);
+
+// Print (and emit in JSON) the files that had at least one match
+void filelist_print_matches(struct filelist *fl, FILE *out);
+void filelist_json(struct filelist *fl, struct json *j);
+
+#endif
@@ -26,15 +26,30 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
 #include <time.h>
 #include <errno.h>
+#include <limits.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
 
 #include <argconfig/argconfig.h>
 #include <capi/capi.h>
 
+#include "corpus.h"
+
 #define CAPI_CACHELINE_MASK (CAPI_CACHELINE_BYTES-1)
 
+// The output is generated in fixed size blocks, each with its own
+// random stream, so this must not change or existing seeds will
+// produce different files.
+#define BLOCK_SIZE (1 << 20)
+
 const char program_desc[]  =
     "Generate a haystack of random data with needle strings in it";
 
@@ -45,19 +60,31 @@ struct config {
     char *phrase;
     int disallow_cacheline_spanning;
     int printable;
+    char *corpus;
+    double near_miss;
+    unsigned threads;
+    char *manifest;
+    int no_manifest;
 };
 
 static const struct config defaults = {
     .insert = 50,
     .seed = -1,
     .phrase = "GoPower8",
+    .corpus = "random",
     .size = 1024*1024*16,
+    .threads = 4,
 };
 
 static const struct argconfig_commandline_options command_line_options[] = {
     {"C",           "", CFG_NONE, &defaults.disallow_cacheline_spanning, no_argument, NULL},
     {"cacheline",   "", CFG_NONE, &defaults.disallow_cacheline_spanning, no_argument,
             "do not insert phrase across cachelines"},
+    {"m",           "FILE", CFG_STRING, &defaults.manifest, required_argument, NULL},
+    {"manifest",    "FILE", CFG_STRING, &defaults.manifest, required_argument,
+            "file to list the needle offsets in (default: OUTPUT_FILE.manifest)"},
+    {"no-manifest", "", CFG_NONE, &defaults.no_manifest, no_argument,
+            "do not write a manifest of the needle offsets"},
     {"i",           "NUM",  CFG_POSITIVE, &defaults.insert, required_argument, NULL},
     {"insert",      "NUM",  CFG_POSITIVE, &defaults.insert, required_argument,
             "the number of times to insert 'phrase'"},
@@ -67,99 +94,234 @@ static const struct argconfig_commandline_options command_line_options[] = {
     {"P",           "", CFG_NONE, &defaults.printable, no_argument, NULL},
     {"printable",   "", CFG_NONE, &defaults.printable, no_argument,
             "only insert printable characters into the random data"},
+    {"c",           "MODE", CFG_STRING, &defaults.corpus, required_argument, NULL},
+    {"corpus",      "MODE", CFG_STRING, &defaults.corpus, required_argument,
+            "haystack contents: random, printable, words, syslog or json"},
+    {"n",           "RATE", CFG_DOUBLE, &defaults.near_miss, required_argument, NULL},
+    {"near-miss",   "RATE", CFG_DOUBLE, &defaults.near_miss, required_argument,
+            "fraction of words replaced by near miss variants of the phrase"},
     {"seed",        "NUM", CFG_INT, &defaults.seed, required_argument,
             "random number seed, set <0 for random seed"},
     {"s",          "NUM",  CFG_LONG_SUFFIX, &defaults.size, required_argument, NULL},
     {"size",       "NUM",  CFG_LONG_SUFFIX, &defaults.size, required_argument,
             "file size to generate"},
+    {"t",          "NUM",  CFG_POSITIVE, &defaults.threads, required_argument, NULL},
+    {"threads",    "NUM",  CFG_POSITIVE, &defaults.threads, required_argument,
+            "number of threads generating data"},
     {0}
 };
 
-static void make_printable(int *x)
+static uint64_t block_key(uint64_t seed, size_t block)
+{
+    return corpus_mix64(seed ^ corpus_mix64(block * 0x9E3779B97F4A7C15ULL + 1));
+}
+
+struct generator {
+    const struct config *cfg;
+    int fd;
+    int seekable;
+    uint64_t seed;
+    struct corpus *corpus;
+    size_t *locs;
+    size_t plen;
+    size_t num_blocks;
+    size_t next_block;
+    size_t wrote;
+};
+
+// Needles are placed one per stratum (the file is divided into
+// 'insert' equal slices) so the locations come out sorted and can never
+// overlap. Each location only depends on the seed and the needle index.
+static int place_needle(const struct config *cfg, uint64_t seed,
+                        size_t n, size_t plen, size_t *pos)
 {
-    *x &= ~0x8080808080808080;
+    size_t width = cfg->size / cfg->insert;
+    size_t lo = n * width;
+    size_t hi = lo + width - plen;
+
+    size_t p = lo + corpus_mix64(seed ^ corpus_mix64(~(uint64_t) n)) % (hi - lo + 1);
 
-    char *c = (char *) x;
-    for (int i = 0; i < sizeof(*x); i++) {
-        if (c[i] < '\n')
-            c[i] = '\n';
-        else if (c[i] < ' ')
-            c[i] = ' ';
-        else if (c[i] > 0x7e)
-            c[i] = ' ';
+    if (cfg->disallow_cacheline_spanning &&
+        (p & ~CAPI_CACHELINE_MASK) != ((p + plen - 1) & ~CAPI_CACHELINE_MASK))
+    {
+        size_t next_line = (p | CAPI_CACHELINE_MASK) + 1;
+        if (next_line - plen >= lo)
+            p = next_line - plen;
+        else if (next_line <= hi)
+            p = next_line;
+        else
+            return -1;
     }
+
+    *pos = p;
+    return 0;
 }
 
-static void generate_random_file(FILE *out, size_t size, int printable)
+static size_t *place_needles(const struct config *cfg, uint64_t seed)
 {
-    int x;
-    time_t start = time(NULL);
-    time_t last_print = start;
-    size_t wrote=0;
+    size_t plen = strlen(cfg->phrase);
 
-    while(size) {
-        x = rand();
-        if (printable)
-            make_printable(&x);
+    if (cfg->insert == 0)
+        return NULL;
 
-        int l = sizeof(x);
-        if (l > size) l = size;
-        if (!fwrite(&x, l, 1, out)) {
-            perror("Writing File");
-            exit(3);
-        }
-        size -= l;
-        wrote += l;
+    if (cfg->size / cfg->insert < plen ||
+        (cfg->disallow_cacheline_spanning && plen > CAPI_CACHELINE_BYTES))
+    {
+        fprintf(stderr, "Error: Unable to insert phrase at enough unique locations!\n");
+        exit(2);
+    }
 
-        if ((time(NULL)- last_print) > 2) {
-            fprintf(stderr, "\rWrote %zdMiB", wrote >> 20);
-            last_print = time(NULL);
+    size_t *locs = malloc(cfg->insert * sizeof(*locs));
+    if (locs == NULL) {
+        perror("Allocating needle locations");
+        exit(3);
+    }
+
+    for (size_t i = 0; i < cfg->insert; i++) {
+        if (place_needle(cfg, seed, i, plen, &locs[i])) {
+            fprintf(stderr, "Error: Unable to insert phrase at enough unique locations!\n");
+            exit(2);
         }
     }
 
-    if (last_print != start)
-        fprintf(stderr, "\rWrote %zdMiB\n", wrote >> 20);
+    return locs;
 }
 
-static int contains(int pos, int i, size_t *locs, size_t len) {
-    for (int j = 0; j < i; j++) {
-        if (pos >= locs[j] && pos <= locs[j] + len)
-            return 1;
-        if (pos + len >= locs[j] && pos <= locs[j])
-            return 1;
+static void insert_needles(struct generator *g, size_t offset, size_t len,
+                           char *buf)
+{
+    size_t lo = 0, hi = g->cfg->insert;
+
+    if (g->locs == NULL)
+        return;
+
+    // Find the first needle which ends inside this block
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (g->locs[mid] + g->plen <= offset)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    for (size_t i = lo; i < g->cfg->insert && g->locs[i] < offset + len; i++) {
+        for (size_t j = 0; j < g->plen; j++) {
+            size_t pos = g->locs[i] + j;
+            if (pos >= offset && pos < offset + len)
+                buf[pos - offset] = g->cfg->phrase[j];
+        }
+    }
+}
+
+static int write_manifest(const char *fpath, struct generator *g)
+{
+    FILE *f = fopen(fpath, "w");
+    if (f == NULL) {
+        fprintf(stderr, "Error openning file '%s': %s\n", fpath, strerror(errno));
+        return -1;
+    }
+
+    fprintf(f, "# phrase: %s\n", g->cfg->phrase);
+    fprintf(f, "# size: %zu\n", g->cfg->size);
+    fprintf(f, "# seed: %llu\n", (unsigned long long) g->seed);
+    fprintf(f, "# count: %u\n", g->cfg->insert);
+
+    for (size_t i = 0; i < g->cfg->insert; i++)
+        fprintf(f, "%zu\n", g->locs[i]);
+
+    if (fclose(f)) {
+        perror("Writing manifest");
+        return -1;
     }
 
     return 0;
 }
 
-static void insert_needles(FILE *out, const struct config *cfg)
+static size_t fill_block(struct generator *g, size_t block, uint64_t *buf)
 {
-    size_t plen = strlen(cfg->phrase);
-    size_t locs[cfg->insert];
-    size_t pos;
-    int j;
+    size_t len = g->cfg->size - block * BLOCK_SIZE;
+    if (len > BLOCK_SIZE)
+        len = BLOCK_SIZE;
+
+    corpus_fill(g->corpus, block_key(g->seed, block), (char *) buf, len);
+    insert_needles(g, block * BLOCK_SIZE, len, (char *) buf);
 
-    for (int i = 0; i < cfg->insert; i++) {
-        for (j = 0; j < 500; j++) {
-            pos = rand() % (cfg->size - plen);
+    return len;
+}
+
+static void write_block(struct generator *g, size_t block, uint64_t *buf)
+{
+    size_t len = fill_block(g, block, buf);
+    off_t offset = block * BLOCK_SIZE;
+    const char *p = (const char *) buf;
 
-            if (cfg->disallow_cacheline_spanning &&
-                (pos & CAPI_CACHELINE_BYTES) != ((pos + plen) & CAPI_CACHELINE_BYTES))
-                continue;
+    while (len) {
+        ssize_t ret;
+        if (g->seekable)
+            ret = pwrite(g->fd, p, len, offset);
+        else
+            ret = write(g->fd, p, len);
 
-            if (!contains(pos, i, locs, plen))
-                break;
+        if (ret < 0) {
+            perror("Writing File");
+            exit(3);
         }
+        p += ret;
+        offset += ret;
+        len -= ret;
+        __sync_add_and_fetch(&g->wrote, ret);
+    }
+}
 
-        if (j == 100) {
-            fprintf(stderr, "Error: Unable to insert phrase at enough unique locations!\n");
-            exit(2);
+static void *generate_thread(void *arg)
+{
+    struct generator *g = arg;
+    uint64_t *buf = malloc(BLOCK_SIZE);
+    if (buf == NULL) {
+        perror("Allocating block buffer");
+        exit(3);
+    }
+
+    size_t block;
+    while ((block = __sync_fetch_and_add(&g->next_block, 1)) < g->num_blocks)
+        write_block(g, block, buf);
+
+    free(buf);
+    return NULL;
+}
+
+static void generate_random_file(struct generator *g, unsigned threads)
+{
+    time_t start = time(NULL);
+    time_t last_print = start;
+
+    g->num_blocks = (g->cfg->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+
+    // Pipes must be written in order so only use one thread for them
+    if (!g->seekable)
+        threads = 1;
+
+    pthread_t thrds[threads];
+    for (unsigned i = 0; i < threads; i++) {
+        if (pthread_create(&thrds[i], NULL, generate_thread, g)) {
+            perror("Starting generator threads");
+            exit(3);
         }
+    }
 
-        locs[i] = pos;
-        fseek(out, pos, SEEK_SET);
-        fwrite(cfg->phrase, plen, 1, out);
+    while (g->wrote < g->cfg->size) {
+        usleep(100000);
+        if ((time(NULL) - last_print) > 2) {
+            fprintf(stderr, "\rWrote %zdMiB", g->wrote >> 20);
+            last_print = time(NULL);
+        }
     }
+
+    for (unsigned i = 0; i < threads; i++)
+        pthread_join(thrds[i], NULL);
+
+    if (last_print != start)
+        fprintf(stderr, "\rWrote %zdMiB\n", g->wrote >> 20);
 }
 
 int main (int argc, char *argv[])
@@ -180,22 +342,68 @@ int main (int argc, char *argv[])
         return 1;
     }
 
-    FILE *output = stdout;
+    int mode = corpus_parse_mode(cfg.corpus);
+    if (mode < 0) {
+        fprintf(stderr, "Unknown corpus mode '%s'!\n", cfg.corpus);
+        return 1;
+    }
+
+    if (cfg.printable && mode == CORPUS_RANDOM)
+        mode = CORPUS_PRINTABLE;
+
+    if (cfg.near_miss < 0 || cfg.near_miss > 1) {
+        fprintf(stderr, "Near miss rate must be between 0 and 1!\n");
+        return 1;
+    }
+
+    if (cfg.near_miss > 0 && strlen(cfg.phrase) < 2) {
+        fprintf(stderr, "Phrase is too short to generate near misses!\n");
+        return 1;
+    }
+
+    struct generator g = {
+        .cfg = &cfg,
+        .fd = STDOUT_FILENO,
+    };
+
     if (args == 1) {
-        output = fopen(argv[1], "w");
-        if (output == NULL) {
+        g.fd = open(argv[1], O_WRONLY | O_CREAT | O_TRUNC, 0664);
+        if (g.fd < 0) {
             fprintf(stderr, "Error openning file '%s': %s\n", argv[1], strerror(errno));
             return 1;
         }
     }
 
+    g.seekable = lseek(g.fd, 0, SEEK_CUR) >= 0;
+
     if (cfg.seed > 0)
-        srand(cfg.seed);
+        g.seed = cfg.seed;
     else
-        srand(time(NULL));
+        g.seed = time(NULL);
 
-    generate_random_file(output, cfg.size, cfg.printable);
-    insert_needles(output, &cfg);
+    g.corpus = corpus_new(mode, cfg.phrase, cfg.near_miss);
+    if (g.corpus == NULL) {
+        perror("Creating corpus");
+        return 3;
+    }
 
-    return 0;
+    g.plen = strlen(cfg.phrase);
+    g.locs = place_needles(&cfg, g.seed);
+
+    generate_random_file(&g, cfg.threads);
+    close(g.fd);
+
+    int ret = 0;
+    char manifest[PATH_MAX];
+    if (cfg.manifest != NULL) {
+        ret = write_manifest(cfg.manifest, &g);
+    } else if (args == 1 && !cfg.no_manifest) {
+        snprintf(manifest, sizeof(manifest), "%s.manifest", argv[1]);
+        ret = write_manifest(manifest, &g);
+    }
+
+    free(g.locs);
+    corpus_free(g.corpus);
+
+    return ret ? 1 : 0;
 }
@@ -0,0 +1,266 @@
+////////////////////////////////////////////////////////////////////////
+//
+// Copyright 2015 PMC-Sierra, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you
+// may not use this file except in compliance with the License. You may
+// obtain a copy of the License at
+// http://www.apache.org/licenses/LICENSE-2.0 Unless required by
+// applicable law or agreed to in writing, software distributed under the
+// License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+// CONDITIONS OF ANY KIND, either express or implied. See the License for
+// the specific language governing permissions and limitations under the
+// License.
+//
+////////////////////////////////////////////////////////////////////////
+
+////////////////////////////////////////////////////////////////////////
+//
+//   Author: Logan Gunthorpe
+//
+//   Description:
+//     Decompression of gzip inputs: sequentially for ordinary gzip
+//     files and block by block for BGZF (blocked gzip, as written by
+//     bgzip) whose blocks can be inflated in parallel.
+//
+////////////////////////////////////////////////////////////////////////
+
+#include "gunzip.h"
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#include <unistd.h>
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+#define GZIP_HEADER 18
+#define GZIP_FEXTRA 4
+#define INPUT_SIZE (256 << 10)
+
+static const char *format_names[] = {
+    [GUNZIP_NONE] = "none",
+    [GUNZIP_GZIP] = "gzip",
+    [GUNZIP_BGZF] = "bgzf",
+};
+
+static unsigned get_le16(const unsigned char *b)
+{
+    return b[0] | b[1] << 8;
+}
+
+static uint32_t get_le32(const unsigned char *b)
+{
+    return b[0] | b[1] << 8 | b[2] << 16 | (uint32_t) b[3] << 24;
+}
+
+// A BGZF block is a gzip member whose first extra subfield is 'BC'
+// holding the size of the whole block, less one
+static int is_bgzf(const unsigned char *h)
+{
+    return h[3] & GZIP_FEXTRA && get_le16(&h[10]) >= 6 &&
+        h[12] == 'B' && h[13] == 'C' && get_le16(&h[14]) == 2;
+}
+
+static int is_gzip(const unsigned char *h)
+{
+    return h[0] == 0x1f && h[1] == 0x8b && h[2] == 8;
+}
+
+enum gunzip_format gunzip_detect(int fd)
+{
+    unsigned char h[GZIP_HEADER];
+
+    if (pread(fd, h, sizeof(h), 0) < 3 || !is_gzip(h))
+        return GUNZIP_NONE;
+
+    return is_bgzf(h) ? GUNZIP_BGZF : GUNZIP_GZIP;
+}
+
+const char *gunzip_format_name(enum gunzip_format fmt)
+{
+    return format_names[fmt];
+}
+
+int gunzip_bgzf_block(int fd, off_t pos, size_t *bsize, size_t *isize)
+{
+    unsigned char h[GZIP_HEADER];
+
+    ssize_t rd = pread(fd, h, sizeof(h), pos);
+    if (rd == 0)
+        return 0;
+
+    if (rd != sizeof(h) || !is_gzip(h) || !is_bgzf(h))
+        return -1;
+
+    *bsize = get_le16(&h[16]) + 1;
+
+    // The trailer's ISIZE is the size of the data
+    unsigned char t[4];
+    if (pread(fd, t, sizeof(t), pos + *bsize - sizeof(t)) != sizeof(t))
+        return -1;
+
+    *isize = get_le32(t);
+    return 1;
+}
+
+#ifdef HAVE_ZLIB
+
+struct gunzip {
+    int fd;
+    z_stream strm;
+    int eof;
+    int done;
+    unsigned char in[INPUT_SIZE];
+};
+
+int gunzip_available(void)
+{
+    return 1;
+}
+
+struct gunzip *gunzip_new(int fd)
+{
+    struct gunzip *gz = calloc(1, sizeof(*gz));
+    if (gz == NULL)
+        return NULL;
+
+    gz->fd = fd;
+
+    // 16 + MAX_WBITS only accepts the gzip format
+    if (inflateInit2(&gz->strm, 16 + MAX_WBITS) != Z_OK) {
+        free(gz);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    return gz;
+}
+
+void gunzip_free(struct gunzip *gz)
+{
+    if (gz == NULL) return;
+
+    inflateEnd(&gz->strm);
+    free(gz);
+}
+
+static void fill_input(struct gunzip *gz)
+{
+    ssize_t rd;
+
+    do {
+        rd = read(gz->fd, gz->in, sizeof(gz->in));
+    } while (rd < 0 && errno == EINTR);
+
+    if (rd < 0)
+        perror("Reading gzip input");
+    if (rd <= 0) {
+        gz->eof = 1;
+        return;
+    }
+
+    gz->strm.next_in = gz->in;
+    gz->strm.avail_in = rd;
+}
+
+size_t gunzip_read(struct gunzip *gz, void *buf, size_t len)
+{
+    z_stream *s = &gz->strm;
+
+    s->next_out = buf;
+    s->avail_out = len;
+
+    while (s->avail_out && !gz->done) {
+        if (!s->avail_in && !gz->eof)
+            fill_input(gz);
+
+        if (!s->avail_in && gz->eof) {
+            gz->done = 1;
+            break;
+        }
+
+        int ret = inflate(s, Z_NO_FLUSH);
+
+        if (ret == Z_STREAM_END) {
+            // Concatenated members are one stream (like gzip -d does),
+            // anything else following the last one is ignored.
+            if (!s->avail_in && !gz->eof)
+                fill_input(gz);
+
+            if (s->avail_in && s->next_in[0] == 0x1f)
+                inflateReset(s);
+            else
+                gz->done = 1;
+        } else if (ret != Z_OK && ret != Z_BUF_ERROR) {
+            fprintf(stderr, "Corrupt gzip data: %s\n",
+                    s->msg ? s->msg : "unknown error");
+            gz->done = 1;
+        }
+    }
+
+    return len - s->avail_out;
+}
+
+size_t gunzip_inflate(const void *src, size_t src_len, void *dst,
+                      size_t dst_len)
+{
+    z_stream s = {0};
+
+    if (inflateInit2(&s, 16 + MAX_WBITS) != Z_OK)
+        return 0;
+
+    s.next_in = (unsigned char *) src;
+    s.avail_in = src_len;
+    s.next_out = dst;
+    s.avail_out = dst_len;
+
+    while (s.avail_in && s.avail_out) {
+        int ret = inflate(&s, Z_NO_FLUSH);
+
+        if (ret == Z_STREAM_END) {
+            inflateReset(&s);
+        } else if (ret != Z_OK) {
+            fprintf(stderr, "Corrupt gzip data: %s\n",
+                    s.msg ? s.msg : "unknown error");
+            break;
+        }
+    }
+
+    inflateEnd(&s);
+    return dst_len - s.avail_out;
+}
+
+#else
+
+int gunzip_available(void)
+{
+    return 0;
+}
+
+struct gunzip *gunzip_new(int fd)
+{
+    errno = ENOSYS;
+    return NULL;
+}
+
+void gunzip_free(struct gunzip *gz)
+{
+}
+
+size_t gunzip_read(struct gunzip *gz, void *buf, size_t len)
+{
+    return 0;
+}
+
+size_t gunzip_inflate(const void *src, size_t src_len, void *dst,
+                      size_t dst_len)
+{
+    return 0;
+}
+
+#endif
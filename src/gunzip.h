@@ -0,0 +1,69 @@
+////////////////////////////////////////////////////////////////////////
+//
+// Copyright 2015 PMC-Sierra, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you
+// may not use this file except in compliance with the License. You may
+// obtain a copy of the License at
+// http://www.apache.org/licenses/LICENSE-2.0 Unless required by
+// applicable law or agreed to in writing, software distributed under the
+// License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+// CONDITIONS OF ANY KIND, either express or implied. See the License for
+// the specific language governing permissions and limitations under the
+// License.
+//
+////////////////////////////////////////////////////////////////////////
+
+////////////////////////////////////////////////////////////////////////
+//
+//   Author: Logan Gunthorpe
+//
+//   Description:
+//     Decompression of gzip inputs: sequentially for ordinary gzip
+//     files and block by block for BGZF (blocked gzip, as written by
+//     bgzip) whose blocks can be inflated in parallel.
+//
+////////////////////////////////////////////////////////////////////////
+
+#ifndef GUNZIP_H
+#define GUNZIP_H
+
+#include <sys/types.h>
+#include <stddef.h>
+
+enum gunzip_format {
+    GUNZIP_NONE,
+    GUNZIP_GZIP,
+    GUNZIP_BGZF,
+};
+
+// The largest amount of data a BGZF block can hold
+#define GUNZIP_BGZF_MAX_BLOCK 65536
+
+// Returns 0 if textswap was built without zlib
+int gunzip_available(void);
+
+// Checks the header at the start of the file, doesn't need zlib
+enum gunzip_format gunzip_detect(int fd);
+const char *gunzip_format_name(enum gunzip_format fmt);
+
+// Inflate an ordinary (possibly multi-member) gzip file from its
+// current position. Returns NULL if zlib isn't available.
+struct gunzip *gunzip_new(int fd);
+void gunzip_free(struct gunzip *gz);
+
+// Returns the number of bytes inflated, less than len only at the end
+// of the data or on an error (which is printed)
+size_t gunzip_read(struct gunzip *gz, void *buf, size_t len);
+
+// Find the size of the BGZF block at pos and of the data it holds.
+// Returns 1 for a block, 0 at the end of the file and -1 if there
+// isn't a BGZF block at pos.
+int gunzip_bgzf_block(int fd, off_t pos, size_t *bsize, size_t *isize);
+
+// Inflate the whole gzip members in src into at most dst_len bytes of
+// dst. Returns the number of bytes written.
+size_t gunzip_inflate(const void *src, size_t src_len, void *dst,
+                      size_t dst_len);
+
+#endif
@@ -0,0 +1,448 @@
+////////////////////////////////////////////////////////////////////////
+//
+// Copyright 2015 PMC-Sierra, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you
+// may not use this file except in compliance with the License. You may
+// obtain a copy of the License at
+// http://www.apache.org/licenses/LICENSE-2.0 Unless required by
+// applicable law or agreed to in writing, software distributed under the
+// License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+// CONDITIONS OF ANY KIND, either express or implied. See the License for
+// the specific language governing permissions and limitations under the
+// License.
+//
+////////////////////////////////////////////////////////////////////////
+
+////////////////////////////////////////////////////////////////////////
+//
+//   Author: Logan Gunthorpe
+//
+//   Description:
+//     Hybrid search: chunks are split between the AFU (through the
+//     wqueue) and a pool of software search engines depending on the
+//     throughput observed from each. The results are merged back in
+//     chunk order before being handed to the write threads.
+//
+////////////////////////////////////////////////////////////////////////
+
+#include "hybrid.h"
+#include "reorder.h"
+#include "textswap.h"
+#include "stats.h"
+#include "cpusample.h"
+#include "affinity.h"
+
+#include <capi/capi.h>
+#include <capi/proc.h>
+#include <capi/fifo.h>
+#include <capi/worker.h>
+#include <capi/macro.h>
+#include <capi/wqueue.h>
+
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+
+// Weight given to each new throughput sample
+#define RATE_ALPHA 0.2
+
+// Starting guess for the throughput of each engine (bytes/s) until
+// there are real samples
+#define RATE_PRIOR (256.0 * 1024 * 1024)
+
+struct backend {
+    double rate;
+    size_t outstanding;
+    size_t bytes;
+    unsigned long chunks;
+};
+
+struct hybrid {
+    struct worker worker;
+    struct fifo *cpu_fifo;
+    struct reorder reorder;
+
+    pthread_t hw_thrd;
+    struct rusage hw_rusage;
+
+    char phrase[17];
+    size_t plen;
+    unsigned slowdown;
+    int num_engines;
+    unsigned thread_seq;
+    struct rusage *engine_rusage;
+
+    pthread_mutex_t mutex;
+    struct backend hw;
+    struct backend cpu;
+
+    // Only touched by the dispatcher
+    char tail[16];
+    size_t tail_len;
+};
+
+static void update_rate(struct hybrid *h, struct backend *b, size_t bytes,
+                        double secs)
+{
+    pthread_mutex_lock(&h->mutex);
+    if (secs > 0)
+        b->rate = b->rate * (1 - RATE_ALPHA) + bytes / secs * RATE_ALPHA;
+    b->outstanding -= bytes;
+    b->bytes += bytes;
+    b->chunks++;
+    pthread_mutex_unlock(&h->mutex);
+}
+
+// Drop the spanning (negative) results reported by the engine and
+// add the ones the dispatcher found instead.
+static void merge_results(struct readthrd_item *item)
+{
+    int32_t *res = item->buf;
+    size_t n = 0;
+
+    if (item->dirty) {
+        for (size_t i = 0; i < item->result_bytes / sizeof(*res); i++) {
+            if (res[i] == INT32_MAX)
+                break;
+            if (res[i] < 0)
+                continue;
+            res[n++] = res[i];
+        }
+    }
+
+    if (item->nboundary) {
+        memmove(&res[item->nboundary], res, n * sizeof(*res));
+        memcpy(res, item->boundary, item->nboundary * sizeof(*res));
+        n += item->nboundary;
+    }
+
+    size_t res_per_line = CAPI_CACHELINE_BYTES / sizeof(*res);
+    size_t top = (n + res_per_line - 1) & ~(res_per_line - 1);
+    for (size_t i = n; i < top; i++)
+        res[i] = INT32_MAX;
+
+    item->result_bytes = top * sizeof(*res);
+    item->dirty = n > 0;
+}
+
+static void *engine_thread(void *arg)
+{
+    struct hybrid *h = container_of(arg, struct hybrid, worker);
+    unsigned tid = __sync_fetch_and_add(&h->thread_seq, 1);
+    cpusample_register("cpu_engine", tid);
+
+    struct proc *proc = proc_init();
+
+    char needle[16] = {0};
+    memcpy(needle, h->phrase, h->plen);
+    uint64_t *d = (uint64_t *) needle;
+    proc_mmio_write64(proc, &MMIO->text_search[0], d[0]);
+    proc_mmio_write64(proc, &MMIO->text_search[8], d[1]);
+
+    int32_t *scratch = NULL;
+    size_t scratch_len = 0;
+    struct readthrd_item *item;
+
+    while ((item = fifo_pop(h->cpu_fifo)) != NULL) {
+        // The results can't be written in place as the software search
+        // would overwrite the data it hasn't looked at yet.
+        size_t len = item->bytes * sizeof(*scratch);
+        if (len > scratch_len) {
+            free(scratch);
+            scratch = malloc(len);
+            if (scratch == NULL) {
+                perror("cpu engine alloc");
+                exit(ENOMEM);
+            }
+            scratch_len = len;
+        }
+
+        double start = stats_now();
+        int dirty;
+        size_t dst_len;
+        proc_run(proc, 0, item->buf, scratch, item->bytes, 0, &dirty,
+                 &dst_len);
+
+        if (h->slowdown > 1)
+            usleep((stats_now() - start) * (h->slowdown - 1) * 1e6);
+
+        item->proc_secs = stats_now() - start;
+        item->dirty = dirty;
+        item->result_bytes = dst_len;
+        if (dirty)
+            memcpy(item->buf, scratch, dst_len);
+
+        merge_results(item);
+        update_rate(h, &h->cpu, item->bytes, item->proc_secs);
+        reorder_put(&h->reorder, item->index, item);
+    }
+
+    free(scratch);
+    free(proc);
+
+    getrusage(RUSAGE_THREAD, &h->engine_rusage[tid]);
+    worker_finish_thread(&h->worker);
+
+    return NULL;
+}
+
+static void *hw_thread(void *arg)
+{
+    struct hybrid *h = arg;
+
+    cpusample_register("afu_complete", 0);
+    affinity_pin(AFFINITY_COMPLETE);
+
+    int last = 0;
+    while (!last) {
+        struct wqueue_item it;
+        int error_code = wqueue_pop(&it);
+        struct readthrd_item *item = it.opaque;
+
+        if (error_code) {
+            fprintf(stderr, "Error 0x%04x processing buffer %d (at 0x%p)\n",
+                    error_code, item->index, item->buf);
+
+            exit(EIO);
+        }
+
+        last = item->last;
+        item->proc_secs = wqueue_calc_duration(&it);
+        item->dirty = it.flags & WQ_DIRTY_FLAG;
+        item->result_bytes = it.dst_len;
+
+        merge_results(item);
+        // Use the time the AFU reports it spent on the item: the time
+        // it took to come back here also includes waiting on the merge
+        // behind slower software engines.
+        update_rate(h, &h->hw, item->bytes, item->proc_secs);
+        reorder_put(&h->reorder, item->index, item);
+    }
+
+    getrusage(RUSAGE_THREAD, &h->hw_rusage);
+
+    return NULL;
+}
+
+static int next_power_of_2(int x)
+{
+    x--;
+    x |= x >> 1;
+    x |= x >> 2;
+    x |= x >> 4;
+    x |= x >> 8;
+    x |= x >> 16;
+    x++;
+
+   return x;
+}
+
+struct hybrid *hybrid_start(const char *phrase, int num_engines,
+                            unsigned slowdown, unsigned queue_len)
+{
+    struct hybrid *h = calloc(1, sizeof(*h));
+    if (h == NULL)
+        return NULL;
+
+    strncpy(h->phrase, phrase, sizeof(h->phrase) - 1);
+    h->plen = strlen(h->phrase);
+    h->slowdown = slowdown;
+    h->num_engines = num_engines;
+    h->hw.rate = RATE_PRIOR;
+    h->cpu.rate = RATE_PRIOR;
+
+    h->engine_rusage = calloc(num_engines, sizeof(*h->engine_rusage));
+    if (h->engine_rusage == NULL)
+        goto error_out;
+
+    h->cpu_fifo = fifo_new(next_power_of_2(num_engines * 2));
+    if (h->cpu_fifo == NULL)
+        goto error_rusage_out;
+    fifo_open(h->cpu_fifo);
+
+    if (reorder_init(&h->reorder, (queue_len + num_engines * 2) * 2))
+        goto error_fifo_out;
+
+    if (pthread_mutex_init(&h->mutex, NULL))
+        goto error_reorder_out;
+
+    if (pthread_create(&h->hw_thrd, NULL, hw_thread, h))
+        goto error_mutex_out;
+
+    if (worker_start(&h->worker, num_engines, engine_thread))
+        goto error_hw_stop;
+
+    return h;
+
+error_hw_stop:
+    pthread_cancel(h->hw_thrd);
+error_mutex_out:
+    pthread_mutex_destroy(&h->mutex);
+error_reorder_out:
+    reorder_destroy(&h->reorder);
+error_fifo_out:
+    fifo_free(h->cpu_fifo);
+error_rusage_out:
+    free(h->engine_rusage);
+error_out:
+    free(h);
+    return NULL;
+}
+
+void hybrid_join(struct hybrid *h)
+{
+    if (h == NULL) return;
+
+    worker_join(&h->worker);
+    pthread_join(h->hw_thrd, NULL);
+}
+
+void hybrid_free(struct hybrid *h)
+{
+    if (h == NULL) return;
+
+    worker_free(&h->worker);
+    pthread_mutex_destroy(&h->mutex);
+    reorder_destroy(&h->reorder);
+    fifo_free(h->cpu_fifo);
+    free(h->engine_rusage);
+    free(h);
+}
+
+// Find the matches which start in the previous chunk and end in this
+// one. They are reported the same way the AFU does: as a negative
+// index counting back from the start of this chunk.
+static void find_boundary(struct hybrid *h, struct readthrd_item *item)
+{
+    char window[32];
+    size_t head = h->plen - 1;
+
+    item->nboundary = 0;
+
+    if (!item->contig || h->tail_len == 0)
+        return;
+
+    if (head > item->real_bytes)
+        head = item->real_bytes;
+
+    memcpy(window, h->tail, h->tail_len);
+    memcpy(&window[h->tail_len], item->buf, head);
+
+    for (size_t s = 0; s < h->tail_len; s++) {
+        if (s + h->plen > h->tail_len + head)
+            break;
+
+        if (memcmp(&window[s], h->phrase, h->plen) == 0)
+            item->boundary[item->nboundary++] = -(int32_t) (h->tail_len - s);
+    }
+}
+
+static void save_tail(struct hybrid *h, struct readthrd_item *item)
+{
+    size_t len = h->plen - 1;
+    if (len > item->real_bytes)
+        len = item->real_bytes;
+
+    memcpy(h->tail, (char *) item->buf + item->real_bytes - len, len);
+    h->tail_len = len;
+}
+
+// Pick the backend expected to finish this chunk first given how much
+// work is already queued on each and how quickly they have been going.
+static int use_hw(struct hybrid *h, size_t bytes)
+{
+    pthread_mutex_lock(&h->mutex);
+    double hw_eta = (h->hw.outstanding + bytes) / h->hw.rate;
+    double cpu_eta = (h->cpu.outstanding + bytes) /
+        (h->cpu.rate * h->num_engines);
+    pthread_mutex_unlock(&h->mutex);
+
+    return hw_eta <= cpu_eta;
+}
+
+void hybrid_dispatch(struct hybrid *h, struct readthrd_item *item)
+{
+    int last = item->last;
+
+    find_boundary(h, item);
+    save_tail(h, item);
+
+    // The last item always goes to the AFU so the wqueue sees the
+    // last item flag.
+    int hw = last || h->num_engines == 0 || use_hw(h, item->bytes);
+    struct backend *b = hw ? &h->hw : &h->cpu;
+
+    pthread_mutex_lock(&h->mutex);
+    b->outstanding += item->bytes;
+    pthread_mutex_unlock(&h->mutex);
+
+    if (hw) {
+        struct wqueue_item witem = {
+            .flags = last ? WQ_LAST_ITEM_FLAG : 0,
+            .src = item->buf,
+            .dst = item->buf,
+            .src_len = item->bytes,
+            .opaque = item,
+        };
+
+        wqueue_push(&witem);
+    } else {
+        fifo_push(h->cpu_fifo, item);
+    }
+
+    if (last)
+        fifo_close(h->cpu_fifo);
+}
+
+struct readthrd_item *hybrid_pop(struct hybrid *h)
+{
+    return reorder_get(&h->reorder);
+}
+
+void hybrid_print(struct hybrid *h, FILE *out)
+{
+    size_t total = h->hw.bytes + h->cpu.bytes;
+    if (total == 0)
+        total = 1;
+
+    fprintf(out, "Hybrid Split:\n");
+    fprintf(out, "  AFU  %8lu chunks  %5.1f%%\n", h->hw.chunks,
+            100.0 * h->hw.bytes / total);
+    fprintf(out, "  CPU  %8lu chunks  %5.1f%%  (%d engines)\n", h->cpu.chunks,
+            100.0 * h->cpu.bytes / total, h->num_engines);
+}
+
+static void backend_json(struct json *j, const char *key, struct backend *b)
+{
+    json_obj_start(j, key);
+    json_uint(j, "chunks", b->chunks);
+    json_uint(j, "bytes", b->bytes);
+    json_double(j, "rate_Bps", b->rate);
+    json_obj_end(j);
+}
+
+void hybrid_json(struct hybrid *h, struct json *j)
+{
+    if (h == NULL) return;
+
+    json_obj_start(j, "backends");
+    backend_json(j, "afu", &h->hw);
+    backend_json(j, "cpu", &h->cpu);
+    json_uint(j, "cpu_engines", h->num_engines);
+    json_obj_end(j);
+}
+
+void hybrid_json_threads(struct hybrid *h, struct json *j)
+{
+    if (h == NULL) return;
+
+    stats_thread_json(j, "afu_complete", 0, &h->hw_rusage);
+    for (int i = 0; i < h->num_engines; i++)
+        stats_thread_json(j, "cpu_engine", i, &h->engine_rusage[i]);
+}
@@ -0,0 +1,59 @@
+////////////////////////////////////////////////////////////////////////
+//
+// Copyright 2015 PMC-Sierra, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you
+// may not use this file except in compliance with the License. You may
+// obtain a copy of the License at
+// http://www.apache.org/licenses/LICENSE-2.0 Unless required by
+// applicable law or agreed to in writing, software distributed under the
+// License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+// CONDITIONS OF ANY KIND, either express or implied. See the License for
+// the specific language governing permissions and limitations under the
+// License.
+//
+////////////////////////////////////////////////////////////////////////
+
+////////////////////////////////////////////////////////////////////////
+//
+//   Author: Logan Gunthorpe
+//
+//   Description:
+//     Hybrid search: chunks are split between the AFU (through the
+//     wqueue) and a pool of software search engines depending on the
+//     throughput observed from each. The results are merged back in
+//     chunk order before being handed to the write threads.
+//
+////////////////////////////////////////////////////////////////////////
+
+#ifndef HYBRID_H
+#define HYBRID_H
+
+#include "readthrd.h"
+#include "json.h"
+
+#include <stdio.h>
+
+// The AFU carries partial matches over from one chunk to the next,
+// which no longer works once consecutive chunks go to different
+// engines. So in hybrid mode the matches that span two chunks are
+// found by the dispatcher (which sees every chunk in order before it
+// is searched) and the spanning results from the engines are dropped.
+
+struct hybrid *hybrid_start(const char *phrase, int num_engines,
+                            unsigned slowdown, unsigned queue_len);
+void hybrid_join(struct hybrid *h);
+void hybrid_free(struct hybrid *h);
+
+// Called, in chunk order, by the read thread's wqueue thread
+void hybrid_dispatch(struct hybrid *h, struct readthrd_item *item);
+
+// Called by the write thread's wqueue thread, returns the next
+// finished item in chunk order
+struct readthrd_item *hybrid_pop(struct hybrid *h);
+
+void hybrid_print(struct hybrid *h, FILE *out);
+void hybrid_json(struct hybrid *h, struct json *j);
+void hybrid_json_threads(struct hybrid *h, struct json *j);
+
+#endif
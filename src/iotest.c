@@ -24,6 +24,7 @@
 //
 ////////////////////////////////////////////////////////////////////////
 
+
 #include "textswap.h"
 #include "readthrd.h"
 #include "writethrd.h"
@@ -36,6 +37,7 @@
 #include <capi/snooper.h>
 #include <capi/worker.h>
 #include <capi/macro.h>
+#include <capi/utils.h>
 
 #include <argconfig/argconfig.h>
 #include <argconfig/report.h>
@@ -43,11 +45,15 @@
 
 #include <sys/time.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
 
 #include <errno.h>
 #include <string.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <time.h>
+#include <math.h>
 #include <inttypes.h>
 
 const char program_desc[]  =
@@ -64,6 +70,11 @@ struct config {
     int croom;
     unsigned queue_len;
     unsigned long numio;
+    unsigned threads;
+    char *pattern;
+    double zipf_theta;
+    char *sweep_queue;
+    char *sweep_io;
 };
 
 static const struct config defaults = {
@@ -75,6 +86,9 @@ static const struct config defaults = {
     .rwmix         = 100,
     .numio         = 16,
     .queue_len     = 16,
+    .threads       = 1,
+    .pattern       = "random",
+    .zipf_theta    = 0.99,
 };
 
 static const struct argconfig_commandline_options command_line_options[] = {
@@ -93,6 +107,9 @@ static const struct argconfig_commandline_options command_line_options[] = {
     {"n",          "NUM",  CFG_LONG_SUFFIX, &defaults.numio, required_argument, NULL},
     {"numio",      "NUM",  CFG_LONG_SUFFIX, &defaults.numio, required_argument,
             "Number of IO in this run"},
+    {"p",          "STRING", CFG_STRING, &defaults.pattern, required_argument, NULL},
+    {"pattern",    "STRING", CFG_STRING, &defaults.pattern, required_argument,
+            "access pattern: seq, random or zipf"},
     {"q",          "NUM",  CFG_POSITIVE, &defaults.queue_len, required_argument, NULL},
     {"queue",      "NUM",  CFG_POSITIVE, &defaults.queue_len, required_argument,
             "Queue length"},
@@ -105,12 +122,29 @@ static const struct argconfig_commandline_options command_line_options[] = {
     {"S",           "", CFG_NONE, &defaults.software, no_argument, NULL},
     {"software",    "", CFG_NONE, &defaults.software, no_argument,
             "use sotfware emulation"},
+    {"sweep-io",   "LIST", CFG_STRING, &defaults.sweep_io, required_argument,
+            "comma separated IO sizes to sweep over (overrides --io)"},
+    {"sweep-queue", "LIST", CFG_STRING, &defaults.sweep_queue, required_argument,
+            "comma separated queue lengths to sweep over (overrides --queue)"},
+    {"t",          "NUM",  CFG_POSITIVE, &defaults.threads, required_argument, NULL},
+    {"threads",    "NUM",  CFG_POSITIVE, &defaults.threads, required_argument,
+            "number of threads submitting IO"},
     {"v",           "", CFG_INCREMENT, NULL, no_argument, NULL},
     {"verbose",     "", CFG_INCREMENT, &defaults.verbose, no_argument,
             "be verbose"},
+    {"zipf-theta", "NUM",  CFG_DOUBLE, &defaults.zipf_theta, required_argument,
+            "skew of the zipf access pattern"},
     {0}
 };
 
+enum pattern {
+    PATTERN_SEQ,
+    PATTERN_RANDOM,
+    PATTERN_ZIPF,
+};
+
+#define MAX_SWEEP 32
+
 struct queue_thread {
     struct worker worker;
     void *buffer;
@@ -118,21 +152,98 @@ struct queue_thread {
     size_t iosize;
     unsigned rwmix;
     unsigned numio;
+    unsigned threads;
+    enum pattern pattern;
+    const double *zipf_cdf;
+    uint64_t seed;
+    unsigned thread_seq;
+    // libcapi's wqueue has only ever been pushed from one thread
+    pthread_mutex_t push_lock;
     unsigned reads, writes;
+
+    // Set when the pop loop gives up so the submitters stop early.
+    // Until they have all finished, what they pushed is drained.
+    volatile int stop;
+    volatile unsigned running;
+    volatile unsigned pushed;
 };
 
+// Each submitter has its own xorshift64* generator so the threads
+// don't contend on (or serialize through) rand().
+static uint64_t rng_next(uint64_t *s)
+{
+    *s ^= *s >> 12;
+    *s ^= *s << 25;
+    *s ^= *s >> 27;
+    return *s * 0x2545F4914F6CDD1DULL;
+}
+
+static double *zipf_cdf(size_t n, double theta)
+{
+    double *cdf = malloc(n * sizeof(*cdf));
+    if (cdf == NULL)
+        return NULL;
+
+    double total = 0;
+    for (size_t i = 0; i < n; i++) {
+        total += 1.0 / pow(i + 1, theta);
+        cdf[i] = total;
+    }
+
+    for (size_t i = 0; i < n; i++)
+        cdf[i] /= total;
+
+    return cdf;
+}
+
+static size_t zipf_pick(const double *cdf, size_t n, uint64_t *rng)
+{
+    double u = (rng_next(rng) >> 11) * (1.0 / (1ULL << 53));
+    size_t lo = 0, hi = n - 1;
+
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (cdf[mid] < u)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return lo;
+}
+
 static void *queue_thread(void *arg)
 {
     struct queue_thread *t = container_of(arg, struct queue_thread, worker);
+    unsigned tid = __sync_fetch_and_add(&t->thread_seq, 1);
 
     size_t maxios = t->bufsize / t->iosize;
     struct {
         uint8_t buf[t->iosize];
     } *ios = t->buffer;
 
-    for (unsigned i = 0; i < t->numio; i++) {
-        int off = rand() % maxios;
-        int read = rand() % 100 < t->rwmix;
+    uint64_t rng = t->seed * 0x9E3779B97F4A7C15ULL + tid + 1;
+    unsigned numio = t->numio / t->threads;
+    if (tid < t->numio % t->threads)
+        numio++;
+
+    size_t seq = maxios * tid / t->threads;
+
+    for (unsigned i = 0; i < numio && !t->stop; i++) {
+        size_t off;
+        switch (t->pattern) {
+        case PATTERN_SEQ:
+            off = seq++ % maxios;
+            break;
+        case PATTERN_ZIPF:
+            off = zipf_pick(t->zipf_cdf, maxios, &rng);
+            break;
+        default:
+            off = rng_next(&rng) % maxios;
+            break;
+        }
+
+        int read = rng_next(&rng) % 100 < t->rwmix;
 
         struct wqueue_item it = {
             .dst = &ios[off],
@@ -150,65 +261,260 @@ static void *queue_thread(void *arg)
             it.flags = WQ_PROC_MEMCPY_FLAG;
         }
 
-        if (i == t->numio-1)
-            it.flags |= WQ_LAST_ITEM_FLAG;
-
+        pthread_mutex_lock(&t->push_lock);
         wqueue_push(&it);
+        __sync_add_and_fetch(&t->pushed, 1);
+        pthread_mutex_unlock(&t->push_lock);
     }
 
+    __sync_sub_and_fetch(&t->running, 1);
     worker_finish_thread(&t->worker);
     return NULL;
 }
 
-static int pop_loop(double *hw_time)
+// With multiple submitters no one of them knows which item reaches the
+// queue last, so none is flagged and we pop by count instead.
+static int pop_loop(unsigned count, double *durations, double *hw_time,
+                    unsigned *popped)
 {
     struct wqueue_item it;
-    unsigned count = 0;
     double total_duration = 0.0;
 
-    do {
+    for (unsigned i = 0; i < count; i++) {
         int error_code = wqueue_pop(&it);
+        (*popped)++;
 
         if (error_code) {
             fprintf(stderr, "Error 0x%04x processing buffer (dst 0x%p)\n",
                     error_code, it.dst);
             return -1;
         }
-        total_duration += wqueue_calc_duration(&it);
-        count++;
 
-    } while (!(it.flags & WQ_LAST_ITEM_FLAG));
+        durations[i] = wqueue_calc_duration(&it);
+        total_duration += durations[i];
+    }
 
     *hw_time = total_duration;
 
     return count;
 }
 
+// Stop the submitters after an error, popping whatever they push until
+// they have all finished, so none is left blocked on a full queue.
+static void drain(struct queue_thread *qt, unsigned popped)
+{
+    struct wqueue_item it;
+
+    qt->stop = 1;
+    __sync_synchronize();
+
+    while (qt->running || popped < qt->pushed) {
+        if (popped < qt->pushed) {
+            wqueue_pop(&it);
+            popped++;
+        } else {
+            sched_yield();
+        }
+    }
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *) a;
+    double y = *(const double *) b;
+
+    return (x > y) - (x < y);
+}
+
+static double percentile(const double *sorted, unsigned n, double p)
+{
+    unsigned i = ceil(p / 100 * n);
+    if (i > 0)
+        i--;
+    if (i >= n)
+        i = n - 1;
+
+    return sorted[i];
+}
+
+static int parse_list(const char *list, unsigned long *vals, unsigned long def)
+{
+    int n = 0;
+
+    if (list == NULL) {
+        vals[0] = def;
+        return 1;
+    }
+
+    while (*list && n < MAX_SWEEP) {
+        vals[n++] = suffix_binary_parse(list);
+        list += strcspn(list, ",");
+        if (*list == ',')
+            list++;
+    }
+
+    return n;
+}
+
+static int run_one(struct config *cfg, struct queue_thread *qt,
+                   unsigned queue_len, size_t io, int detail)
+{
+    double *durations = malloc(cfg->numio * sizeof(*durations));
+    if (durations == NULL) {
+        perror("Allocating latency table");
+        return 1;
+    }
+
+    if (wqueue_init(cfg->device, &MMIO->wq, queue_len)) {
+        perror("Initializing wqueue");
+        free(durations);
+        return 1;
+    }
+
+    if (cfg->seed)
+        cxl->mmio_write64(wqueue_afu(), &MMIO->lfsr_seed, cfg->seed);
+
+    if (!cfg->software && cfg->croom >= 0)
+        wqueue_set_croom(cfg->croom);
+
+    memset(&qt->worker, 0, sizeof(qt->worker));
+    qt->iosize = io;
+    qt->thread_seq = 0;
+    qt->reads = qt->writes = 0;
+    qt->stop = 0;
+    qt->running = cfg->threads;
+    qt->pushed = 0;
+
+    double hw_duration = 0;
+    struct timeval start_time;
+    gettimeofday(&start_time, NULL);
+
+    worker_start(&qt->worker, cfg->threads, queue_thread);
+    unsigned popped = 0;
+    int io_count = pop_loop(cfg->numio, durations, &hw_duration, &popped);
+    if (io_count < 0)
+        drain(qt, popped);
+    worker_join(&qt->worker);
+
+    struct timeval end_time;
+    gettimeofday(&end_time, NULL);
+
+    worker_free(&qt->worker);
+
+    if (io_count < 0) {
+        wqueue_cleanup();
+        free(durations);
+        return 2;
+    }
+
+    if (!cfg->software && cfg->verbose) {
+        snooper_dump(wqueue_afu());
+        snooper_tag_usage(wqueue_afu());
+        snooper_tag_stats(wqueue_afu(), cfg->verbose);
+    }
+
+    wqueue_cleanup();
+
+    qsort(durations, io_count, sizeof(*durations), cmp_double);
+
+    double elapsed = utils_timeval_to_secs(&end_time) -
+        utils_timeval_to_secs(&start_time);
+
+    if (detail) {
+        double read_bytes = qt->reads * io;
+        double wrote_bytes = qt->writes * io;
+        const char *read_suffix = suffix_dbinary_get(&read_bytes);
+        const char *wrote_suffix = suffix_dbinary_get(&wrote_bytes);
+
+        printf("\nRead:  %6.2f%sB\n", read_bytes, read_suffix);
+        printf("Wrote: %6.2f%sB\n\n", wrote_bytes, wrote_suffix);
+
+        printf("Hardware rate:  ");
+        report_transfer_bin_rate_elapsed(stdout, hw_duration, io*io_count);
+        printf("\n");
+        printf("Software rate:  ");
+        report_transfer_bin_rate(stdout, &start_time, &end_time, io*io_count);
+        printf("\n");
+        printf("Latency:        p50 %.1fus, p99 %.1fus, p99.9 %.1fus, max %.1fus\n",
+               percentile(durations, io_count, 50) * 1e6,
+               percentile(durations, io_count, 99) * 1e6,
+               percentile(durations, io_count, 99.9) * 1e6,
+               durations[io_count - 1] * 1e6);
+    } else {
+        printf("%6u %10zu %12.0f %10.2f %10.1f %10.1f %10.1f\n",
+               queue_len, io, io_count / elapsed,
+               io * io_count / elapsed / (1 << 20),
+               percentile(durations, io_count, 50) * 1e6,
+               percentile(durations, io_count, 99) * 1e6,
+               percentile(durations, io_count, 99.9) * 1e6);
+    }
+
+    free(durations);
+    return 0;
+}
+
 int main (int argc, char *argv[])
 {
     int ret = 0;
     struct config cfg;
     struct queue_thread qt = {};
+    unsigned long queues[MAX_SWEEP], ios[MAX_SWEEP];
 
     argconfig_append_usage("INPUT [OUTPUT]");
     argconfig_parse(argc, argv, program_desc, command_line_options,
                     &defaults, &cfg, sizeof(cfg));
 
+    // A seed of 0 leaves the AFU's lfsr alone, only the submitters'
+    // generators are seeded from the time
     if (cfg.seed == 0) {
-        srand(time(NULL));
+        qt.seed = time(NULL);
     } else {
         printf("Using Seed: %ld\n", cfg.seed);
-        srand(cfg.seed);
+        qt.seed = cfg.seed;
     }
 
+    if (strcmp(cfg.pattern, "seq") == 0) {
+        qt.pattern = PATTERN_SEQ;
+    } else if (strcmp(cfg.pattern, "random") == 0) {
+        qt.pattern = PATTERN_RANDOM;
+    } else if (strcmp(cfg.pattern, "zipf") == 0) {
+        qt.pattern = PATTERN_ZIPF;
+    } else {
+        fprintf(stderr, "Unknown access pattern '%s'\n", cfg.pattern);
+        return 1;
+    }
+
+    int nqueues = parse_list(cfg.sweep_queue, queues, cfg.queue_len);
+    int nios = parse_list(cfg.sweep_io, ios, cfg.io);
+
     if (cfg.buffer & (CAPI_CACHELINE_BYTES-1)) {
         fprintf(stderr, "Buffer must be a multiple of the cache line size (%d)\n",
                 CAPI_CACHELINE_BYTES);
         return 1;
     }
-    if (cfg.io & (CAPI_CACHELINE_BYTES-1)) {
-        fprintf(stderr, "IO size must be a multiple of the cache line size (%d)\n",
-                CAPI_CACHELINE_BYTES);
+
+    for (int i = 0; i < nios; i++) {
+        if (ios[i] == 0 || ios[i] & (CAPI_CACHELINE_BYTES-1)) {
+            fprintf(stderr, "IO size must be a multiple of the cache line size (%d)\n",
+                    CAPI_CACHELINE_BYTES);
+            return 1;
+        }
+
+        if (ios[i] > cfg.buffer) {
+            fprintf(stderr, "IO size must not be larger than the buffer\n");
+            return 1;
+        }
+    }
+
+    for (int i = 0; i < nqueues; i++) {
+        if (queues[i] == 0) {
+            fprintf(stderr, "Queue length must be greater than zero\n");
+            return 1;
+        }
+    }
+
+    if (cfg.numio == 0) {
+        fprintf(stderr, "Number of IOs must be greater than zero\n");
         return 1;
     }
 
@@ -225,60 +531,38 @@ int main (int argc, char *argv[])
     printf("Buffer %p - Len %ld\n", qt.buffer, cfg.buffer);
 
     snooper_init(&MMIO->snooper);
-    if (wqueue_init(cfg.device, &MMIO->wq, cfg.queue_len)) {
-        perror("Initializing wqueue");
-        return 1;
-    }
-
-    if (cfg.seed) {
-        cxl->mmio_write64(wqueue_afu(), &MMIO->lfsr_seed, cfg.seed);
-        srand(cfg.seed);
-    }
-
-    if (!cfg.software && cfg.croom >= 0)
-        wqueue_set_croom(cfg.croom);
 
     qt.bufsize = cfg.buffer;
-    qt.iosize = cfg.io;
     qt.rwmix = cfg.rwmix;
     qt.numio = cfg.numio;
+    qt.threads = cfg.threads;
+    pthread_mutex_init(&qt.push_lock, NULL);
+
+    int detail = nqueues == 1 && nios == 1;
+    if (!detail)
+        printf("\n%6s %10s %12s %10s %10s %10s %10s\n", "queue", "io",
+               "IOPS", "MiB/s", "p50_us", "p99_us", "p99.9_us");
+
+    for (int i = 0; i < nios && !ret; i++) {
+        double *cdf = NULL;
+        if (qt.pattern == PATTERN_ZIPF) {
+            cdf = zipf_cdf(cfg.buffer / ios[i], cfg.zipf_theta);
+            if (cdf == NULL) {
+                perror("Allocating zipf table");
+                ret = 1;
+                break;
+            }
+        }
+        qt.zipf_cdf = cdf;
 
-    double hw_duration = 0;
-    struct timeval start_time;
-    gettimeofday(&start_time, NULL);
-
-    worker_start(&qt.worker, 1, queue_thread);
-    int io_count = pop_loop(&hw_duration);
-
-    struct timeval end_time;
-    gettimeofday(&end_time, NULL);
-
-    if (io_count < 0)
-        return 2;
+        for (int j = 0; j < nqueues && !ret; j++)
+            ret = run_one(&cfg, &qt, queues[j], ios[i], detail);
 
-    if (!cfg.software && cfg.verbose) {
-        snooper_dump(wqueue_afu());
-        snooper_tag_usage(wqueue_afu());
-        snooper_tag_stats(wqueue_afu(), cfg.verbose);
+        free(cdf);
     }
 
-    double read_bytes = qt.reads * cfg.io;
-    double wrote_bytes = qt.writes * cfg.io;
-    const char *read_suffix = suffix_dbinary_get(&read_bytes);
-    const char *wrote_suffix = suffix_dbinary_get(&wrote_bytes);
-
-    printf("\nRead:  %6.2f%sB\n", read_bytes, read_suffix);
-    printf("Wrote: %6.2f%sB\n\n", wrote_bytes, wrote_suffix);
-
-
-    printf("Hardware rate:  ");
-    report_transfer_bin_rate_elapsed(stdout, hw_duration, cfg.io*io_count);
-    printf("\n");
-    printf("Software rate:  ");
-    report_transfer_bin_rate(stdout, &start_time, &end_time, cfg.io*io_count);
-    printf("\n");
-
-    wqueue_cleanup();
+    pthread_mutex_destroy(&qt.push_lock);
+    free(qt.buffer);
 
     return ret;
 }
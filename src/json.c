@@ -0,0 +1,149 @@
+////////////////////////////////////////////////////////////////////////
+//
+// Copyright 2015 PMC-Sierra, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you
+// may not use this file except in compliance with the License. You may
+// obtain a copy of the License at
+// http://www.apache.org/licenses/LICENSE-2.0 Unless required by
+// applicable law or agreed to in writing, software distributed under the
+// License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+// CONDITIONS OF ANY KIND, either express or implied. See the License for
+// the specific language governing permissions and limitations under the
+// License.
+//
+////////////////////////////////////////////////////////////////////////
+
+////////////////////////////////////////////////////////////////////////
+//
+//   Author: Logan Gunthorpe
+//
+//   Description:
+//     Minimal streaming JSON writer. Each top level object is written
+//     on a single line so the output can be consumed as JSON Lines.
+//
+////////////////////////////////////////////////////////////////////////
+
+#include "json.h"
+
+#include <math.h>
+
+void json_init(struct json *j, FILE *out)
+{
+    j->out = out;
+    j->depth = 0;
+    j->need_comma[0] = 0;
+}
+
+static void write_string(FILE *out, const char *s)
+{
+    fputc('"', out);
+    for (; *s; s++) {
+        unsigned char c = *s;
+        switch (c) {
+        case '"':  fputs("\\\"", out); break;
+        case '\\': fputs("\\\\", out); break;
+        case '\n': fputs("\\n", out);  break;
+        case '\r': fputs("\\r", out);  break;
+        case '\t': fputs("\\t", out);  break;
+        default:
+            if (c < 0x20)
+                fprintf(out, "\\u%04x", c);
+            else
+                fputc(c, out);
+        }
+    }
+    fputc('"', out);
+}
+
+static void write_key(struct json *j, const char *key)
+{
+    if (j->need_comma[j->depth])
+        fputc(',', j->out);
+    j->need_comma[j->depth] = 1;
+
+    if (key != NULL) {
+        write_string(j->out, key);
+        fputc(':', j->out);
+    }
+}
+
+static void open_scope(struct json *j, const char *key, char c)
+{
+    write_key(j, key);
+    fputc(c, j->out);
+
+    if (j->depth < JSON_MAX_DEPTH - 1)
+        j->depth++;
+    j->need_comma[j->depth] = 0;
+}
+
+static void close_scope(struct json *j, char c)
+{
+    fputc(c, j->out);
+
+    if (j->depth > 0)
+        j->depth--;
+
+    if (j->depth == 0) {
+        j->need_comma[0] = 0;
+        fputc('\n', j->out);
+        fflush(j->out);
+    }
+}
+
+void json_obj_start(struct json *j, const char *key)
+{
+    open_scope(j, key, '{');
+}
+
+void json_obj_end(struct json *j)
+{
+    close_scope(j, '}');
+}
+
+void json_arr_start(struct json *j, const char *key)
+{
+    open_scope(j, key, '[');
+}
+
+void json_arr_end(struct json *j)
+{
+    close_scope(j, ']');
+}
+
+void json_str(struct json *j, const char *key, const char *val)
+{
+    write_key(j, key);
+    if (val == NULL)
+        fputs("null", j->out);
+    else
+        write_string(j->out, val);
+}
+
+void json_int(struct json *j, const char *key, long long val)
+{
+    write_key(j, key);
+    fprintf(j->out, "%lld", val);
+}
+
+void json_uint(struct json *j, const char *key, unsigned long long val)
+{
+    write_key(j, key);
+    fprintf(j->out, "%llu", val);
+}
+
+void json_double(struct json *j, const char *key, double val)
+{
+    write_key(j, key);
+    if (isfinite(val))
+        fprintf(j->out, "%.9g", val);
+    else
+        fputs("null", j->out);
+}
+
+void json_bool(struct json *j, const char *key, int val)
+{
+    write_key(j, key);
+    fputs(val ? "true" : "false", j->out);
+}
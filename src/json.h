@@ -0,0 +1,54 @@
+////////////////////////////////////////////////////////////////////////
+//
+// Copyright 2015 PMC-Sierra, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you
+// may not use this file except in compliance with the License. You may
+// obtain a copy of the License at
+// http://www.apache.org/licenses/LICENSE-2.0 Unless required by
+// applicable law or agreed to in writing, software distributed under the
+// License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+// CONDITIONS OF ANY KIND, either express or implied. See the License for
+// the specific language governing permissions and limitations under the
+// License.
+//
+////////////////////////////////////////////////////////////////////////
+
+////////////////////////////////////////////////////////////////////////
+//
+//   Author: Logan Gunthorpe
+//
+//   Description:
+//     Minimal streaming JSON writer. Each top level object is written
+//     on a single line so the output can be consumed as JSON Lines.
+//
+////////////////////////////////////////////////////////////////////////
+
+#ifndef JSON_H
+#define JSON_H
+
+#include <stdio.h>
+
+#define JSON_MAX_DEPTH 16
+
+struct json {
+    FILE *out;
+    int depth;
+    int need_comma[JSON_MAX_DEPTH];
+};
+
+void json_init(struct json *j, FILE *out);
+
+// Key should be NULL for the top level object and for array members
+void json_obj_start(struct json *j, const char *key);
+void json_obj_end(struct json *j);
+void json_arr_start(struct json *j, const char *key);
+void json_arr_end(struct json *j);
+
+void json_str(struct json *j, const char *key, const char *val);
+void json_int(struct json *j, const char *key, long long val);
+void json_uint(struct json *j, const char *key, unsigned long long val);
+void json_double(struct json *j, const char *key, double val);
+void json_bool(struct json *j, const char *key, int val);
+
+#endif
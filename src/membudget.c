@@ -0,0 +1,130 @@
+////////////////////////////////////////////////////////////////////////
+//
+// Copyright 2015 PMC-Sierra, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you
+// may not use this file except in compliance with the License. You may
+// obtain a copy of the License at
+// http://www.apache.org/licenses/LICENSE-2.0 Unless required by
+// applicable law or agreed to in writing, software distributed under the
+// License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+// CONDITIONS OF ANY KIND, either express or implied. See the License for
+// the specific language governing permissions and limitations under the
+// License.
+//
+////////////////////////////////////////////////////////////////////////
+
+////////////////////////////////////////////////////////////////////////
+//
+//   Author: Logan Gunthorpe
+//
+//   Description:
+//     Byte credit counter capping the memory held by live chunk
+//     buffers.
+//
+////////////////////////////////////////////////////////////////////////
+
+#include "membudget.h"
+
+#include <argconfig/suffix.h>
+
+#include <pthread.h>
+#include <stdlib.h>
+
+struct membudget {
+    size_t limit;
+    size_t used;
+    size_t peak;
+    unsigned long waits;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+};
+
+struct membudget *membudget_new(size_t limit)
+{
+    struct membudget *b = calloc(1, sizeof(*b));
+    if (b == NULL)
+        return NULL;
+
+    b->limit = limit;
+
+    if (pthread_mutex_init(&b->mutex, NULL))
+        goto error_out;
+
+    if (pthread_cond_init(&b->cond, NULL))
+        goto error_mutex_out;
+
+    return b;
+
+error_mutex_out:
+    pthread_mutex_destroy(&b->mutex);
+error_out:
+    free(b);
+    return NULL;
+}
+
+void membudget_free(struct membudget *b)
+{
+    if (b == NULL) return;
+
+    pthread_cond_destroy(&b->cond);
+    pthread_mutex_destroy(&b->mutex);
+    free(b);
+}
+
+void membudget_acquire(struct membudget *b, size_t bytes)
+{
+    pthread_mutex_lock(&b->mutex);
+
+    if (b->used && b->used + bytes > b->limit) {
+        b->waits++;
+        while (b->used && b->used + bytes > b->limit)
+            pthread_cond_wait(&b->cond, &b->mutex);
+    }
+
+    b->used += bytes;
+    if (b->used > b->peak)
+        b->peak = b->used;
+
+    pthread_mutex_unlock(&b->mutex);
+}
+
+void membudget_release(struct membudget *b, size_t bytes)
+{
+    pthread_mutex_lock(&b->mutex);
+    b->used -= bytes;
+    pthread_cond_signal(&b->cond);
+    pthread_mutex_unlock(&b->mutex);
+}
+
+size_t membudget_limit(struct membudget *b)
+{
+    return b->limit;
+}
+
+size_t membudget_peak(struct membudget *b)
+{
+    return b->peak;
+}
+
+void membudget_print(struct membudget *b, FILE *out)
+{
+    double peak = b->peak;
+    double limit = b->limit;
+    const char *peak_suffix = suffix_dbinary_get(&peak);
+    const char *limit_suffix = suffix_dbinary_get(&limit);
+
+    fprintf(out, "Memory:\n  peak %.2f%sB of %.2f%sB budget, %lu waits\n",
+            peak, peak_suffix, limit, limit_suffix, b->waits);
+}
+
+void membudget_json(struct membudget *b, struct json *j)
+{
+    if (b == NULL) return;
+
+    json_obj_start(j, "memory");
+    json_uint(j, "budget", b->limit);
+    json_uint(j, "peak", b->peak);
+    json_uint(j, "waits", b->waits);
+    json_obj_end(j);
+}
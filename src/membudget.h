@@ -0,0 +1,50 @@
+////////////////////////////////////////////////////////////////////////
+//
+// Copyright 2015 PMC-Sierra, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you
+// may not use this file except in compliance with the License. You may
+// obtain a copy of the License at
+// http://www.apache.org/licenses/LICENSE-2.0 Unless required by
+// applicable law or agreed to in writing, software distributed under the
+// License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+// CONDITIONS OF ANY KIND, either express or implied. See the License for
+// the specific language governing permissions and limitations under the
+// License.
+//
+////////////////////////////////////////////////////////////////////////
+
+////////////////////////////////////////////////////////////////////////
+//
+//   Author: Logan Gunthorpe
+//
+//   Description:
+//     Byte credit counter capping the memory held by live chunk
+//     buffers.
+//
+////////////////////////////////////////////////////////////////////////
+
+#ifndef MEMBUDGET_H
+#define MEMBUDGET_H
+
+#include "json.h"
+
+#include <stdio.h>
+#include <stddef.h>
+
+struct membudget *membudget_new(size_t limit);
+void membudget_free(struct membudget *b);
+
+// Blocks until bytes fit in the budget. A request larger than the
+// whole budget is let through once nothing else is held so it can't
+// block forever.
+void membudget_acquire(struct membudget *b, size_t bytes);
+void membudget_release(struct membudget *b, size_t bytes);
+
+size_t membudget_limit(struct membudget *b);
+size_t membudget_peak(struct membudget *b);
+
+void membudget_print(struct membudget *b, FILE *out);
+void membudget_json(struct membudget *b, struct json *j);
+
+#endif
@@ -0,0 +1,164 @@
+////////////////////////////////////////////////////////////////////////
+//
+// Copyright 2015 PMC-Sierra, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you
+// may not use this file except in compliance with the License. You may
+// obtain a copy of the License at
+// http://www.apache.org/licenses/LICENSE-2.0 Unless required by
+// applicable law or agreed to in writing, software distributed under the
+// License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+// CONDITIONS OF ANY KIND, either express or implied. See the License for
+// the specific language governing permissions and limitations under the
+// License.
+//
+////////////////////////////////////////////////////////////////////////
+
+////////////////////////////////////////////////////////////////////////
+//
+//   Author: Logan Gunthorpe
+//
+//   Description:
+//     The blocks (read thread chunks) of a file as the trigram sidecars
+//     see them: the per-block bookkeeping while a sidecar is built, and
+//     turning the candidate blocks of a query into the ranges to read.
+//
+////////////////////////////////////////////////////////////////////////
+
+#include "ngblocks.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+int ngblocks_init(struct ngblocks *nb, size_t elem_size)
+{
+    memset(nb, 0, sizeof(*nb));
+    nb->elem_size = elem_size;
+
+    return pthread_mutex_init(&nb->mutex, NULL);
+}
+
+void ngblocks_destroy(struct ngblocks *nb)
+{
+    pthread_mutex_destroy(&nb->mutex);
+    free(nb->blocks);
+    nb->blocks = NULL;
+}
+
+void ngblock_info_init(struct ngblock_info *bi, struct readthrd_item *item)
+{
+    const unsigned char *buf = item->buf;
+    size_t len = item->real_bytes;
+
+    memset(bi, 0, sizeof(*bi));
+    bi->b.offset = item->offset;
+    bi->b.bytes = len;
+    bi->seen = 1;
+
+    memcpy(bi->head, buf, len < 2 ? len : 2);
+    memcpy(bi->tail, &buf[len < 2 ? 0 : len - 2], len < 2 ? len : 2);
+}
+
+int ngblocks_store(struct ngblocks *nb, unsigned idx,
+                   const struct ngblock_info *bi)
+{
+    int ret = -1;
+
+    pthread_mutex_lock(&nb->mutex);
+
+    if (idx >= nb->alloc) {
+        size_t alloc = nb->alloc ? nb->alloc : 256;
+        while (alloc <= idx)
+            alloc *= 2;
+
+        char *n = realloc(nb->blocks, alloc * nb->elem_size);
+        if (n == NULL)
+            goto out;
+
+        memset(&n[nb->alloc * nb->elem_size], 0,
+               (alloc - nb->alloc) * nb->elem_size);
+        nb->blocks = n;
+        nb->alloc = alloc;
+    }
+
+    if (idx >= nb->nblocks)
+        nb->nblocks = idx + 1;
+
+    memcpy(ngblocks_get(nb, idx), bi, nb->elem_size);
+    ret = 0;
+
+out:
+    pthread_mutex_unlock(&nb->mutex);
+    return ret;
+}
+
+int ngblocks_finish(struct ngblocks *nb,
+                    void (*add_gram)(void *arg, struct ngblock_info *bi,
+                                     const unsigned char *gram),
+                    void *arg)
+{
+    for (size_t i = 0; i < nb->nblocks; i++) {
+        if (!ngblocks_get(nb, i)->seen) {
+            errno = EIO;
+            return -1;
+        }
+    }
+
+    for (size_t i = 0; i + 1 < nb->nblocks; i++) {
+        struct ngblock_info *bi = ngblocks_get(nb, i);
+        struct ngblock_info *next = ngblocks_get(nb, i + 1);
+
+        next->b.contig = next->b.offset == bi->b.offset + bi->b.bytes;
+        if (!next->b.contig)
+            continue;
+
+        unsigned char w[4];
+        size_t tlen = bi->b.bytes < 2 ? bi->b.bytes : 2;
+        size_t hlen = next->b.bytes < 2 ? next->b.bytes : 2;
+
+        memcpy(w, bi->tail, tlen);
+        memcpy(&w[tlen], next->head, hlen);
+
+        for (size_t s = 0; s < tlen && s + 3 <= tlen + hlen; s++)
+            add_gram(arg, bi, &w[s]);
+    }
+
+    return 0;
+}
+
+int ngranges_init(struct ngranges *r, size_t nblocks, const char *phrase)
+{
+    memset(r, 0, sizeof(*r));
+    r->plen = strlen(phrase);
+
+    r->ranges = malloc((nblocks + 1) * sizeof(*r->ranges));
+    if (r->ranges == NULL)
+        return -1;
+
+    return 0;
+}
+
+void ngranges_add(struct ngranges *r, const struct ngblock *b, int cand)
+{
+    int prev = r->prev;
+
+    r->prev = cand;
+    if (!cand)
+        return;
+
+    r->candidates++;
+    r->candidate_bytes += b->bytes;
+
+    size_t end = b->offset + b->bytes + (r->plen ? r->plen - 1 : 0);
+
+    if (prev && b->contig) {
+        struct readthrd_range *rg = &r->ranges[r->count - 1];
+        rg->length = end - rg->offset;
+        return;
+    }
+
+    r->ranges[r->count].offset = b->offset;
+    r->ranges[r->count].length = end - b->offset;
+    r->count++;
+}
@@ -0,0 +1,111 @@
+////////////////////////////////////////////////////////////////////////
+//
+// Copyright 2015 PMC-Sierra, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you
+// may not use this file except in compliance with the License. You may
+// obtain a copy of the License at
+// http://www.apache.org/licenses/LICENSE-2.0 Unless required by
+// applicable law or agreed to in writing, software distributed under the
+// License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+// CONDITIONS OF ANY KIND, either express or implied. See the License for
+// the specific language governing permissions and limitations under the
+// License.
+//
+////////////////////////////////////////////////////////////////////////
+
+////////////////////////////////////////////////////////////////////////
+//
+//   Author: Logan Gunthorpe
+//
+//   Description:
+//     The blocks (read thread chunks) of a file as the trigram sidecars
+//     see them: the per-block bookkeeping while a sidecar is built, and
+//     turning the candidate blocks of a query into the ranges to read.
+//
+////////////////////////////////////////////////////////////////////////
+
+#ifndef NGBLOCKS_H
+#define NGBLOCKS_H
+
+#include "readthrd.h"
+
+#include <pthread.h>
+#include <stdint.h>
+
+// As stored in the sidecars
+struct ngblock {
+    uint64_t offset;
+    uint32_t bytes;
+    // Set if the block directly follows the previous one (no hole)
+    uint32_t contig;
+};
+
+// Kept for every block while a sidecar is built. Each sidecar puts it
+// first in its own per-block struct.
+struct ngblock_info {
+    struct ngblock b;
+    int seen;
+
+    // The trigrams crossing into the next block are added once both
+    // have been read
+    unsigned char head[2];
+    unsigned char tail[2];
+};
+
+// The blocks by item index, each elem_size bytes
+struct ngblocks {
+    size_t elem_size;
+    pthread_mutex_t mutex;
+    char *blocks;
+    size_t nblocks;
+    size_t alloc;
+};
+
+int ngblocks_init(struct ngblocks *nb, size_t elem_size);
+void ngblocks_destroy(struct ngblocks *nb);
+
+static inline struct ngblock_info *ngblocks_get(struct ngblocks *nb,
+                                                size_t i)
+{
+    return (struct ngblock_info *) &nb->blocks[i * nb->elem_size];
+}
+
+// Fill in the info of the block an item read
+void ngblock_info_init(struct ngblock_info *bi, struct readthrd_item *item);
+
+// Copy a block (elem_size bytes, starting with its info) into the
+// table. Called from any of the read threads.
+int ngblocks_store(struct ngblocks *nb, unsigned idx,
+                   const struct ngblock_info *bi);
+
+// Once the whole file has been read: set which blocks are contiguous
+// and give each block the trigrams which start in it but end in the
+// next one (through add_gram), so every trigram of a match starting
+// in a block is in that block or the next. Fails with EIO if a block
+// was never read.
+int ngblocks_finish(struct ngblocks *nb,
+                    void (*add_gram)(void *arg, struct ngblock_info *bi,
+                                     const unsigned char *gram),
+                    void *arg);
+
+// Runs of candidate blocks become one range, read on far enough to
+// find the matches which start in the last block and end in the next
+// (plen - 1 bytes). No match starts in that next block or it would be
+// in the run too.
+struct ngranges {
+    struct readthrd_range *ranges;
+    ssize_t count;
+    size_t plen;
+    int prev;
+
+    unsigned long candidates;
+    size_t candidate_bytes;
+};
+
+int ngranges_init(struct ngranges *r, size_t nblocks, const char *phrase);
+
+// Called for every block, in order
+void ngranges_add(struct ngranges *r, const struct ngblock *b, int cand);
+
+#endif
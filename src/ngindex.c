@@ -0,0 +1,494 @@
+////////////////////////////////////////////////////////////////////////
+//
+// Copyright 2015 PMC-Sierra, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you
+// may not use this file except in compliance with the License. You may
+// obtain a copy of the License at
+// http://www.apache.org/licenses/LICENSE-2.0 Unless required by
+// applicable law or agreed to in writing, software distributed under the
+// License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+// CONDITIONS OF ANY KIND, either express or implied. See the License for
+// the specific language governing permissions and limitations under the
+// License.
+//
+////////////////////////////////////////////////////////////////////////
+
+////////////////////////////////////////////////////////////////////////
+//
+//   Author: Logan Gunthorpe
+//
+//   Description:
+//     Trigram index of the blocks of a file: for every (hashed) trigram
+//     the list of blocks it appears in, so a search only has to read
+//     the blocks which could hold the phrase.
+//
+////////////////////////////////////////////////////////////////////////
+
+#include "ngindex.h"
+#include "ngblocks.h"
+
+#include <capi/macro.h>
+
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+// The file is a header, a table of the blocks, the start of each
+// bucket's postings (plus one for the end) and then the postings: the
+// ascending block numbers each bucket's trigrams appear in, as varint
+// deltas (the first is the block number plus one). Stored in host byte
+// order, it's only meant to be used where it was built.
+struct ngindex_header {
+    char magic[8];
+    uint64_t dev;
+    uint64_t ino;
+    uint64_t size;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    uint32_t bits;
+    uint32_t nblocks;
+    uint64_t postings_bytes;
+};
+
+struct block_info {
+    struct ngblock_info info;
+    uint32_t *buckets;
+    uint32_t nbuckets;
+};
+
+struct ngindex_builder {
+    unsigned bits;
+    struct ngblocks blocks;
+};
+
+struct ngindex {
+    void *map;
+    size_t map_len;
+    const struct ngindex_header *hdr;
+    const struct ngblock *blocks;
+    const uint64_t *starts;
+    const unsigned char *postings;
+
+    unsigned candidates;
+    size_t candidate_bytes;
+};
+
+static uint32_t bucket(const unsigned char *b, unsigned bits)
+{
+    uint32_t t = b[0] | b[1] << 8 | b[2] << 16;
+
+    return (t * 2654435761u) >> (32 - bits);
+}
+
+static int cmp_u32(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *) a;
+    uint32_t y = *(const uint32_t *) b;
+
+    return x < y ? -1 : x > y;
+}
+
+static struct block_info *block(struct ngindex_builder *b, size_t i)
+{
+    return container_of(ngblocks_get(&b->blocks, i), struct block_info, info);
+}
+
+struct ngindex_builder *ngindex_builder_new(unsigned bucket_bits)
+{
+    struct ngindex_builder *b = calloc(1, sizeof(*b));
+    if (b == NULL)
+        return NULL;
+
+    b->bits = bucket_bits;
+
+    if (ngblocks_init(&b->blocks, sizeof(struct block_info))) {
+        free(b);
+        return NULL;
+    }
+
+    return b;
+}
+
+void ngindex_builder_free(struct ngindex_builder *b)
+{
+    if (b == NULL) return;
+
+    for (size_t i = 0; i < b->blocks.nblocks; i++)
+        free(block(b, i)->buckets);
+
+    ngblocks_destroy(&b->blocks);
+    free(b);
+}
+
+void ngindex_visit(void *arg, struct readthrd_item *item)
+{
+    struct ngindex_builder *b = arg;
+    const unsigned char *buf = item->buf;
+    size_t len = item->real_bytes;
+
+    if (!len || item->pack)
+        return;
+
+    size_t words = ((size_t) 1 << b->bits) / 64;
+    uint64_t *bitmap = calloc(words, sizeof(*bitmap));
+    if (bitmap == NULL)
+        goto nomem;
+
+    struct block_info bi = {0};
+    ngblock_info_init(&bi.info, item);
+
+    size_t count = 0;
+    for (size_t i = 0; i + 3 <= len; i++) {
+        uint32_t bk = bucket(&buf[i], b->bits);
+        uint64_t bit = 1ULL << (bk % 64);
+
+        if (!(bitmap[bk / 64] & bit)) {
+            bitmap[bk / 64] |= bit;
+            count++;
+        }
+    }
+
+    // Room for the two trigrams crossing into the next block
+    bi.buckets = malloc((count + 2) * sizeof(*bi.buckets));
+    if (bi.buckets == NULL)
+        goto nomem;
+
+    for (size_t w = 0; w < words; w++) {
+        uint64_t v = bitmap[w];
+        while (v) {
+            bi.buckets[bi.nbuckets++] = w * 64 + __builtin_ctzll(v);
+            v &= v - 1;
+        }
+    }
+
+    free(bitmap);
+    if (ngblocks_store(&b->blocks, item->index, &bi.info))
+        goto nomem;
+
+    return;
+
+nomem:
+    perror("Building index");
+    exit(ENOMEM);
+}
+
+static void add_bucket(struct block_info *bi, uint32_t bk)
+{
+    if (bsearch(&bk, bi->buckets, bi->nbuckets, sizeof(bk), cmp_u32))
+        return;
+
+    bi->buckets[bi->nbuckets++] = bk;
+    qsort(bi->buckets, bi->nbuckets, sizeof(bk), cmp_u32);
+}
+
+static void add_crossing(void *arg, struct ngblock_info *info,
+                         const unsigned char *gram)
+{
+    struct ngindex_builder *b = arg;
+
+    add_bucket(container_of(info, struct block_info, info),
+               bucket(gram, b->bits));
+}
+
+static size_t varint_len(uint32_t v)
+{
+    size_t n = 1;
+
+    for (; v >= 0x80; v >>= 7)
+        n++;
+
+    return n;
+}
+
+static size_t varint_put(unsigned char *p, uint32_t v)
+{
+    size_t n = 0;
+
+    for (; v >= 0x80; v >>= 7)
+        p[n++] = (v & 0x7f) | 0x80;
+    p[n++] = v;
+
+    return n;
+}
+
+static uint32_t varint_get(const unsigned char **p)
+{
+    uint32_t v = 0;
+
+    for (int shift = 0; ; shift += 7) {
+        unsigned char c = *(*p)++;
+
+        v |= (uint32_t) (c & 0x7f) << shift;
+        if (!(c & 0x80))
+            return v;
+    }
+}
+
+int ngindex_write(struct ngindex_builder *b, const char *fpath,
+                  const struct stat *st)
+{
+    size_t nbuckets = (size_t) 1 << b->bits;
+    uint64_t *starts = NULL;
+    uint64_t *fill = NULL;
+    uint32_t *last = NULL;
+    char *tmp = NULL;
+    FILE *f = NULL;
+    int ret = -1;
+
+    size_t nblocks = b->blocks.nblocks;
+
+    if (ngblocks_finish(&b->blocks, add_crossing, b))
+        return -1;
+
+    starts = calloc(nbuckets + 1, sizeof(*starts));
+    fill = calloc(nbuckets, sizeof(*fill));
+    last = calloc(nbuckets, sizeof(*last));
+    if (starts == NULL || fill == NULL || last == NULL)
+        goto out;
+
+    // Blocks are visited in order so each bucket's list is ascending
+    for (size_t i = 0; i < nblocks; i++) {
+        for (size_t j = 0; j < block(b, i)->nbuckets; j++) {
+            uint32_t bk = block(b, i)->buckets[j];
+
+            starts[bk + 1] += varint_len(i + 1 - last[bk]);
+            last[bk] = i + 1;
+        }
+    }
+
+    for (size_t i = 0; i < nbuckets; i++)
+        starts[i + 1] += starts[i];
+
+    unsigned char *postings = malloc(starts[nbuckets] + 1);
+    if (postings == NULL)
+        goto out;
+
+    memset(last, 0, nbuckets * sizeof(*last));
+    for (size_t i = 0; i < nblocks; i++) {
+        for (size_t j = 0; j < block(b, i)->nbuckets; j++) {
+            uint32_t bk = block(b, i)->buckets[j];
+
+            fill[bk] += varint_put(&postings[starts[bk] + fill[bk]],
+                                   i + 1 - last[bk]);
+            last[bk] = i + 1;
+        }
+    }
+
+    struct ngindex_header hdr = {
+        .dev = st->st_dev,
+        .ino = st->st_ino,
+        .size = st->st_size,
+        .mtime_sec = st->st_mtim.tv_sec,
+        .mtime_nsec = st->st_mtim.tv_nsec,
+        .bits = b->bits,
+        .nblocks = nblocks,
+        .postings_bytes = starts[nbuckets],
+    };
+    memcpy(hdr.magic, NGINDEX_MAGIC, sizeof(hdr.magic));
+
+    if (asprintf(&tmp, "%s.%d", fpath, getpid()) < 0) {
+        tmp = NULL;
+        goto free_postings;
+    }
+
+    f = fopen(tmp, "wb");
+    if (f == NULL)
+        goto free_postings;
+
+    if (fwrite(&hdr, sizeof(hdr), 1, f) != 1)
+        goto close_file;
+
+    for (size_t i = 0; i < nblocks; i++)
+        if (fwrite(&block(b, i)->info.b, sizeof(struct ngblock), 1, f) != 1)
+            goto close_file;
+
+    if (fwrite(starts, sizeof(*starts), nbuckets + 1, f) != nbuckets + 1 ||
+        fwrite(postings, 1, hdr.postings_bytes, f) != hdr.postings_bytes)
+        goto close_file;
+
+    ret = fclose(f);
+    f = NULL;
+    if (!ret)
+        ret = rename(tmp, fpath);
+
+close_file:
+    if (f != NULL)
+        fclose(f);
+    if (ret)
+        unlink(tmp);
+free_postings:
+    free(postings);
+out:
+    free(tmp);
+    free(starts);
+    free(fill);
+    free(last);
+    return ret;
+}
+
+struct ngindex *ngindex_open(const char *fpath, const struct stat *st)
+{
+    struct ngindex *idx = calloc(1, sizeof(*idx));
+    struct stat ist;
+
+    if (idx == NULL)
+        return NULL;
+
+    int fd = open(fpath, O_RDONLY);
+    if (fd < 0)
+        goto free_idx;
+
+    if (fstat(fd, &ist))
+        goto close_fd;
+
+    idx->map_len = ist.st_size;
+    if (idx->map_len < sizeof(*idx->hdr)) {
+        errno = EINVAL;
+        goto close_fd;
+    }
+
+    idx->map = mmap(NULL, idx->map_len, PROT_READ, MAP_SHARED, fd, 0);
+    if (idx->map == MAP_FAILED)
+        goto close_fd;
+
+    const struct ngindex_header *h = idx->map;
+    idx->hdr = h;
+
+    size_t nbuckets = (size_t) 1 << h->bits;
+    if (memcmp(h->magic, NGINDEX_MAGIC, sizeof(h->magic)) != 0 ||
+        h->bits < 8 || h->bits > 28 ||
+        idx->map_len != sizeof(*h) + h->nblocks * sizeof(*idx->blocks) +
+            (nbuckets + 1) * sizeof(*idx->starts) +
+            h->postings_bytes) {
+        errno = EINVAL;
+        goto unmap;
+    }
+
+    if (h->dev != st->st_dev || h->ino != st->st_ino ||
+        h->size != st->st_size || h->mtime_sec != st->st_mtim.tv_sec ||
+        h->mtime_nsec != st->st_mtim.tv_nsec) {
+        errno = ESTALE;
+        goto unmap;
+    }
+
+    idx->blocks = (const void *) &h[1];
+    idx->starts = (const void *) &idx->blocks[h->nblocks];
+    idx->postings = (const void *) &idx->starts[nbuckets + 1];
+
+    if (idx->starts[nbuckets] != h->postings_bytes) {
+        errno = EINVAL;
+        goto unmap;
+    }
+
+    close(fd);
+    return idx;
+
+unmap:
+    munmap(idx->map, idx->map_len);
+close_fd:
+    close(fd);
+free_idx:
+    free(idx);
+    return NULL;
+}
+
+void ngindex_close(struct ngindex *idx)
+{
+    if (idx == NULL) return;
+
+    munmap(idx->map, idx->map_len);
+    free(idx);
+}
+
+ssize_t ngindex_query(struct ngindex *idx, const char *phrase,
+                      struct readthrd_range **ranges)
+{
+    const struct ngindex_header *h = idx->hdr;
+    const unsigned char *p = (const unsigned char *) phrase;
+    size_t plen = strlen(phrase);
+    size_t nblocks = h->nblocks;
+    struct ngranges r;
+
+    if (ngranges_init(&r, nblocks, phrase))
+        return -1;
+
+    unsigned char *cand = malloc(nblocks + 1);
+    unsigned char *mask = malloc(nblocks + 1);
+    if (cand == NULL || mask == NULL) {
+        free(cand);
+        free(mask);
+        free(r.ranges);
+        return -1;
+    }
+
+    // Shorter phrases have no trigrams to look up, every block is a
+    // candidate
+    memset(cand, 1, nblocks);
+
+    for (size_t i = 0; i + 3 <= plen; i++) {
+        uint32_t bk = bucket(&p[i], h->bits);
+
+        // A trigram in a block could also belong to a match starting
+        // in the block before
+        memset(mask, 0, nblocks);
+        const unsigned char *pos = &idx->postings[idx->starts[bk]];
+        const unsigned char *end = &idx->postings[idx->starts[bk + 1]];
+        uint32_t blk = 0;
+
+        while (pos < end) {
+            blk += varint_get(&pos);
+            if (blk > nblocks)
+                break;
+
+            mask[blk - 1] = 1;
+            if (blk > 1 && idx->blocks[blk - 1].contig)
+                mask[blk - 2] = 1;
+        }
+
+        for (size_t b = 0; b < nblocks; b++)
+            cand[b] &= mask[b];
+    }
+
+    for (size_t b = 0; b < nblocks; b++)
+        ngranges_add(&r, &idx->blocks[b], cand[b]);
+
+    idx->candidates = r.candidates;
+    idx->candidate_bytes = r.candidate_bytes;
+    *ranges = r.ranges;
+
+    free(cand);
+    free(mask);
+    return r.count;
+}
+
+unsigned ngindex_blocks(struct ngindex *idx)
+{
+    return idx->hdr->nblocks;
+}
+
+unsigned ngindex_candidates(struct ngindex *idx)
+{
+    return idx->candidates;
+}
+
+void ngindex_print(struct ngindex *idx, FILE *out)
+{
+    fprintf(out, "Index: %u of %u blocks (%zu bytes) searched\n",
+            idx->candidates, idx->hdr->nblocks, idx->candidate_bytes);
+}
+
+void ngindex_json(struct ngindex *idx, struct json *j)
+{
+    if (idx == NULL) return;
+
+    json_obj_start(j, "index");
+    json_uint(j, "blocks", idx->hdr->nblocks);
+    json_uint(j, "candidate_blocks", idx->candidates);
+    json_uint(j, "candidate_bytes", idx->candidate_bytes);
+    json_obj_end(j);
+}
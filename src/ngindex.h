@@ -0,0 +1,70 @@
+////////////////////////////////////////////////////////////////////////
+//
+// Copyright 2015 PMC-Sierra, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you
+// may not use this file except in compliance with the License. You may
+// obtain a copy of the License at
+// http://www.apache.org/licenses/LICENSE-2.0 Unless required by
+// applicable law or agreed to in writing, software distributed under the
+// License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+// CONDITIONS OF ANY KIND, either express or implied. See the License for
+// the specific language governing permissions and limitations under the
+// License.
+//
+////////////////////////////////////////////////////////////////////////
+
+////////////////////////////////////////////////////////////////////////
+//
+//   Author: Logan Gunthorpe
+//
+//   Description:
+//     Trigram index of the blocks of a file: for every (hashed) trigram
+//     the list of blocks it appears in, so a search only has to read
+//     the blocks which could hold the phrase.
+//
+////////////////////////////////////////////////////////////////////////
+
+#ifndef NGINDEX_H
+#define NGINDEX_H
+
+#include "readthrd.h"
+
+#include <sys/stat.h>
+#include <stdio.h>
+#include <stdint.h>
+
+#define NGINDEX_MAGIC "TSNGI001"
+#define NGINDEX_DEFAULT_BITS 20
+
+// Blocks are the chunks the index was built with, a phrase can't be
+// longer than one
+#define NGINDEX_MIN_BLOCK 4096
+
+// The index is built from the chunks as the read threads read them
+// (ngindex_visit is the readthrd visit callback) and written once the
+// whole file has been read.
+struct ngindex_builder *ngindex_builder_new(unsigned bucket_bits);
+void ngindex_visit(void *arg, struct readthrd_item *item);
+int ngindex_write(struct ngindex_builder *b, const char *fpath,
+                  const struct stat *st);
+void ngindex_builder_free(struct ngindex_builder *b);
+
+// The index file is mapped, not read. Open fails with ESTALE if the
+// input has changed since the index was built.
+struct ngindex *ngindex_open(const char *fpath, const struct stat *st);
+void ngindex_close(struct ngindex *idx);
+
+// Find the byte ranges to search for phrase: the runs of blocks where
+// a match could start, extended to take in the matches running into
+// the next block. Returns the number of ranges (in *ranges, to be
+// freed) or -1 on error.
+ssize_t ngindex_query(struct ngindex *idx, const char *phrase,
+                      struct readthrd_range **ranges);
+
+unsigned ngindex_blocks(struct ngindex *idx);
+unsigned ngindex_candidates(struct ngindex *idx);
+void ngindex_print(struct ngindex *idx, FILE *out);
+void ngindex_json(struct ngindex *idx, struct json *j);
+
+#endif
@@ -0,0 +1,121 @@
+////////////////////////////////////////////////////////////////////////
+//
+// Copyright 2015 PMC-Sierra, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you
+// may not use this file except in compliance with the License. You may
+// obtain a copy of the License at
+// http://www.apache.org/licenses/LICENSE-2.0 Unless required by
+// applicable law or agreed to in writing, software distributed under the
+// License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+// CONDITIONS OF ANY KIND, either express or implied. See the License for
+// the specific language governing permissions and limitations under the
+// License.
+//
+////////////////////////////////////////////////////////////////////////
+
+////////////////////////////////////////////////////////////////////////
+//
+//   Author: Logan Gunthorpe
+//
+//   Description:
+//     Partial result files: the matches found in one shard (byte range)
+//     of an input, so the results of several shards can be merged.
+//
+////////////////////////////////////////////////////////////////////////
+
+#include "partial.h"
+
+#include <endian.h>
+#include <errno.h>
+#include <string.h>
+
+static int write_header(struct partial *p)
+{
+    struct partial_header h = p->hdr;
+
+    h.offset = htole64(h.offset);
+    h.length = htole64(h.length);
+    h.count = htole64(h.count);
+
+    if (fseeko(p->f, 0, SEEK_SET) ||
+        fwrite(&h, sizeof(h), 1, p->f) != 1)
+        return -1;
+
+    return 0;
+}
+
+int partial_create(struct partial *p, const char *fpath, const char *phrase,
+                   uint64_t offset, uint64_t length)
+{
+    memset(&p->hdr, 0, sizeof(p->hdr));
+    memcpy(p->hdr.magic, PARTIAL_MAGIC, sizeof(p->hdr.magic));
+    strncpy(p->hdr.phrase, phrase, sizeof(p->hdr.phrase) - 1);
+    p->hdr.offset = offset;
+    p->hdr.length = length;
+
+    p->f = fopen(fpath, "wb");
+    if (p->f == NULL)
+        return -1;
+
+    // The count gets filled in when the file is closed
+    if (write_header(p)) {
+        fclose(p->f);
+        return -1;
+    }
+
+    return 0;
+}
+
+int partial_add(struct partial *p, uint64_t offset)
+{
+    uint64_t le = htole64(offset);
+
+    if (fwrite(&le, sizeof(le), 1, p->f) != 1)
+        return -1;
+
+    p->hdr.count++;
+    return 0;
+}
+
+int partial_close(struct partial *p)
+{
+    int ret = write_header(p);
+
+    if (fclose(p->f))
+        ret = -1;
+
+    return ret;
+}
+
+int partial_open(struct partial *p, const char *fpath)
+{
+    p->f = fopen(fpath, "rb");
+    if (p->f == NULL)
+        return -1;
+
+    if (fread(&p->hdr, sizeof(p->hdr), 1, p->f) != 1 ||
+        memcmp(p->hdr.magic, PARTIAL_MAGIC, sizeof(p->hdr.magic)) != 0) {
+        fclose(p->f);
+        errno = EINVAL;
+        return -1;
+    }
+
+    p->hdr.offset = le64toh(p->hdr.offset);
+    p->hdr.length = le64toh(p->hdr.length);
+    p->hdr.count = le64toh(p->hdr.count);
+    p->hdr.phrase[sizeof(p->hdr.phrase) - 1] = 0;
+
+    return 0;
+}
+
+int partial_next(struct partial *p, uint64_t *offset)
+{
+    uint64_t le;
+
+    if (fread(&le, sizeof(le), 1, p->f) != 1)
+        return ferror(p->f) ? -1 : 0;
+
+    *offset = le64toh(le);
+    return 1;
+}
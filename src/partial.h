@@ -0,0 +1,63 @@
+////////////////////////////////////////////////////////////////////////
+//
+// Copyright 2015 PMC-Sierra, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you
+// may not use this file except in compliance with the License. You may
+// obtain a copy of the License at
+// http://www.apache.org/licenses/LICENSE-2.0 Unless required by
+// applicable law or agreed to in writing, software distributed under the
+// License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+// CONDITIONS OF ANY KIND, either express or implied. See the License for
+// the specific language governing permissions and limitations under the
+// License.
+//
+////////////////////////////////////////////////////////////////////////
+
+////////////////////////////////////////////////////////////////////////
+//
+//   Author: Logan Gunthorpe
+//
+//   Description:
+//     Partial result files: the matches found in one shard (byte range)
+//     of an input, so the results of several shards can be merged.
+//
+////////////////////////////////////////////////////////////////////////
+
+#ifndef PARTIAL_H
+#define PARTIAL_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#define PARTIAL_MAGIC "TSPART01"
+
+// All fields are stored little endian. The header is followed by
+// count 64-bit match offsets in ascending order. The offsets are
+// relative to the start of the input, not the shard, and every match
+// starts inside [offset, offset + length).
+struct partial_header {
+    char magic[8];
+    uint64_t offset;
+    uint64_t length;
+    uint64_t count;
+    char phrase[24];
+};
+
+struct partial {
+    FILE *f;
+    struct partial_header hdr;
+};
+
+int partial_create(struct partial *p, const char *fpath, const char *phrase,
+                   uint64_t offset, uint64_t length);
+int partial_add(struct partial *p, uint64_t offset);
+// Writes the final count and closes the file
+int partial_close(struct partial *p);
+
+// Opens a partial file for reading and checks its header
+int partial_open(struct partial *p, const char *fpath);
+// Returns 1 with the next offset, 0 at the end or -1 on error
+int partial_next(struct partial *p, uint64_t *offset);
+
+#endif
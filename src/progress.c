@@ -0,0 +1,201 @@
+////////////////////////////////////////////////////////////////////////
+//
+// Copyright 2015 PMC-Sierra, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you
+// may not use this file except in compliance with the License. You may
+// obtain a copy of the License at
+// http://www.apache.org/licenses/LICENSE-2.0 Unless required by
+// applicable law or agreed to in writing, software distributed under the
+// License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+// CONDITIONS OF ANY KIND, either express or implied. See the License for
+// the specific language governing permissions and limitations under the
+// License.
+//
+////////////////////////////////////////////////////////////////////////
+
+////////////////////////////////////////////////////////////////////////
+//
+//   Author: Logan Gunthorpe
+//
+//   Description:
+//     Timer thread which periodically samples the read and write
+//     thread counters and reports on the progress of a scan.
+//
+////////////////////////////////////////////////////////////////////////
+
+#include "progress.h"
+#include "stats.h"
+#include "cpusample.h"
+
+#include <argconfig/suffix.h>
+
+#include <pthread.h>
+#include <time.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <stdio.h>
+
+struct progress {
+    struct readthrd *rt;
+    struct writethrd *wt;
+    unsigned interval;
+    struct json *json;
+    double start;
+
+    double last_time;
+    size_t last_done;
+    int printed;
+
+    int stop;
+    pthread_t thrd;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+};
+
+static void print_line(size_t submitted, size_t done, double rate,
+                       double avg_rate, unsigned long in_flight, double eta)
+{
+    double sub = submitted, dn = done;
+    const char *sub_suffix = suffix_dbinary_get(&sub);
+    const char *dn_suffix = suffix_dbinary_get(&dn);
+    const char *rate_suffix = suffix_dbinary_get(&rate);
+    const char *avg_suffix = suffix_dbinary_get(&avg_rate);
+
+    fprintf(stderr, "\r%6.2f%sB submitted, %6.2f%sB done, "
+            "%6.2f%sB/s (avg %6.2f%sB/s), %3lu in flight",
+            sub, sub_suffix, dn, dn_suffix, rate, rate_suffix,
+            avg_rate, avg_suffix, in_flight);
+
+    if (eta >= 0)
+        fprintf(stderr, ", ETA %4.0fs  ", eta);
+    else
+        fprintf(stderr, ", ETA    ?s  ");
+}
+
+static void report(struct progress *p)
+{
+    double now = stats_now();
+    double elapsed = now - p->start;
+    size_t total = readthrd_total_bytes(p->rt);
+    size_t submitted, done;
+    unsigned long in_flight = 0;
+
+    if (p->wt == NULL) {
+        submitted = done = readthrd_bytes_read(p->rt);
+    } else {
+        submitted = readthrd_bytes_submitted(p->rt);
+        done = writethrd_bytes_done(p->wt);
+        in_flight = readthrd_chunks_submitted(p->rt) -
+            writethrd_chunks_done(p->wt);
+    }
+
+    double rate = (done - p->last_done) / (now - p->last_time);
+    double avg_rate = done / elapsed;
+    double eta = -1;
+    if (avg_rate > 0 && !readthrd_is_stream(p->rt))
+        eta = total > done ? (total - done) / avg_rate : 0;
+
+    p->last_time = now;
+    p->last_done = done;
+
+    if (p->json == NULL) {
+        print_line(submitted, done, rate, avg_rate, in_flight, eta);
+        p->printed = 1;
+        return;
+    }
+
+    struct json *j = p->json;
+
+    json_obj_start(j, NULL);
+    json_str(j, "type", "progress");
+    json_double(j, "elapsed_s", elapsed);
+    json_uint(j, "bytes_total", total);
+    json_uint(j, "bytes_read", readthrd_bytes_read(p->rt));
+    json_uint(j, "bytes_submitted", submitted);
+    json_uint(j, "bytes_done", done);
+    json_uint(j, "chunks_in_flight", in_flight);
+    json_double(j, "rate_Bps", rate);
+    json_double(j, "avg_rate_Bps", avg_rate);
+    if (eta >= 0)
+        json_double(j, "eta_s", eta);
+    else
+        json_str(j, "eta_s", NULL);
+    json_obj_end(j);
+}
+
+static void *progress_thread(void *arg)
+{
+    struct progress *p = arg;
+    struct timespec deadline;
+
+    cpusample_register("progress", 0);
+
+    clock_gettime(CLOCK_REALTIME, &deadline);
+
+    pthread_mutex_lock(&p->mutex);
+    while (!p->stop) {
+        deadline.tv_sec += p->interval;
+        while (!p->stop &&
+               pthread_cond_timedwait(&p->cond, &p->mutex, &deadline) != ETIMEDOUT);
+
+        if (!p->stop)
+            report(p);
+    }
+    pthread_mutex_unlock(&p->mutex);
+
+    return NULL;
+}
+
+struct progress *progress_start(struct readthrd *rt, struct writethrd *wt,
+                                unsigned interval, struct json *json)
+{
+    struct progress *p = calloc(1, sizeof(*p));
+    if (p == NULL)
+        return NULL;
+
+    p->rt = rt;
+    p->wt = wt;
+    p->interval = interval;
+    p->json = json;
+    p->start = stats_now();
+    p->last_time = p->start;
+
+    if (pthread_mutex_init(&p->mutex, NULL))
+        goto error_out;
+
+    if (pthread_cond_init(&p->cond, NULL))
+        goto error_mutex_out;
+
+    if (pthread_create(&p->thrd, NULL, progress_thread, p))
+        goto error_cond_out;
+
+    return p;
+
+error_cond_out:
+    pthread_cond_destroy(&p->cond);
+error_mutex_out:
+    pthread_mutex_destroy(&p->mutex);
+error_out:
+    free(p);
+    return NULL;
+}
+
+void progress_stop(struct progress *p)
+{
+    if (p == NULL) return;
+
+    pthread_mutex_lock(&p->mutex);
+    p->stop = 1;
+    pthread_cond_signal(&p->cond);
+    pthread_mutex_unlock(&p->mutex);
+
+    pthread_join(p->thrd, NULL);
+
+    if (p->printed)
+        fprintf(stderr, "\n");
+
+    pthread_cond_destroy(&p->cond);
+    pthread_mutex_destroy(&p->mutex);
+    free(p);
+}
@@ -0,0 +1,39 @@
+////////////////////////////////////////////////////////////////////////
+//
+// Copyright 2015 PMC-Sierra, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you
+// may not use this file except in compliance with the License. You may
+// obtain a copy of the License at
+// http://www.apache.org/licenses/LICENSE-2.0 Unless required by
+// applicable law or agreed to in writing, software distributed under the
+// License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+// CONDITIONS OF ANY KIND, either express or implied. See the License for
+// the specific language governing permissions and limitations under the
+// License.
+//
+////////////////////////////////////////////////////////////////////////
+
+////////////////////////////////////////////////////////////////////////
+//
+//   Author: Logan Gunthorpe
+//
+//   Description:
+//     Timer thread which periodically samples the read and write
+//     thread counters and reports on the progress of a scan.
+//
+////////////////////////////////////////////////////////////////////////
+
+#ifndef PROGRESS_H
+#define PROGRESS_H
+
+#include "readthrd.h"
+#include "writethrd.h"
+#include "json.h"
+
+// If json is NULL a single status line is updated on stderr instead.
+struct progress *progress_start(struct readthrd *rt, struct writethrd *wt,
+                                unsigned interval, struct json *json);
+void progress_stop(struct progress *p);
+
+#endif
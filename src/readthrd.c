@@ -26,7 +26,17 @@
 ////////////////////////////////////////////////////////////////////////
 
 #include "readthrd.h"
+#include "reorder.h"
+#include "hybrid.h"
 #include "textswap.h"
+#include "stats.h"
+#include "cpusample.h"
+#include "affinity.h"
+#include "bufpool.h"
+#include "membudget.h"
+#include "filelist.h"
+#include "gunzip.h"
+#include "xxhash.h"
 
 #include <capi/worker.h>
 #include <capi/macro.h>
@@ -37,6 +47,8 @@
 #include <sys/stat.h>
 #include <sys/time.h>
 #include <sys/resource.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <pthread.h>
@@ -45,66 +57,262 @@
 #include <string.h>
 #include <stdio.h>
 
+// Alignment used for O_DIRECT on devices that report smaller (or no)
+// logical blocks
+#define DIRECT_ALIGN 4096
 
 struct readthrd {
     struct worker worker;
     const char *fpath;
+    struct filelist *files;
     struct fifo *input;
     int flags;
     ssize_t file_size;
-    struct readthrd_item **reorder_buf;
-    unsigned *reorder_idx;
-    int reorder_len;
+    unsigned block_size;
+    struct reorder reorder;
+    struct hybrid *hybrid;
+    struct bufpool *pool;
+    struct membudget *budget;
+    int stream;
+    int stream_fd;
+    int gzip;
+    volatile int stop;
+    size_t hole_bytes;
+
+    void (*visit)(void *arg, struct readthrd_item *item);
+    void *visit_arg;
+
+    const struct readthrd_range *ranges;
+    size_t nranges;
 
     pthread_t wqueue_thrd;
     struct rusage wqueue_rusage;
 
-    pthread_mutex_t mutex;
-    pthread_cond_t ready_cond;
-    pthread_cond_t free_cond;
+    int num_threads;
+    unsigned thread_seq;
+    struct rusage *read_rusage;
+    struct stats_hist read_hist;
+    size_t total_bytes;
+    size_t bytes_read;
+    size_t bytes_submitted;
+    unsigned long chunks_submitted;
 };
 
-static void *read_thread(void *arg)
+static void touch_pages(unsigned char *buf, size_t len)
 {
-    struct readthrd *rt = container_of(arg, struct readthrd, worker);
+    static long page_size;
 
-    int fd = open(rt->fpath, O_RDONLY);
-    if (fd < 0) {
-        perror("read thread open");
-        return NULL;
-    }
+    if (!page_size)
+        page_size = sysconf(_SC_PAGESIZE);
 
-    struct readthrd_item *item;
+    for (size_t i = 0; i < len; i += page_size)
+        buf[i] = 0;
+}
 
-    while ((item = fifo_pop(rt->input)) != NULL) {
+static size_t item_memsize(struct readthrd *rt, size_t bytes)
+{
+    if (rt->flags & READTHREAD_COPY)
+        return bytes;
+
+    // Leave room for the results
+    return bytes * sizeof(uint32_t);
+}
+
+// Once stopped, the chunks still in the pipeline are only passed along
+// so they keep their place in the order (and the last one can flush
+// the wqueue). Their results get thrown away.
+static void cancel_item(struct readthrd_item *item)
+{
+    if (item->bytes > CAPI_CACHELINE_BYTES)
+        item->bytes = CAPI_CACHELINE_BYTES;
+    item->real_bytes = 0;
+}
+
+static const char *item_path(struct readthrd *rt, struct readthrd_item *item)
+{
+    if (rt->files == NULL)
+        return rt->fpath;
+
+    return rt->files->files[item->file].path;
+}
+
+// Read a chunk of a single file. Direct reads have to cover whole
+// blocks so they may read past the end of the window, that part (and
+// the padding up to a cacheline) is cleared.
+static ssize_t read_chunk(struct readthrd *rt, int fd,
+                          struct readthrd_item *item, unsigned char *buf)
+{
+    ssize_t rd = 0;
+
+    if (fd >= 0) {
         lseek(fd, item->offset, SEEK_SET);
+        if (rt->flags & READTHREAD_DIRECT)
+            rd = read(fd, buf, item->bytes);
+        else
+            rd = read(fd, buf, item->real_bytes);
+    }
 
-        size_t memsize = item->bytes;
-        if (!(rt->flags & READTHREAD_COPY))
-            memsize *= sizeof(uint32_t);
+    if (rd < 0) {
+        perror("read thread read");
+        rd = 0;
+    }
+    if (rd > item->real_bytes)
+        rd = item->real_bytes;
+    memset(&buf[rd], 0, item->bytes - rd);
 
-        unsigned char *buf;
-        if ((buf = capi_alloc(memsize)) == NULL) {
+    return rd;
+}
+
+// Inflate the BGZF blocks of an item. zbuf is the reader's scratch
+// space for the compressed data, grown as needed.
+static ssize_t read_bgzf(int fd, struct readthrd_item *item,
+                         unsigned char *buf, void **zbuf, size_t *zbuf_len)
+{
+    ssize_t rd = 0;
+
+    if (*zbuf_len < item->zbytes) {
+        void *z = realloc(*zbuf, item->zbytes);
+        if (z == NULL) {
             perror("read thread alloc");
-            break;
+            exit(1);
+        }
+
+        *zbuf = z;
+        *zbuf_len = item->zbytes;
+    }
+
+    if (fd >= 0 && pread(fd, *zbuf, item->zbytes, item->zoffset) ==
+        item->zbytes)
+        rd = gunzip_inflate(*zbuf, item->zbytes, buf, item->real_bytes);
+    else if (fd >= 0)
+        perror("read thread read");
+
+    memset(&buf[rd], 0, item->bytes - rd);
+
+    return rd;
+}
+
+// Read each of the small files packed into an item into its place,
+// leaving zeros for the guards
+static ssize_t read_pack(struct readthrd *rt, struct readthrd_item *item,
+                         unsigned char *buf)
+{
+    ssize_t total = 0;
+
+    memset(buf, 0, item->bytes);
+
+    for (unsigned i = 0; i < item->npack; i++) {
+        struct readthrd_pack *pk = &item->pack[i];
+        const char *path = rt->files->files[pk->file].path;
+
+        int fd = open(path, O_RDONLY);
+        if (fd < 0) {
+            fprintf(stderr, "Unable to open '%s': %s\n", path,
+                    strerror(errno));
+            continue;
         }
 
-        ssize_t rd = read(fd, buf, item->bytes);
-        memset(&buf[rd], 0, item->bytes - rd);
+        ssize_t rd = read(fd, &buf[pk->start], pk->bytes);
+        if (rd < 0)
+            perror("read thread read");
+        else
+            total += rd;
+
+        close(fd);
+    }
+
+    return total;
+}
+
+static void *read_thread(void *arg)
+{
+    struct readthrd *rt = container_of(arg, struct readthrd, worker);
+    unsigned tid = __sync_fetch_and_add(&rt->thread_seq, 1);
+    cpusample_register("reader", tid);
+    affinity_pin(AFFINITY_READER);
+
+    int oflags = O_RDONLY;
+    if (rt->flags & READTHREAD_DIRECT)
+        oflags |= O_DIRECT;
+
+    // With several inputs the chunks of one file are spread over all
+    // the readers so each keeps the last file it read open.
+    int fd = -1;
+    unsigned fd_file = 0;
+
+    void *zbuf = NULL;
+    size_t zbuf_len = 0;
+
+    struct readthrd_item *item;
+
+    while ((item = fifo_pop(rt->input)) != NULL) {
+        if (item->pack == NULL && (fd < 0 || item->file != fd_file)) {
+            if (fd >= 0)
+                close(fd);
+
+            fd_file = item->file;
+            fd = open(item_path(rt, item), oflags);
+            if (fd < 0)
+                fprintf(stderr, "Unable to open '%s': %s\n",
+                        item_path(rt, item), strerror(errno));
+        }
+
+        size_t memsize = item_memsize(rt, item->bytes);
+
+        unsigned char *buf = item->buf;
+        if (buf == NULL) {
+            if (rt->flags & READTHREAD_DIRECT) {
+                void *p;
+                buf = posix_memalign(&p, rt->block_size, memsize) ? NULL : p;
+            } else {
+                buf = capi_alloc(memsize);
+            }
+
+            if (buf == NULL) {
+                perror("read thread alloc");
+                break;
+            }
+
+            // The read faults in the data pages from this thread, do
+            // the same for the result space so, when the reader is
+            // pinned, the whole buffer lands on its node rather than
+            // wherever the results happen to be written first.
+            if (memsize > item->bytes && affinity_is_set(AFFINITY_READER))
+                touch_pages(&buf[item->bytes], memsize - item->bytes);
+        }
 
         item->buf = buf;
 
-        pthread_mutex_lock(&rt->mutex);
-        int idx = item->index % rt->reorder_len;
-        while (rt->reorder_buf[idx] != NULL ||
-               rt->reorder_idx[idx] != item->index)
-            pthread_cond_wait(&rt->free_cond, &rt->mutex);
-        rt->reorder_buf[idx] = item;
-        pthread_cond_signal(&rt->ready_cond);
-        pthread_mutex_unlock(&rt->mutex);
+        if (rt->stop) {
+            cancel_item(item);
+            memset(buf, 0, item->bytes);
+            reorder_put(&rt->reorder, item->index, item);
+            continue;
+        }
+
+        double start = stats_now();
+        ssize_t rd;
+        if (item->pack)
+            rd = read_pack(rt, item, buf);
+        else if (item->zbytes)
+            rd = read_bgzf(fd, item, buf, &zbuf, &zbuf_len);
+        else
+            rd = read_chunk(rt, fd, item, buf);
+
+        if (rt->flags & READTHREAD_FINGERPRINT)
+            item->fingerprint = xxh64(buf, item->real_bytes, 0);
+        if (rt->visit)
+            rt->visit(rt->visit_arg, item);
+        stats_hist_add(&rt->read_hist, stats_now() - start);
+        __sync_add_and_fetch(&rt->bytes_read, rd);
+
+        reorder_put(&rt->reorder, item->index, item);
     }
 
-    close(fd);
+    if (fd >= 0)
+        close(fd);
+    free(zbuf);
+    getrusage(RUSAGE_THREAD, &rt->read_rusage[tid]);
     worker_finish_thread(&rt->worker);
 
     return NULL;
@@ -112,23 +320,14 @@ static void *read_thread(void *arg)
 
 static void *wqueue_thread(void *arg)
 {
-    int idx = 0;
     struct readthrd *rt = container_of(arg, struct readthrd, worker);
 
+    cpusample_register("wqueue_submit", 0);
+    affinity_pin(AFFINITY_SUBMIT);
+
     int last = 0;
     while(!last) {
-        pthread_mutex_lock(&rt->mutex);
-        while(rt->reorder_buf[idx] == NULL)
-            pthread_cond_wait(&rt->ready_cond, &rt->mutex);
-
-        struct readthrd_item *item = rt->reorder_buf[idx];
-        rt->reorder_idx[idx] += rt->reorder_len;
-        rt->reorder_buf[idx] = NULL;
-        pthread_cond_broadcast(&rt->free_cond);
-        idx++;
-        idx %= rt->reorder_len;
-        pthread_mutex_unlock(&rt->mutex);
-
+        struct readthrd_item *item = reorder_get(&rt->reorder);
         last = item->last;
 
         if (rt->flags & READTHREAD_VERBOSE)
@@ -136,8 +335,20 @@ static void *wqueue_thread(void *arg)
                    item->offset);
 
         if (rt->flags & READTHREAD_DISCARD) {
-            free(item->buf);
-            free(item);
+            readthrd_item_free(item);
+            continue;
+        }
+
+        if (rt->stop)
+            cancel_item(item);
+
+        // Counted before it's pushed: from then on the item may be
+        // freed, and the chunk counted as done, by the write side
+        __sync_add_and_fetch(&rt->bytes_submitted, item->real_bytes);
+        __sync_add_and_fetch(&rt->chunks_submitted, 1);
+
+        if (rt->hybrid) {
+            hybrid_dispatch(rt->hybrid, item);
             continue;
         }
 
@@ -161,23 +372,86 @@ static void *wqueue_thread(void *arg)
     return NULL;
 }
 
-static ssize_t check_file(const char *f)
+int readthrd_geometry(const char *fpath, int flags,
+                      struct readthrd_geometry *geom)
 {
-    int fd = open(f, O_RDONLY);
+    memset(geom, 0, sizeof(*geom));
+    geom->block_size = DIRECT_ALIGN;
+
+    // Streams are only checked with stat, opening (and closing) a FIFO
+    // here could break the pipe before it's read.
+    struct stat s;
+    int ret = strcmp(fpath, "-") == 0 ? fstat(STDIN_FILENO, &s) :
+        stat(fpath, &s);
+    if (ret) {
+        fprintf(stderr, "Unable to open '%s': %s\n", fpath, strerror(errno));
+        return -1;
+    }
+
+    if (S_ISFIFO(s.st_mode) || S_ISSOCK(s.st_mode) || S_ISCHR(s.st_mode) ||
+        strcmp(fpath, "-") == 0) {
+        geom->stream = 1;
+        return 0;
+    }
+
+    int fd = open(fpath, O_RDONLY);
     if (fd < 0) {
-        fprintf(stderr, "Unable to open '%s': %s\n", f, strerror(errno));
+        fprintf(stderr, "Unable to open '%s': %s\n", fpath, strerror(errno));
         return -1;
     }
 
-    struct stat s;
-    ssize_t ret = -1;
-    if (!fstat(fd, &s))
-        ret = s.st_size;
-    else
-        fprintf(stderr, "Unable to get file size of '%s': %s\n", f, strerror(errno));
+    if (fstat(fd, &s)) {
+        fprintf(stderr, "Unable to get file size of '%s': %s\n", fpath,
+                strerror(errno));
+        goto error_close;
+    }
+
+    geom->size = s.st_size;
+
+    if (S_ISBLK(s.st_mode)) {
+        // st_size is 0 for block devices
+        uint64_t size;
+        if (ioctl(fd, BLKGETSIZE64, &size)) {
+            fprintf(stderr, "Unable to get the size of '%s': %s\n", fpath,
+                    strerror(errno));
+            goto error_close;
+        }
+
+        int ssz;
+        if (!ioctl(fd, BLKSSZGET, &ssz) && ssz > DIRECT_ALIGN)
+            geom->block_size = ssz;
+
+        ioctl(fd, BLKIOOPT, &geom->io_opt);
+
+        geom->size = size;
+        geom->blockdev = 1;
+    }
+
+    if (!geom->blockdev && flags & READTHREAD_GUNZIP)
+        geom->gzip = gunzip_detect(fd);
 
     close(fd);
-    return ret;
+
+    if (!geom->blockdev && !(flags & READTHREAD_DIRECT))
+        return 0;
+
+    fd = open(fpath, O_RDONLY | O_DIRECT);
+    if (fd < 0 && errno == EINVAL) {
+        fprintf(stderr, "'%s' doesn't support O_DIRECT, using buffered "
+                "reads\n", fpath);
+        return 0;
+    } else if (fd < 0) {
+        fprintf(stderr, "Unable to open '%s': %s\n", fpath, strerror(errno));
+        return -1;
+    }
+
+    geom->direct = 1;
+    close(fd);
+    return 0;
+
+error_close:
+    close(fd);
+    return -1;
 }
 
 static int next_power_of_2(int x)
@@ -193,10 +467,11 @@ static int next_power_of_2(int x)
    return x;
 }
 
-struct readthrd *readthrd_start(const char *fpath,
-                                int num_threads, int flags)
+static struct readthrd *start(const char *fpath, struct filelist *files,
+                              int num_threads, int flags,
+                              struct hybrid *hybrid)
 {
-    struct readthrd *rt = malloc(sizeof(*rt));
+    struct readthrd *rt = calloc(1, sizeof(*rt));
     if (rt == NULL)
         return NULL;
 
@@ -205,36 +480,51 @@ struct readthrd *readthrd_start(const char *fpath,
         goto error_out;
     fifo_open(rt->input);
 
-    rt->file_size = check_file(fpath);
-    if (rt->file_size < 0)
+    struct readthrd_geometry geom;
+    if (files != NULL) {
+        // A list of files is always read through the page cache
+        memset(&geom, 0, sizeof(geom));
+        geom.size = files->total_size;
+        geom.block_size = DIRECT_ALIGN;
+    } else if (readthrd_geometry(fpath, flags, &geom)) {
         goto error_fifo_out;
+    }
 
+    if (geom.direct)
+        flags |= READTHREAD_DIRECT;
+    else
+        flags &= ~READTHREAD_DIRECT;
+
+    rt->stream = geom.stream;
+    rt->gzip = geom.gzip;
+    if (geom.stream && strcmp(fpath, "-") == 0) {
+        rt->stream_fd = STDIN_FILENO;
+    } else if (geom.stream) {
+        rt->stream_fd = open(fpath, O_RDONLY);
+        if (rt->stream_fd < 0) {
+            fprintf(stderr, "Unable to open '%s': %s\n", fpath,
+                    strerror(errno));
+            goto error_fifo_out;
+        }
+    }
+
+    rt->file_size = geom.size;
+    rt->block_size = geom.block_size;
     rt->fpath = fpath;
+    rt->files = files;
     rt->flags = flags;
+    rt->hybrid = hybrid;
 
-    rt->reorder_len = num_threads * 2;
-    rt->reorder_buf = calloc(rt->reorder_len, sizeof(*rt->reorder_buf));
-    if (rt->reorder_buf == NULL)
+    if (reorder_init(&rt->reorder, num_threads * 2))
         goto error_fifo_out;
 
-    rt->reorder_idx = malloc(rt->reorder_len * sizeof(*rt->reorder_idx));
-    if (rt->reorder_idx == NULL)
-        goto error_reorder_buf_out;
-
-    for (unsigned i = 0; i < rt->reorder_len; i++)
-        rt->reorder_idx[i] = i;
-
-    if (pthread_mutex_init(&rt->mutex, NULL))
+    rt->num_threads = num_threads;
+    rt->read_rusage = calloc(num_threads, sizeof(*rt->read_rusage));
+    if (rt->read_rusage == NULL)
         goto error_reorder_out;
 
-    if (pthread_cond_init(&rt->ready_cond, NULL))
-        goto error_mutex_out;
-
-    if (pthread_cond_init(&rt->free_cond, NULL))
-        goto error_ready_cond_out;
-
     if (pthread_create(&rt->wqueue_thrd, NULL, wqueue_thread, rt))
-        goto error_free_cond_out;
+        goto error_rusage_out;
 
     if (worker_start(&rt->worker, num_threads, read_thread))
         goto error_wqueue_stop;
@@ -243,16 +533,10 @@ struct readthrd *readthrd_start(const char *fpath,
 
 error_wqueue_stop:
     pthread_cancel(rt->wqueue_thrd);
-error_free_cond_out:
-    pthread_cond_destroy(&rt->free_cond);
-error_ready_cond_out:
-    pthread_cond_destroy(&rt->ready_cond);
-error_mutex_out:
-    pthread_mutex_destroy(&rt->mutex);
+error_rusage_out:
+    free(rt->read_rusage);
 error_reorder_out:
-    free(rt->reorder_idx);
-error_reorder_buf_out:
-    free(rt->reorder_buf);
+    reorder_destroy(&rt->reorder);
 error_fifo_out:
     fifo_free(rt->input);
 error_out:
@@ -260,12 +544,44 @@ error_out:
     return NULL;
 }
 
+struct readthrd *readthrd_start(const char *fpath,
+                                int num_threads, int flags,
+                                struct hybrid *hybrid)
+{
+    return start(fpath, NULL, num_threads, flags, hybrid);
+}
+
+struct readthrd *readthrd_start_files(struct filelist *files,
+                                      int num_threads, int flags,
+                                      struct hybrid *hybrid)
+{
+    return start(files->files[0].path, files, num_threads, flags, hybrid);
+}
+
+void readthrd_stop(struct readthrd *rt)
+{
+    rt->stop = 1;
+}
+
 void readthrd_print_cputime(struct readthrd *rt)
 {
     fprintf(stderr, "Read Thread CPU Time:\n");
     worker_print_cputime(&rt->worker, &rt->wqueue_rusage, "W");
 }
 
+void readthrd_json_threads(struct readthrd *rt, struct json *j)
+{
+    for (int i = 0; i < rt->num_threads; i++)
+        stats_thread_json(j, "reader", i, &rt->read_rusage[i]);
+
+    stats_thread_json(j, "wqueue_submit", 0, &rt->wqueue_rusage);
+}
+
+void readthrd_json_stages(struct readthrd *rt, struct json *j)
+{
+    stats_hist_json(j, "read", &rt->read_hist);
+}
+
 void readthrd_join(struct readthrd *rt)
 {
     worker_join(&rt->worker);
@@ -274,12 +590,13 @@ void readthrd_join(struct readthrd *rt)
 
 void readthrd_free(struct readthrd *rt)
 {
+    if (rt->stream && rt->stream_fd != STDIN_FILENO)
+        close(rt->stream_fd);
+
     worker_free(&rt->worker);
-    pthread_cond_destroy(&rt->free_cond);
-    pthread_cond_destroy(&rt->ready_cond);
-    pthread_mutex_destroy(&rt->mutex);
+    reorder_destroy(&rt->reorder);
     fifo_free(rt->input);
-    free(rt->reorder_buf);
+    free(rt->read_rusage);
     free(rt);
 }
 
@@ -291,49 +608,678 @@ static size_t round_to_cache_line(size_t x)
     return x;
 }
 
-size_t readthrd_run(struct readthrd *rt, size_t chunk_size, size_t read_size)
+// Direct reads must be whole blocks (which are whole cachelines too)
+static size_t round_chunk(struct readthrd *rt, size_t x)
+{
+    if (!(rt->flags & READTHREAD_DIRECT))
+        return round_to_cache_line(x);
+
+    return (x + rt->block_size - 1) / rt->block_size * rt->block_size;
+}
+
+void readthrd_set_bufpool(struct readthrd *rt, struct bufpool *pool)
+{
+    rt->pool = pool;
+}
+
+void readthrd_set_membudget(struct readthrd *rt, struct membudget *budget)
+{
+    rt->budget = budget;
+}
+
+void readthrd_set_visit(struct readthrd *rt,
+                        void (*visit)(void *arg, struct readthrd_item *item),
+                        void *arg)
+{
+    rt->visit = visit;
+    rt->visit_arg = arg;
+}
+
+void readthrd_set_ranges(struct readthrd *rt,
+                         const struct readthrd_range *ranges, size_t count)
+{
+    rt->ranges = ranges;
+    rt->nranges = count;
+}
+
+// Find the next extent of data at or after pos (and before end). Holes
+// read back as zeros which can never match the search phrase, so
+// there is no point reading them. Filesystems without SEEK_DATA
+// support report the whole file as data.
+static int next_extent(int fd, off_t pos, off_t end, off_t *start,
+                       off_t *stop)
+{
+    if (pos >= end)
+        return 0;
+
+    off_t data = lseek(fd, pos, SEEK_DATA);
+    if (data < 0) {
+        if (errno == ENXIO)
+            return 0;
+        data = pos;
+    }
+
+    if (data >= end)
+        return 0;
+
+    off_t hole = lseek(fd, data, SEEK_HOLE);
+    if (hole < 0 || hole > end)
+        hole = end;
+
+    *start = data;
+    *stop = hole;
+    return 1;
+}
+
+static size_t count_data(int fd, off_t pos, off_t end)
+{
+    off_t start, stop;
+    size_t total = 0;
+
+    while (next_extent(fd, pos, end, &start, &stop)) {
+        total += stop - start;
+        pos = stop;
+    }
+
+    return total;
+}
+
+struct planner {
+    size_t chunk_size;
+    unsigned idx;
+    unsigned prev_file;
+    off_t prev_end;
+    size_t total;
+
+    // Each item is held back until the next one is planned so that,
+    // however many files there are, the very last one can be marked.
+    struct readthrd_item *pending;
+
+    // Small files waiting to be packed into the next item
+    struct readthrd_pack *pack;
+    unsigned npack;
+    unsigned pack_alloc;
+    size_t pack_bytes;
+};
+
+// Buffers and memory credits are taken by the planner, in chunk order,
+// so a reader can never hold the last of them while an earlier chunk
+// is waiting.
+static void take_buffer(struct readthrd *rt, struct readthrd_item *it)
+{
+    it->budget = rt->budget;
+    it->mem_bytes = item_memsize(rt, it->bytes);
+    if (rt->budget)
+        membudget_acquire(rt->budget, it->mem_bytes);
+
+    it->pool = rt->pool;
+    it->buf = rt->pool ? bufpool_get(rt->pool) : NULL;
+}
+
+static void push_item(struct readthrd *rt, struct readthrd_item *it)
+{
+    take_buffer(rt, it);
+    fifo_push(rt->input, it);
+}
+
+static struct readthrd_item *plan_item(struct readthrd *rt, struct planner *p,
+                                       unsigned file, off_t offset,
+                                       size_t remain)
+{
+    struct readthrd_item *it = malloc(sizeof(*it));
+    if (it == NULL) {
+        perror("readthrd_item malloc");
+        exit(1);
+    }
+
+    it->index = p->idx++;
+    it->file = file;
+    it->offset = offset;
+    it->contig = it->index && file == p->prev_file && offset == p->prev_end;
+    it->bytes = p->chunk_size;
+    it->real_bytes = p->chunk_size;
+    if (it->bytes > remain) {
+        it->bytes = round_chunk(rt, remain);
+        it->real_bytes = remain;
+    }
+    it->last = 0;
+    it->pack = NULL;
+    it->npack = 0;
+    it->zbytes = 0;
+
+    p->prev_file = file;
+    p->prev_end = offset + it->real_bytes;
+    p->total += it->real_bytes;
+
+    if (p->pending)
+        push_item(rt, p->pending);
+    p->pending = it;
+
+    return it;
+}
+
+// Plan the chunks for [start, end) of one file. fd is used to skip
+// the holes, without it everything is read.
+static void plan_file(struct readthrd *rt, struct planner *p, unsigned file,
+                      int fd, off_t start, off_t end)
 {
-    size_t offset = 0;
-    ssize_t remain = rt->file_size;
-    unsigned idx = 0;
+    off_t ext_start = start, ext_stop = end;
 
-    if (read_size && remain > read_size)
-        remain = read_size;
+    if (fd >= 0) {
+        size_t data = count_data(fd, start, end);
+        rt->hole_bytes += end - start - data;
+        __sync_sub_and_fetch(&rt->total_bytes, end - start - data);
 
-    while (1) {
-        struct readthrd_item *it = malloc(sizeof(*it));
+        if (!next_extent(fd, start, end, &ext_start, &ext_stop))
+            return;
+    }
+
+    while (!rt->stop) {
+        off_t offset = ext_start;
+        while (offset < ext_stop && !rt->stop)
+            offset += plan_item(rt, p, file, offset,
+                                ext_stop - offset)->real_bytes;
+
+        if (fd < 0 || !next_extent(fd, ext_stop, end, &ext_start, &ext_stop))
+            break;
+    }
+}
+
+// Ordinary gzip can only be inflated from the start so the planner
+// does it, filling each buffer and putting it straight in the reorder
+// ring for the submit thread. The chunks are never held back: if the
+// last one has data a final empty item is planned after it.
+static void plan_inflate(struct readthrd *rt, struct planner *p,
+                         unsigned file, int fd, size_t length)
+{
+    struct gunzip *gz = gunzip_new(fd);
+    if (gz == NULL) {
+        perror("Starting gunzip");
+        return;
+    }
+
+    // Buffers have to be taken in chunk order
+    if (p->pending) {
+        push_item(rt, p->pending);
+        p->pending = NULL;
+    }
+
+    size_t remain = length ? length : SIZE_MAX;
+    off_t offset = 0;
+
+    while (remain && !rt->stop) {
+        struct readthrd_item *it = calloc(1, sizeof(*it));
         if (it == NULL) {
             perror("readthrd_item malloc");
             exit(1);
         }
 
-        it->index = idx++;
+        it->bytes = p->chunk_size;
+        take_buffer(rt, it);
+        if (it->buf == NULL)
+            it->buf = capi_alloc(it->mem_bytes);
+        if (it->buf == NULL) {
+            perror("gunzip alloc");
+            exit(1);
+        }
+
+        double start = stats_now();
+        size_t want = remain < p->chunk_size ? remain : p->chunk_size;
+        size_t got = gunzip_read(gz, it->buf, want);
+        stats_hist_add(&rt->read_hist, stats_now() - start);
+
+        if (!got) {
+            readthrd_item_free(it);
+            break;
+        }
+
+        it->index = p->idx++;
+        it->file = file;
         it->offset = offset;
-        it->bytes = chunk_size;
-        it->real_bytes = chunk_size;
-        if (it->bytes > remain) {
-            it->bytes = round_to_cache_line(remain);
-            it->real_bytes = remain;
+        it->contig = offset > 0;
+        it->real_bytes = got;
+        it->bytes = round_chunk(rt, got);
+        memset((char *) it->buf + got, 0, it->bytes - got);
+
+        offset += got;
+        remain -= got;
+        p->prev_file = file;
+        p->prev_end = offset;
+        p->total += got;
+        __sync_add_and_fetch(&rt->bytes_read, got);
+        __sync_add_and_fetch(&rt->total_bytes, got);
+
+        reorder_put(&rt->reorder, it->index, it);
+    }
+
+    gunzip_free(gz);
+}
+
+static void plan_blocks(struct readthrd *rt, struct planner *p,
+                        unsigned file, off_t offset, off_t zoffset,
+                        size_t zbytes, size_t bytes)
+{
+    struct readthrd_item *it = plan_item(rt, p, file, offset, bytes);
+    it->zoffset = zoffset;
+    it->zbytes = zbytes;
+    __sync_add_and_fetch(&rt->total_bytes, it->real_bytes);
+}
+
+// BGZF files are a series of independent gzip members of at most 64KiB
+// each, with their sizes in the headers and trailers. So the planner
+// only has to walk the headers and the blocks of each chunk can be
+// inflated by the read threads, in parallel.
+static void plan_bgzf(struct readthrd *rt, struct planner *p, unsigned file,
+                      int fd, size_t length)
+{
+    size_t remain = length ? length : SIZE_MAX;
+    off_t pos = 0, zstart = 0, offset = 0;
+    size_t bytes = 0;
+    size_t bsize, isize;
+    int ret;
+
+    while (remain && !rt->stop &&
+           (ret = gunzip_bgzf_block(fd, pos, &bsize, &isize)) > 0) {
+        if (bytes + isize > p->chunk_size) {
+            plan_blocks(rt, p, file, offset, zstart, pos - zstart, bytes);
+            offset += bytes;
+            remain -= bytes;
+            zstart = pos;
+            bytes = 0;
+        }
+
+        if (bytes + isize > remain)
+            isize = remain - bytes;
+
+        pos += bsize;
+        bytes += isize;
+
+        // The block finishing the window is the last one to read
+        if (bytes == remain)
+            break;
+    }
+
+    if (ret < 0)
+        fprintf(stderr, "Invalid BGZF block at %zd, ignoring the rest\n",
+                (ssize_t) pos);
+
+    if (bytes && remain)
+        plan_blocks(rt, p, file, offset, zstart, pos - zstart, bytes);
+}
+
+static void plan_gzip(struct readthrd *rt, struct planner *p, unsigned file,
+                      int fd, size_t length)
+{
+    // A single block has to fit in a chunk
+    if (gunzip_detect(fd) == GUNZIP_BGZF &&
+        p->chunk_size >= GUNZIP_BGZF_MAX_BLOCK)
+        plan_bgzf(rt, p, file, fd, length);
+    else
+        plan_inflate(rt, p, file, fd, length);
+}
+
+static void plan_ranges(struct readthrd *rt, struct planner *p, int fd,
+                        off_t start, off_t end)
+{
+    rt->total_bytes = 0;
+
+    for (size_t i = 0; i < rt->nranges && !rt->stop; i++) {
+        off_t rstart = rt->ranges[i].offset;
+        off_t rend = rstart + rt->ranges[i].length;
+
+        if (rstart < start)
+            rstart = start;
+        if (rend > end)
+            rend = end;
+        if (rstart >= rend)
+            continue;
+
+        __sync_add_and_fetch(&rt->total_bytes, rend - rstart);
+        plan_file(rt, p, 0, fd, rstart, rend);
+    }
+}
+
+static void flush_pack(struct readthrd *rt, struct planner *p)
+{
+    if (!p->npack)
+        return;
+
+    struct readthrd_item *it = plan_item(rt, p, p->pack[0].file, 0,
+                                         p->pack_bytes);
+    it->pack = p->pack;
+    it->npack = p->npack;
+    it->contig = 0;
+
+    // Nothing is contiguous with a pack
+    p->prev_end = -1;
+
+    p->pack = NULL;
+    p->npack = p->pack_alloc = 0;
+    p->pack_bytes = 0;
+}
+
+// Files smaller than a chunk would otherwise each cost a whole item
+// (and trip through the wqueue) so they are packed together instead.
+static void pack_file(struct readthrd *rt, struct planner *p, unsigned file,
+                      size_t size)
+{
+    size_t start = p->pack_bytes ? p->pack_bytes + 1 : 0;
+
+    if (start + size > p->chunk_size) {
+        flush_pack(rt, p);
+        start = 0;
+    }
+
+    if (p->npack == p->pack_alloc) {
+        unsigned alloc = p->pack_alloc ? p->pack_alloc * 2 : 16;
+        struct readthrd_pack *pack = realloc(p->pack, alloc * sizeof(*pack));
+        if (pack == NULL) {
+            perror("readthrd_pack realloc");
+            exit(1);
+        }
+
+        p->pack = pack;
+        p->pack_alloc = alloc;
+    }
+
+    // The guard is searched along with the files
+    if (start)
+        __sync_add_and_fetch(&rt->total_bytes, 1);
+
+    p->pack[p->npack++] = (struct readthrd_pack) {
+        .file = file,
+        .start = start,
+        .bytes = size,
+    };
+    p->pack_bytes = start + size;
+}
+
+// Scan every file in the list from start to finish, back to back, so
+// the wqueue never drains between them.
+static void plan_files(struct readthrd *rt, struct planner *p)
+{
+    for (unsigned i = 0; i < rt->files->count && !rt->stop; i++) {
+        struct filelist_file *f = &rt->files->files[i];
+
+        if (!f->size)
+            continue;
+
+        // Small files get packed together without being opened, unless
+        // gunzip is on: then their headers are checked first so
+        // compressed data is never searched as is
+        int small = f->size < p->chunk_size &&
+            !(rt->flags & READTHREAD_COPY);
+
+        if (small && !(rt->flags & READTHREAD_GUNZIP)) {
+            pack_file(rt, p, i, f->size);
+            continue;
+        }
+
+        int fd = -1;
+        if (!(rt->flags & READTHREAD_COPY)) {
+            fd = open(f->path, O_RDONLY);
+            if (fd < 0) {
+                fprintf(stderr, "Skipping '%s': %s\n", f->path,
+                        strerror(errno));
+                __sync_sub_and_fetch(&rt->total_bytes, f->size);
+                continue;
+            }
+        }
+
+        int gz = rt->flags & READTHREAD_GUNZIP && fd >= 0 &&
+            gunzip_detect(fd) != GUNZIP_NONE;
+
+        if (small && !gz) {
+            close(fd);
+            pack_file(rt, p, i, f->size);
+            continue;
+        }
+
+        flush_pack(rt, p);
+
+        if (gz) {
+            // Only the uncompressed size counts
+            __sync_sub_and_fetch(&rt->total_bytes, f->size);
+            plan_gzip(rt, p, i, fd, 0);
+        } else {
+            plan_file(rt, p, i, fd, 0, f->size);
         }
 
-        it->last = 0;
+        if (fd >= 0)
+            close(fd);
+    }
 
-        offset += it->bytes;
-        remain -= it->bytes;
-        if (remain <= 0)
-            it->last = 1;
+    if (rt->stop) {
+        free(p->pack);
+        return;
+    }
 
-        fifo_push(rt->input, it);
+    flush_pack(rt, p);
+}
+
+static size_t read_full(int fd, unsigned char *buf, size_t len)
+{
+    size_t got = 0;
+
+    while (got < len) {
+        ssize_t rd = read(fd, &buf[got], len - got);
+        if (rd < 0 && errno == EINTR)
+            continue;
 
-        if (it->last)
+        if (rd < 0)
+            perror("read stream");
+        if (rd <= 0)
             break;
+
+        got += rd;
+    }
+
+    return got;
+}
+
+// A stream can only be read once, in order, so the planner reads it
+// itself and hands the chunks straight to the submit thread while the
+// AFU and write threads carry on in parallel. One byte is read ahead
+// to find out which chunk is the last without holding a second buffer.
+static void plan_stream(struct readthrd *rt, struct planner *p,
+                        size_t length)
+{
+    size_t remain = length ? length : SIZE_MAX;
+    unsigned char peek;
+    int have_peek = 0;
+    int last = 0;
+
+    while (!last) {
+        struct readthrd_item *it = calloc(1, sizeof(*it));
+        if (it == NULL) {
+            perror("readthrd_item malloc");
+            exit(1);
+        }
+
+        it->index = p->idx++;
+        it->offset = p->total;
+        it->contig = it->index > 0;
+        it->bytes = p->chunk_size;
+
+        take_buffer(rt, it);
+        if (it->buf == NULL)
+            it->buf = capi_alloc(it->mem_bytes);
+        if (it->buf == NULL) {
+            perror("read stream alloc");
+            exit(1);
+        }
+
+        unsigned char *buf = it->buf;
+        size_t want = remain < p->chunk_size ? remain : p->chunk_size;
+        size_t got = 0;
+
+        double start = stats_now();
+        if (have_peek) {
+            buf[0] = peek;
+            got = 1;
+        }
+        got += read_full(rt->stream_fd, &buf[got], want - got);
+        remain -= got;
+
+        have_peek = remain && !rt->stop &&
+            read_full(rt->stream_fd, &peek, 1) == 1;
+        stats_hist_add(&rt->read_hist, stats_now() - start);
+
+        last = !have_peek;
+        it->last = last;
+        it->real_bytes = got;
+        it->bytes = round_chunk(rt, got);
+        memset(&buf[got], 0, it->bytes - got);
+
+        p->total += got;
+        __sync_add_and_fetch(&rt->bytes_read, got);
+        __sync_add_and_fetch(&rt->total_bytes, got);
+
+        // The item may be completed and freed as soon as it is put
+        reorder_put(&rt->reorder, it->index, it);
+    }
+
+    rt->file_size = p->total;
+}
+
+size_t readthrd_run(struct readthrd *rt, size_t chunk_size, size_t offset,
+                    size_t length)
+{
+    struct planner p = {0};
+    off_t start = offset;
+    off_t end = rt->file_size;
+
+    if (start > end)
+        start = end;
+
+    if (length && end - start > length)
+        end = start + length;
+
+    p.chunk_size = round_chunk(rt, chunk_size);
+
+    if (rt->stream) {
+        plan_stream(rt, &p, length);
+        fifo_close(rt->input);
+        return p.total;
+    }
+
+    // Unaligned windows can't be read directly
+    if (rt->flags & READTHREAD_DIRECT && start % rt->block_size) {
+        fprintf(stderr, "Offset %zu is not a multiple of the block size "
+                "(%u)\n", (size_t) start, rt->block_size);
+        exit(EINVAL);
     }
 
+    rt->total_bytes = end - start;
+
+    if (rt->files != NULL) {
+        plan_files(rt, &p);
+    } else if (rt->gzip) {
+        int fd = open(rt->fpath, O_RDONLY);
+        if (fd < 0) {
+            perror("Opening gzip input");
+        } else {
+            // The uncompressed size isn't known until the end
+            rt->total_bytes = 0;
+            plan_gzip(rt, &p, 0, fd, length);
+            rt->file_size = p.total;
+            close(fd);
+        }
+    } else {
+        // A copy has to reproduce the holes too so it reads everything
+        int fd = -1;
+        if (!(rt->flags & READTHREAD_COPY))
+            fd = open(rt->fpath, O_RDONLY);
+
+        if (rt->ranges)
+            plan_ranges(rt, &p, fd, start, end);
+        else
+            plan_file(rt, &p, 0, fd, start, end);
+
+        if (fd >= 0)
+            close(fd);
+    }
+
+    // There always has to be a last item to flush the pipeline, even
+    // if there was nothing to read
+    if (p.pending == NULL)
+        plan_item(rt, &p, 0, start, 0);
+
+    p.pending->last = 1;
+    push_item(rt, p.pending);
+
     fifo_close(rt->input);
-    return offset;
+    return p.total;
 }
 
 size_t readthrd_file_size(struct readthrd *rt)
 {
     return rt->file_size;
 }
+
+int readthrd_is_stream(struct readthrd *rt)
+{
+    // The size of a compressed input is only known once it's all read
+    return rt->stream || rt->gzip;
+}
+
+size_t readthrd_total_bytes(struct readthrd *rt)
+{
+    return rt->total_bytes;
+}
+
+size_t readthrd_hole_bytes(struct readthrd *rt)
+{
+    return rt->hole_bytes;
+}
+
+size_t readthrd_bytes_read(struct readthrd *rt)
+{
+    return rt->bytes_read;
+}
+
+size_t readthrd_bytes_submitted(struct readthrd *rt)
+{
+    return rt->bytes_submitted;
+}
+
+unsigned long readthrd_chunks_submitted(struct readthrd *rt)
+{
+    return rt->chunks_submitted;
+}
+
+unsigned readthrd_item_locate(struct readthrd_item *item, int32_t idx,
+                              off_t *offset)
+{
+    if (item->pack == NULL) {
+        *offset = (off_t) item->offset + idx;
+        return item->file;
+    }
+
+    // Find the last file starting at or before the index
+    unsigned lo = 0, hi = item->npack;
+    while (hi - lo > 1) {
+        unsigned mid = (lo + hi) / 2;
+        if (item->pack[mid].start <= idx)
+            lo = mid;
+        else
+            hi = mid;
+    }
+
+    *offset = idx - (int32_t) item->pack[lo].start;
+    return item->pack[lo].file;
+}
+
+void readthrd_item_free(struct readthrd_item *item)
+{
+    if (item->pool)
+        bufpool_put(item->pool, item->buf);
+    else
+        free(item->buf);
+
+    if (item->budget)
+        membudget_release(item->budget, item->mem_bytes);
+
+    free(item->pack);
+    free(item);
+}
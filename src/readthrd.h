@@ -28,31 +28,165 @@
 #ifndef READTHRD_H
 #define READTHRD_H
 
+#include "json.h"
+
 #include <capi/fifo.h>
+#include <sys/types.h>
 #include <stdlib.h>
+#include <stdint.h>
+
+struct hybrid;
+struct filelist;
+struct bufpool;
+struct membudget;
 
 enum {
     READTHREAD_DISCARD = 1,
     READTHREAD_VERBOSE = 2,
     READTHREAD_COPY = 4,
+    READTHREAD_DIRECT = 8,
+    READTHREAD_GUNZIP = 16,
+    READTHREAD_FINGERPRINT = 32,
+};
+
+struct readthrd_geometry {
+    size_t size;
+    int blockdev;
+
+    // Set if the input should be read with O_DIRECT (block devices, or
+    // READTHREAD_DIRECT) and the filesystem supports it. Chunk offsets
+    // and lengths must then be multiples of block_size.
+    int direct;
+    unsigned block_size;
+
+    // The device's optimal IO size, 0 if it doesn't report one
+    unsigned io_opt;
+
+    // Set for stdin ("-"), pipes, sockets and character devices which
+    // can only be read once, in order. The size isn't known up front.
+    int stream;
+
+    // The gunzip_format of the input when READTHREAD_GUNZIP is set.
+    // The size is then the compressed size.
+    int gzip;
+};
+
+int readthrd_geometry(const char *fpath, int flags,
+                      struct readthrd_geometry *geom);
+
+// One of the small files packed into an item: bytes of the file are
+// at start in the item's buffer. Each is followed by a zero guard byte,
+// which can't be part of a phrase, so no match spans two files.
+struct readthrd_pack {
+    unsigned file;
+    unsigned start;
+    unsigned bytes;
 };
 
 struct readthrd_item {
     unsigned index;
     int last;
+    // Index of the input in the file list (0 for a single input). The
+    // offset is relative to the start of that file.
+    unsigned file;
+    // Set when the chunk directly follows the previous one in the
+    // file. Otherwise (after a hole) any match the AFU reports as
+    // spanning into it from the previous chunk is bogus.
+    int contig;
     size_t offset;
     size_t bytes;
     size_t real_bytes;
     size_t result_bytes;
     void *buf;
+    struct bufpool *pool;
+    struct membudget *budget;
+    size_t mem_bytes;
+
+    // Set when the item holds several whole files (in file order)
+    // instead of a chunk of one. See readthrd_item_locate().
+    struct readthrd_pack *pack;
+    unsigned npack;
+
+    // Set when the chunk is a run of whole BGZF blocks, zbytes long at
+    // zoffset in the compressed file, for the reader to inflate. The
+    // offset is then in the uncompressed data.
+    off_t zoffset;
+    size_t zbytes;
+
+    // XXH64 of the chunk's data, with READTHREAD_FINGERPRINT
+    uint64_t fingerprint;
+
+    int dirty;
+    double proc_secs;
+
+    // Only used in hybrid mode, see hybrid.h
+    int nboundary;
+    int32_t boundary[16];
+};
+
+struct readthrd *readthrd_start(const char *fpath, int num_threads, int flags,
+                                struct hybrid *hybrid);
+// Read every file in the list, one after the other, as a single stream
+// of chunks. The files are always read through the page cache.
+struct readthrd *readthrd_start_files(struct filelist *files,
+                                      int num_threads, int flags,
+                                      struct hybrid *hybrid);
+// Take the chunk buffers from a pool, in chunk order, instead of
+// having each read thread allocate its own. Must be called before
+// readthrd_run.
+void readthrd_set_bufpool(struct readthrd *rt, struct bufpool *pool);
+// Hold back chunks until their buffers fit in the budget. Must be
+// called before readthrd_run.
+void readthrd_set_membudget(struct readthrd *rt, struct membudget *budget);
+
+// Called by each read thread with every chunk it has read, before the
+// chunk is submitted. Must be called before readthrd_run.
+void readthrd_set_visit(struct readthrd *rt,
+                        void (*visit)(void *arg, struct readthrd_item *item),
+                        void *arg);
+
+// Only read these byte ranges (ascending and not overlapping) of a
+// single input, within the window given to readthrd_run. Must be
+// called before readthrd_run.
+struct readthrd_range {
+    size_t offset;
+    size_t length;
 };
 
-struct readthrd *readthrd_start(const char *fpath, int num_threads, int flags);
-size_t readthrd_run(struct readthrd *rt, size_t chunk_size, size_t read_size);
+void readthrd_set_ranges(struct readthrd *rt,
+                         const struct readthrd_range *ranges, size_t count);
+
+// Read the length bytes (0 for all of it) of the input starting at
+// offset. Returns the number of bytes planned. Streams are always read
+// from where they are, offset is ignored.
+size_t readthrd_run(struct readthrd *rt, size_t chunk_size, size_t offset,
+                    size_t length);
+
+// Stop reading early: chunks that haven't been submitted yet are
+// shrunk to a single (ignored) cacheline and the next chunk planned
+// becomes the last.
+void readthrd_stop(struct readthrd *rt);
 void readthrd_print_cputime(struct readthrd *rt);
+void readthrd_json_threads(struct readthrd *rt, struct json *j);
+void readthrd_json_stages(struct readthrd *rt, struct json *j);
 void readthrd_join(struct readthrd *rt);
 void readthrd_free(struct readthrd *rt);
+// For a stream this is only known once it's been read
 size_t readthrd_file_size(struct readthrd *rt);
+int readthrd_is_stream(struct readthrd *rt);
+size_t readthrd_total_bytes(struct readthrd *rt);
+size_t readthrd_bytes_read(struct readthrd *rt);
+size_t readthrd_hole_bytes(struct readthrd *rt);
+size_t readthrd_bytes_submitted(struct readthrd *rt);
+unsigned long readthrd_chunks_submitted(struct readthrd *rt);
+
+// Release an item and its buffer
+void readthrd_item_free(struct readthrd_item *item);
+
+// Map a result index of an item back to the file it's in. Returns the
+// file's index with the offset of the match in that file.
+unsigned readthrd_item_locate(struct readthrd_item *item, int32_t idx,
+                              off_t *offset);
 
 
 
@@ -0,0 +1,104 @@
+////////////////////////////////////////////////////////////////////////
+//
+// Copyright 2015 PMC-Sierra, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you
+// may not use this file except in compliance with the License. You may
+// obtain a copy of the License at
+// http://www.apache.org/licenses/LICENSE-2.0 Unless required by
+// applicable law or agreed to in writing, software distributed under the
+// License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+// CONDITIONS OF ANY KIND, either express or implied. See the License for
+// the specific language governing permissions and limitations under the
+// License.
+//
+////////////////////////////////////////////////////////////////////////
+
+////////////////////////////////////////////////////////////////////////
+//
+//   Author: Logan Gunthorpe
+//
+//   Description:
+//     Reorder ring: many threads put items tagged with a sequence
+//     index and a single consumer gets them back in index order.
+//
+////////////////////////////////////////////////////////////////////////
+
+#include "reorder.h"
+
+#include <stdlib.h>
+
+int reorder_init(struct reorder *r, unsigned len)
+{
+    r->len = len;
+    r->next = 0;
+
+    r->buf = calloc(len, sizeof(*r->buf));
+    if (r->buf == NULL)
+        goto error_out;
+
+    r->idx = malloc(len * sizeof(*r->idx));
+    if (r->idx == NULL)
+        goto error_buf_out;
+
+    for (unsigned i = 0; i < len; i++)
+        r->idx[i] = i;
+
+    if (pthread_mutex_init(&r->mutex, NULL))
+        goto error_idx_out;
+
+    if (pthread_cond_init(&r->ready_cond, NULL))
+        goto error_mutex_out;
+
+    if (pthread_cond_init(&r->free_cond, NULL))
+        goto error_ready_cond_out;
+
+    return 0;
+
+error_ready_cond_out:
+    pthread_cond_destroy(&r->ready_cond);
+error_mutex_out:
+    pthread_mutex_destroy(&r->mutex);
+error_idx_out:
+    free(r->idx);
+error_buf_out:
+    free(r->buf);
+error_out:
+    return -1;
+}
+
+void reorder_destroy(struct reorder *r)
+{
+    pthread_cond_destroy(&r->free_cond);
+    pthread_cond_destroy(&r->ready_cond);
+    pthread_mutex_destroy(&r->mutex);
+    free(r->idx);
+    free(r->buf);
+}
+
+void reorder_put(struct reorder *r, unsigned index, void *item)
+{
+    pthread_mutex_lock(&r->mutex);
+    unsigned slot = index % r->len;
+    while (r->buf[slot] != NULL || r->idx[slot] != index)
+        pthread_cond_wait(&r->free_cond, &r->mutex);
+    r->buf[slot] = item;
+    pthread_cond_signal(&r->ready_cond);
+    pthread_mutex_unlock(&r->mutex);
+}
+
+void *reorder_get(struct reorder *r)
+{
+    pthread_mutex_lock(&r->mutex);
+    while (r->buf[r->next] == NULL)
+        pthread_cond_wait(&r->ready_cond, &r->mutex);
+
+    void *item = r->buf[r->next];
+    r->idx[r->next] += r->len;
+    r->buf[r->next] = NULL;
+    pthread_cond_broadcast(&r->free_cond);
+    r->next = (r->next + 1) % r->len;
+    pthread_mutex_unlock(&r->mutex);
+
+    return item;
+}
@@ -0,0 +1,53 @@
+////////////////////////////////////////////////////////////////////////
+//
+// Copyright 2015 PMC-Sierra, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you
+// may not use this file except in compliance with the License. You may
+// obtain a copy of the License at
+// http://www.apache.org/licenses/LICENSE-2.0 Unless required by
+// applicable law or agreed to in writing, software distributed under the
+// License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+// CONDITIONS OF ANY KIND, either express or implied. See the License for
+// the specific language governing permissions and limitations under the
+// License.
+//
+////////////////////////////////////////////////////////////////////////
+
+////////////////////////////////////////////////////////////////////////
+//
+//   Author: Logan Gunthorpe
+//
+//   Description:
+//     Reorder ring: many threads put items tagged with a sequence
+//     index and a single consumer gets them back in index order.
+//
+////////////////////////////////////////////////////////////////////////
+
+#ifndef REORDER_H
+#define REORDER_H
+
+#include <pthread.h>
+
+struct reorder {
+    void **buf;
+    unsigned *idx;
+    unsigned len;
+    unsigned next;
+
+    pthread_mutex_t mutex;
+    pthread_cond_t ready_cond;
+    pthread_cond_t free_cond;
+};
+
+int reorder_init(struct reorder *r, unsigned len);
+void reorder_destroy(struct reorder *r);
+
+// Blocks until the slot for index is free. Indexes must start at zero
+// and every index must eventually be put.
+void reorder_put(struct reorder *r, unsigned index, void *item);
+
+// Blocks until the next item, in index order, is available
+void *reorder_get(struct reorder *r);
+
+#endif
@@ -0,0 +1,385 @@
+////////////////////////////////////////////////////////////////////////
+//
+// Copyright 2015 PMC-Sierra, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you
+// may not use this file except in compliance with the License. You may
+// obtain a copy of the License at
+// http://www.apache.org/licenses/LICENSE-2.0 Unless required by
+// applicable law or agreed to in writing, software distributed under the
+// License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+// CONDITIONS OF ANY KIND, either express or implied. See the License for
+// the specific language governing permissions and limitations under the
+// License.
+//
+////////////////////////////////////////////////////////////////////////
+
+////////////////////////////////////////////////////////////////////////
+//
+//   Author: Logan Gunthorpe
+//
+//   Description:
+//     On disk cache of search results, keyed by the identity of the
+//     input file and what was searched for, so an unchanged file
+//     doesn't have to be read again.
+//
+////////////////////////////////////////////////////////////////////////
+
+#include "rescache.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define SUFFIX ".tsc"
+
+struct rescache_header {
+    char magic[8];
+    struct rescache_key key;
+    uint64_t bytes;
+    uint64_t count;
+};
+
+static int make_key(struct rescache_key *key, const struct stat *st,
+                    const char *phrase, uint64_t offset, uint64_t length,
+                    unsigned mode)
+{
+    // Zeroed so the unused bytes of the phrase hash the same every time
+    memset(key, 0, sizeof(*key));
+
+    if (strlen(phrase) >= sizeof(key->phrase))
+        return -1;
+
+    key->dev = st->st_dev;
+    key->ino = st->st_ino;
+    key->size = st->st_size;
+    key->mtime_sec = st->st_mtim.tv_sec;
+    key->mtime_nsec = st->st_mtim.tv_nsec;
+    key->ctime_sec = st->st_ctim.tv_sec;
+    key->ctime_nsec = st->st_ctim.tv_nsec;
+    key->offset = offset;
+    key->length = length;
+    key->mode = mode;
+    strcpy(key->phrase, phrase);
+
+    return 0;
+}
+
+// FNV-1a, only used to name the entries: the whole key is checked
+// when one is read back
+static uint64_t hash_key(const struct rescache_key *key)
+{
+    const unsigned char *b = (const unsigned char *) key;
+    uint64_t h = 0xcbf29ce484222325ULL;
+
+    for (size_t i = 0; i < sizeof(*key); i++) {
+        h ^= b[i];
+        h *= 0x100000001b3ULL;
+    }
+
+    return h;
+}
+
+static char *default_dir(void)
+{
+    const char *xdg = getenv("XDG_CACHE_HOME");
+    const char *home = getenv("HOME");
+    char *dir;
+
+    if (xdg != NULL && *xdg) {
+        if (asprintf(&dir, "%s/textswap", xdg) < 0)
+            return NULL;
+    } else if (home != NULL && *home) {
+        if (asprintf(&dir, "%s/.cache/textswap", home) < 0)
+            return NULL;
+    } else {
+        return NULL;
+    }
+
+    return dir;
+}
+
+static int make_dirs(char *dir)
+{
+    for (char *p = dir + 1; *p; p++) {
+        if (*p != '/')
+            continue;
+
+        *p = 0;
+        int ret = mkdir(dir, 0755);
+        *p = '/';
+
+        if (ret && errno != EEXIST)
+            return -1;
+    }
+
+    if (mkdir(dir, 0755) && errno != EEXIST)
+        return -1;
+
+    return 0;
+}
+
+int rescache_init(struct rescache *rc, const char *dir, size_t max_size,
+                  const char *fpath, const char *phrase, uint64_t offset,
+                  uint64_t length, unsigned mode)
+{
+    struct stat st;
+
+    memset(rc, 0, sizeof(*rc));
+    rc->max_size = max_size;
+    clock_gettime(CLOCK_REALTIME, &rc->start);
+
+    if (stat(fpath, &st) || !S_ISREG(st.st_mode))
+        return -1;
+
+    if (make_key(&rc->key, &st, phrase, offset, length, mode))
+        return -1;
+
+    rc->fpath = strdup(fpath);
+    if (rc->fpath == NULL)
+        return -1;
+
+    rc->dir = dir ? strdup(dir) : default_dir();
+    if (rc->dir == NULL)
+        goto free_fpath;
+
+    if (make_dirs(rc->dir)) {
+        fprintf(stderr, "Unable to create the result cache '%s': %s\n",
+                rc->dir, strerror(errno));
+        goto free_dir;
+    }
+
+    if (asprintf(&rc->path, "%s/%016llx" SUFFIX, rc->dir,
+                 (unsigned long long) hash_key(&rc->key)) < 0)
+        goto free_dir;
+
+    return 0;
+
+free_dir:
+    free(rc->dir);
+    rc->dir = NULL;
+free_fpath:
+    free(rc->fpath);
+    rc->fpath = NULL;
+    return -1;
+}
+
+void rescache_free(struct rescache *rc)
+{
+    free(rc->fpath);
+    free(rc->dir);
+    free(rc->path);
+    free(rc->offsets);
+    memset(rc, 0, sizeof(*rc));
+}
+
+int rescache_lookup(struct rescache *rc)
+{
+    struct rescache_header hdr;
+    struct stat st;
+    int ret = 0;
+
+    FILE *f = fopen(rc->path, "rb");
+    if (f == NULL)
+        return 0;
+
+    if (fread(&hdr, sizeof(hdr), 1, f) != 1 ||
+        memcmp(hdr.magic, RESCACHE_MAGIC, sizeof(hdr.magic)) != 0 ||
+        memcmp(&hdr.key, &rc->key, sizeof(hdr.key)) != 0)
+        goto out;
+
+    // A truncated entry is treated as a miss and gets rewritten
+    if (fstat(fileno(f), &st) ||
+        st.st_size != sizeof(hdr) + hdr.count * sizeof(*rc->offsets))
+        goto out;
+
+    uint64_t *offsets = malloc(hdr.count * sizeof(*offsets) + 1);
+    if (offsets == NULL)
+        goto out;
+
+    if (fread(offsets, sizeof(*offsets), hdr.count, f) != hdr.count) {
+        free(offsets);
+        goto out;
+    }
+
+    free(rc->offsets);
+    rc->offsets = offsets;
+    rc->count = rc->alloc = hdr.count;
+    rc->bytes = hdr.bytes;
+    ret = 1;
+
+    // The entry's mtime orders the evictions
+    futimens(fileno(f), NULL);
+
+out:
+    fclose(f);
+    return ret;
+}
+
+void rescache_add(struct rescache *rc, uint64_t offset)
+{
+    if (rc->overflow)
+        return;
+
+    if (rc->count == rc->alloc) {
+        size_t alloc = rc->alloc ? rc->alloc * 2 : 256;
+        uint64_t *offsets = NULL;
+
+        if (alloc * sizeof(*offsets) + sizeof(struct rescache_header) <=
+            rc->max_size)
+            offsets = realloc(rc->offsets, alloc * sizeof(*offsets));
+
+        if (offsets == NULL) {
+            rc->overflow = 1;
+            free(rc->offsets);
+            rc->offsets = NULL;
+            rc->count = rc->alloc = 0;
+            return;
+        }
+
+        rc->offsets = offsets;
+        rc->alloc = alloc;
+    }
+
+    rc->offsets[rc->count++] = offset;
+}
+
+struct entry {
+    char *name;
+    off_t size;
+    struct timespec mtime;
+};
+
+static int cmp_entries(const void *a, const void *b)
+{
+    const struct entry *x = a;
+    const struct entry *y = b;
+
+    if (x->mtime.tv_sec != y->mtime.tv_sec)
+        return x->mtime.tv_sec < y->mtime.tv_sec ? -1 : 1;
+    if (x->mtime.tv_nsec != y->mtime.tv_nsec)
+        return x->mtime.tv_nsec < y->mtime.tv_nsec ? -1 : 1;
+    return 0;
+}
+
+static int is_entry(const char *name)
+{
+    size_t len = strlen(name);
+
+    return len > strlen(SUFFIX) &&
+        strcmp(&name[len - strlen(SUFFIX)], SUFFIX) == 0;
+}
+
+// Drop the least recently used entries until the cache fits
+static void evict(struct rescache *rc)
+{
+    DIR *dir = opendir(rc->dir);
+    if (dir == NULL)
+        return;
+
+    struct entry *entries = NULL;
+    size_t count = 0, alloc = 0;
+    size_t total = 0;
+    struct dirent *de;
+
+    while ((de = readdir(dir)) != NULL) {
+        struct stat st;
+
+        if (!is_entry(de->d_name) ||
+            fstatat(dirfd(dir), de->d_name, &st, 0) ||
+            !S_ISREG(st.st_mode))
+            continue;
+
+        if (count == alloc) {
+            alloc = alloc ? alloc * 2 : 64;
+            struct entry *e = realloc(entries, alloc * sizeof(*e));
+            if (e == NULL)
+                goto out;
+            entries = e;
+        }
+
+        entries[count].name = strdup(de->d_name);
+        if (entries[count].name == NULL)
+            goto out;
+
+        entries[count].size = st.st_size;
+        entries[count].mtime = st.st_mtim;
+        total += st.st_size;
+        count++;
+    }
+
+    qsort(entries, count, sizeof(*entries), cmp_entries);
+
+    for (size_t i = 0; i < count && total > rc->max_size; i++) {
+        if (unlinkat(dirfd(dir), entries[i].name, 0) == 0)
+            total -= entries[i].size;
+    }
+
+out:
+    for (size_t i = 0; i < count; i++)
+        free(entries[i].name);
+    free(entries);
+    closedir(dir);
+}
+
+int rescache_store(struct rescache *rc)
+{
+    struct rescache_header hdr;
+    struct rescache_key key;
+    struct stat st;
+    char *tmp;
+    int ret = -1;
+
+    if (rc->overflow || rc->path == NULL)
+        return 0;
+
+    // The file can't have changed during the scan. Nor can it have
+    // been written within a second of the scan starting: timestamps
+    // are coarse so a later write might leave the mtime as it was.
+    if (stat(rc->fpath, &st) ||
+        make_key(&key, &st, rc->key.phrase, rc->key.offset, rc->key.length,
+                 rc->key.mode) ||
+        memcmp(&key, &rc->key, sizeof(key)) != 0 ||
+        st.st_mtim.tv_sec >= rc->start.tv_sec - 1)
+        return 0;
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, RESCACHE_MAGIC, sizeof(hdr.magic));
+    hdr.key = rc->key;
+    hdr.bytes = rc->bytes;
+    hdr.count = rc->count;
+
+    if (asprintf(&tmp, "%s.%d", rc->path, getpid()) < 0)
+        return -1;
+
+    // Written aside and renamed so a reader never sees half an entry
+    FILE *f = fopen(tmp, "wb");
+    if (f == NULL)
+        goto free_tmp;
+
+    if (fwrite(&hdr, sizeof(hdr), 1, f) != 1 ||
+        fwrite(rc->offsets, sizeof(*rc->offsets), rc->count, f) != rc->count) {
+        fclose(f);
+        goto unlink_tmp;
+    }
+
+    if (fclose(f) || rename(tmp, rc->path))
+        goto unlink_tmp;
+
+    free(tmp);
+    evict(rc);
+    return 0;
+
+unlink_tmp:
+    unlink(tmp);
+free_tmp:
+    free(tmp);
+    return ret;
+}
@@ -0,0 +1,95 @@
+////////////////////////////////////////////////////////////////////////
+//
+// Copyright 2015 PMC-Sierra, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you
+// may not use this file except in compliance with the License. You may
+// obtain a copy of the License at
+// http://www.apache.org/licenses/LICENSE-2.0 Unless required by
+// applicable law or agreed to in writing, software distributed under the
+// License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+// CONDITIONS OF ANY KIND, either express or implied. See the License for
+// the specific language governing permissions and limitations under the
+// License.
+//
+////////////////////////////////////////////////////////////////////////
+
+////////////////////////////////////////////////////////////////////////
+//
+//   Author: Logan Gunthorpe
+//
+//   Description:
+//     On disk cache of search results, keyed by the identity of the
+//     input file and what was searched for, so an unchanged file
+//     doesn't have to be read again.
+//
+////////////////////////////////////////////////////////////////////////
+
+#ifndef RESCACHE_H
+#define RESCACHE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+
+#define RESCACHE_MAGIC "TSCACHE1"
+
+enum {
+    RESCACHE_GUNZIP = 1,
+};
+
+// Everything a search's results depend on. Entries are stored in host
+// byte order, the cache is only meant for the machine that wrote it.
+struct rescache_key {
+    uint64_t dev;
+    uint64_t ino;
+    uint64_t size;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    int64_t ctime_sec;
+    int64_t ctime_nsec;
+    uint64_t offset;
+    uint64_t length;
+    uint32_t mode;
+    char phrase[28];
+};
+
+struct rescache {
+    char *fpath;
+    char *dir;
+    size_t max_size;
+    char *path;
+    struct rescache_key key;
+    struct timespec start;
+
+    // The number of bytes scanned and the matches found (or read back
+    // from the cache), in order
+    uint64_t bytes;
+    uint64_t *offsets;
+    size_t count;
+    size_t alloc;
+    int overflow;
+};
+
+// The default directory is $XDG_CACHE_HOME/textswap or
+// ~/.cache/textswap. Returns -1 if fpath can't be cached (it isn't a
+// regular file or there is no cache directory).
+int rescache_init(struct rescache *rc, const char *dir, size_t max_size,
+                  const char *fpath, const char *phrase, uint64_t offset,
+                  uint64_t length, unsigned mode);
+void rescache_free(struct rescache *rc);
+
+// Returns 1, with the offsets filled in, if there's an entry for the
+// key, otherwise 0
+int rescache_lookup(struct rescache *rc);
+
+// Record a match found by the scan. Once the offsets wouldn't fit in
+// the cache any more they are dropped and nothing will be stored.
+void rescache_add(struct rescache *rc, uint64_t offset);
+
+// Store the recorded matches, if the file hasn't changed since the
+// key was made, then evict the least recently used entries until the
+// cache fits in max_size
+int rescache_store(struct rescache *rc);
+
+#endif
@@ -0,0 +1,493 @@
+////////////////////////////////////////////////////////////////////////
+//
+// Copyright 2015 PMC-Sierra, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you
+// may not use this file except in compliance with the License. You may
+// obtain a copy of the License at
+// http://www.apache.org/licenses/LICENSE-2.0 Unless required by
+// applicable law or agreed to in writing, software distributed under the
+// License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+// CONDITIONS OF ANY KIND, either express or implied. See the License for
+// the specific language governing permissions and limitations under the
+// License.
+//
+////////////////////////////////////////////////////////////////////////
+
+////////////////////////////////////////////////////////////////////////
+//
+//   Author: Logan Gunthorpe
+//
+//   Description:
+//     State kept between incremental scans of a file which is mostly
+//     appended to: a fingerprint of every chunk and all the matches, so
+//     the next scan only has to search the chunks that changed and what
+//     was appended.
+//
+////////////////////////////////////////////////////////////////////////
+
+#include "rescan.h"
+#include "xxhash.h"
+#include "ngblocks.h"
+
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Stored in host byte order, like the result cache
+struct rescan_header {
+    char magic[8];
+    char phrase[24];
+    uint64_t chunk_size;
+    uint64_t dev;
+    uint64_t ino;
+    uint64_t size;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    uint64_t nchunks;
+    uint64_t nmatches;
+};
+
+static void state_free(struct rescan_state *s)
+{
+    free(s->chunks);
+    free(s->matches);
+    memset(s, 0, sizeof(*s));
+}
+
+static int load(struct rescan *rs, FILE *f)
+{
+    struct rescan_header hdr;
+    struct rescan_state *s = &rs->old;
+    struct stat st;
+
+    if (fread(&hdr, sizeof(hdr), 1, f) != 1 ||
+        memcmp(hdr.magic, RESCAN_MAGIC, sizeof(hdr.magic)) != 0 ||
+        fstat(fileno(f), &st) ||
+        st.st_size != sizeof(hdr) + hdr.nchunks * sizeof(*s->chunks) +
+            hdr.nmatches * sizeof(*s->matches)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    // A scan for something else, or in other chunks, is no help
+    if (strncmp(hdr.phrase, rs->phrase, sizeof(hdr.phrase)) != 0 ||
+        hdr.chunk_size != rs->chunk_size)
+        return 0;
+
+    s->chunks = malloc(hdr.nchunks * sizeof(*s->chunks) + 1);
+    s->matches = malloc(hdr.nmatches * sizeof(*s->matches) + 1);
+    if (s->chunks == NULL || s->matches == NULL)
+        goto free_state;
+
+    if (fread(s->chunks, sizeof(*s->chunks), hdr.nchunks, f) != hdr.nchunks ||
+        fread(s->matches, sizeof(*s->matches), hdr.nmatches, f) !=
+            hdr.nmatches)
+        goto free_state;
+
+    s->nchunks = s->chunks_alloc = hdr.nchunks;
+    s->nmatches = s->matches_alloc = hdr.nmatches;
+    s->dev = hdr.dev;
+    s->ino = hdr.ino;
+    s->size = hdr.size;
+    s->mtime_sec = hdr.mtime_sec;
+    s->mtime_nsec = hdr.mtime_nsec;
+
+    for (size_t i = 0; i < s->nchunks; i++) {
+        struct rescan_chunk *c = &s->chunks[i];
+
+        if (c->bytes > rs->chunk_size || c->offset + c->bytes > s->size ||
+            (i && c->offset < c[-1].offset + c[-1].bytes)) {
+            errno = EINVAL;
+            goto free_state;
+        }
+    }
+
+    for (size_t i = 1; i < s->nmatches; i++) {
+        if (s->matches[i] <= s->matches[i - 1]) {
+            errno = EINVAL;
+            goto free_state;
+        }
+    }
+
+    return 0;
+
+free_state:
+    state_free(s);
+    return -1;
+}
+
+int rescan_open(struct rescan *rs, const char *fpath, const char *phrase,
+                size_t chunk_size)
+{
+    memset(rs, 0, sizeof(*rs));
+    strncpy(rs->phrase, phrase, sizeof(rs->phrase) - 1);
+    rs->chunk_size = chunk_size;
+
+    rs->fpath = strdup(fpath);
+    if (rs->fpath == NULL)
+        return -1;
+
+    // The first scan starts with nothing
+    FILE *f = fopen(fpath, "rb");
+    if (f == NULL && errno == ENOENT)
+        return 0;
+    else if (f == NULL)
+        goto free_path;
+
+    int ret = load(rs, f);
+    fclose(f);
+    if (ret)
+        goto free_path;
+
+    return 0;
+
+free_path:
+    free(rs->fpath);
+    rs->fpath = NULL;
+    return -1;
+}
+
+void rescan_free(struct rescan *rs)
+{
+    state_free(&rs->old);
+    state_free(&rs->new);
+    free(rs->ranges);
+    free(rs->known);
+    free(rs->fpath);
+    rs->fpath = NULL;
+}
+
+static int grow(void **p, size_t *alloc, size_t need, size_t size)
+{
+    if (need <= *alloc)
+        return 0;
+
+    size_t n = *alloc ? *alloc : 256;
+    while (n < need)
+        n *= 2;
+
+    void *np = realloc(*p, n * size);
+    if (np == NULL)
+        return -1;
+
+    *p = np;
+    *alloc = n;
+    return 0;
+}
+
+static int read_chunk(int fd, struct rescan_chunk *c, char *buf)
+{
+    size_t got = 0;
+
+    while (got < c->bytes) {
+        ssize_t n = pread(fd, buf + got, c->bytes - got, c->offset + got);
+        if (n < 0)
+            return -1;
+        else if (n == 0)
+            break;
+        got += n;
+    }
+
+    return got;
+}
+
+// Fingerprint the chunks of the last scan again, in the new state, and
+// mark the ones that changed to be searched along with the chunk
+// before (which the matches running into them start in)
+static int find_changed(struct rescan *rs, const char *input,
+                        unsigned char *search)
+{
+    struct rescan_state *s = &rs->old;
+    struct rescan_chunk *nc = rs->new.chunks;
+    int ret = -1;
+
+    int fd = open(input, O_RDONLY);
+    if (fd < 0)
+        return -1;
+
+    char *buf = malloc(rs->chunk_size + 1);
+    if (buf == NULL)
+        goto close_fd;
+
+    for (size_t i = 0; i < s->nchunks; i++) {
+        ssize_t got = read_chunk(fd, &s->chunks[i], buf);
+        if (got < 0)
+            goto free_buf;
+
+        nc[i].hash = xxh64(buf, got, 0);
+        if (got == s->chunks[i].bytes && nc[i].hash == s->chunks[i].hash)
+            continue;
+
+        search[i] = 1;
+        if (i && s->chunks[i].offset ==
+                 s->chunks[i - 1].offset + s->chunks[i - 1].bytes)
+            search[i - 1] = 1;
+    }
+
+    ret = 0;
+
+free_buf:
+    free(buf);
+close_fd:
+    close(fd);
+    return ret;
+}
+
+// The old matches starting in the chunks which aren't searched
+static int find_known(struct rescan *rs, const unsigned char *search)
+{
+    struct rescan_state *s = &rs->old;
+    size_t c = 0;
+
+    rs->known = malloc(s->nmatches * sizeof(*rs->known) + 1);
+    if (rs->known == NULL)
+        return -1;
+
+    for (size_t i = 0; i < s->nmatches; i++) {
+        while (c + 1 < s->nchunks &&
+               s->matches[i] >= s->chunks[c + 1].offset)
+            c++;
+
+        if (!search[c])
+            rs->known[rs->nknown++] = s->matches[i];
+    }
+
+    return 0;
+}
+
+static int plan_ranges(struct rescan *rs, const unsigned char *search)
+{
+    struct rescan_state *s = &rs->old;
+    struct ngranges r;
+
+    if (ngranges_init(&r, s->nchunks, rs->phrase))
+        return -1;
+
+    for (size_t i = 0; i < s->nchunks; i++) {
+        struct ngblock b = {
+            .offset = s->chunks[i].offset,
+            .bytes = s->chunks[i].bytes,
+            .contig = i && s->chunks[i].offset ==
+                s->chunks[i - 1].offset + s->chunks[i - 1].bytes,
+        };
+
+        ngranges_add(&r, &b, search[i]);
+
+        if (!search[i]) {
+            rs->reused_chunks++;
+            rs->reused_bytes += b.bytes;
+        }
+    }
+
+    // The last chunks are always searched, on to the end of the file
+    struct readthrd_range *last = &r.ranges[r.count - 1];
+    last->length = rs->new.size - last->offset;
+
+    rs->ranges = r.ranges;
+    rs->nranges = r.count;
+    return 0;
+}
+
+static ssize_t plan_all(struct rescan *rs)
+{
+    rs->ranges = malloc(sizeof(*rs->ranges));
+    if (rs->ranges == NULL)
+        return -1;
+
+    rs->ranges[0].offset = 0;
+    rs->ranges[0].length = rs->new.size;
+    rs->nranges = 1;
+    return 1;
+}
+
+ssize_t rescan_plan(struct rescan *rs, const char *input,
+                    const struct stat *st)
+{
+    struct rescan_state *s = &rs->old;
+    struct rescan_state *n = &rs->new;
+    size_t plen = strlen(rs->phrase);
+    int ret = -1;
+
+    n->dev = st->st_dev;
+    n->ino = st->st_ino;
+    n->size = st->st_size;
+    n->mtime_sec = st->st_mtim.tv_sec;
+    n->mtime_nsec = st->st_mtim.tv_nsec;
+
+    // A file that was replaced (eg. rotated) or cut short has to be
+    // searched again from the start
+    if (!s->nchunks || s->dev != n->dev || s->ino != n->ino ||
+        s->size > n->size)
+        return plan_all(rs);
+
+    // Start the tail far enough back that every match starting before
+    // it also finished before the end of the last scan, so it's in the
+    // old matches.
+    size_t first = s->nchunks - 1;
+    while (first && s->size - s->chunks[first].offset < plen - 1)
+        first--;
+
+    if (s->size - s->chunks[first].offset < plen - 1)
+        return plan_all(rs);
+
+    unsigned char *search = calloc(s->nchunks, 1);
+    if (search == NULL)
+        return -1;
+
+    if (grow((void **) &n->chunks, &n->chunks_alloc, s->nchunks,
+             sizeof(*n->chunks)))
+        goto free_search;
+
+    // The chunks before the tail keep their place in the new state,
+    // the tail's are recorded as it's searched
+    memcpy(n->chunks, s->chunks, first * sizeof(*n->chunks));
+    n->nchunks = first;
+    rs->record_from = s->chunks[first].offset;
+
+    if ((s->size != n->size || s->mtime_sec != n->mtime_sec ||
+         s->mtime_nsec != n->mtime_nsec) &&
+        find_changed(rs, input, search))
+        goto free_search;
+
+    memset(&search[first], 1, s->nchunks - first);
+
+    if (find_known(rs, search) || plan_ranges(rs, search))
+        goto free_search;
+
+    ret = rs->nranges;
+
+free_search:
+    free(search);
+    return ret;
+}
+
+static int add_match(struct rescan_state *s, uint64_t offset)
+{
+    if (grow((void **) &s->matches, &s->matches_alloc, s->nmatches + 1,
+             sizeof(*s->matches)))
+        return -1;
+
+    s->matches[s->nmatches++] = offset;
+    return 0;
+}
+
+// The known matches go into the new state in order with the ones found
+static int add_known(struct rescan *rs, uint64_t before)
+{
+    for (; rs->known_next < rs->nknown &&
+           rs->known[rs->known_next] < before; rs->known_next++)
+        if (add_match(&rs->new, rs->known[rs->known_next]))
+            return -1;
+
+    return 0;
+}
+
+int rescan_record(struct rescan *rs, struct readthrd_item *item)
+{
+    struct rescan_state *s = &rs->new;
+
+    if (item->pack || !item->real_bytes)
+        return 0;
+
+    if (add_known(rs, item->offset))
+        return -1;
+
+    if (item->offset >= rs->record_from) {
+        if (grow((void **) &s->chunks, &s->chunks_alloc, s->nchunks + 1,
+                 sizeof(*s->chunks)))
+            return -1;
+
+        struct rescan_chunk *c = &s->chunks[s->nchunks++];
+        c->offset = item->offset;
+        c->hash = item->fingerprint;
+        c->bytes = item->real_bytes;
+        c->reserved = 0;
+    }
+
+    if (!item->dirty)
+        return 0;
+
+    int32_t *res = item->buf;
+    for (size_t i = 0; i < item->result_bytes / sizeof(*res); i++) {
+        if (res[i] == INT32_MAX)
+            break;
+
+        if (add_match(s, (int64_t) item->offset + res[i]))
+            return -1;
+    }
+
+    return 0;
+}
+
+int rescan_save(struct rescan *rs)
+{
+    struct rescan_state *s = &rs->new;
+    struct rescan_header hdr;
+    char *tmp;
+
+    if (add_known(rs, UINT64_MAX))
+        return -1;
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, RESCAN_MAGIC, sizeof(hdr.magic));
+    memcpy(hdr.phrase, rs->phrase, sizeof(hdr.phrase));
+    hdr.chunk_size = rs->chunk_size;
+    hdr.dev = s->dev;
+    hdr.ino = s->ino;
+    hdr.size = s->size;
+    hdr.mtime_sec = s->mtime_sec;
+    hdr.mtime_nsec = s->mtime_nsec;
+    hdr.nchunks = s->nchunks;
+    hdr.nmatches = s->nmatches;
+
+    if (asprintf(&tmp, "%s.%d", rs->fpath, getpid()) < 0)
+        return -1;
+
+    // Written aside and renamed so an interrupted save leaves the old
+    // state as it was
+    FILE *f = fopen(tmp, "wb");
+    if (f == NULL)
+        goto free_tmp;
+
+    if (fwrite(&hdr, sizeof(hdr), 1, f) != 1 ||
+        fwrite(s->chunks, sizeof(*s->chunks), s->nchunks, f) != s->nchunks ||
+        fwrite(s->matches, sizeof(*s->matches), s->nmatches, f) !=
+            s->nmatches) {
+        fclose(f);
+        goto unlink_tmp;
+    }
+
+    if (fclose(f) || rename(tmp, rs->fpath))
+        goto unlink_tmp;
+
+    free(tmp);
+    return 0;
+
+unlink_tmp:
+    unlink(tmp);
+free_tmp:
+    free(tmp);
+    return -1;
+}
+
+void rescan_print(struct rescan *rs, FILE *out)
+{
+    fprintf(out, "Chunks Reused: %lu of %zu (%zu bytes not searched)\n",
+            rs->reused_chunks, rs->new.nchunks, rs->reused_bytes);
+}
+
+void rescan_json(struct rescan *rs, struct json *j)
+{
+    if (rs == NULL) return;
+
+    json_obj_start(j, "rescan");
+    json_uint(j, "chunks", rs->new.nchunks);
+    json_uint(j, "reused_chunks", rs->reused_chunks);
+    json_uint(j, "reused_bytes", rs->reused_bytes);
+    json_obj_end(j);
+}
@@ -0,0 +1,119 @@
+////////////////////////////////////////////////////////////////////////
+//
+// Copyright 2015 PMC-Sierra, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you
+// may not use this file except in compliance with the License. You may
+// obtain a copy of the License at
+// http://www.apache.org/licenses/LICENSE-2.0 Unless required by
+// applicable law or agreed to in writing, software distributed under the
+// License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+// CONDITIONS OF ANY KIND, either express or implied. See the License for
+// the specific language governing permissions and limitations under the
+// License.
+//
+////////////////////////////////////////////////////////////////////////
+
+////////////////////////////////////////////////////////////////////////
+//
+//   Author: Logan Gunthorpe
+//
+//   Description:
+//     State kept between incremental scans of a file which is mostly
+//     appended to: a fingerprint of every chunk and all the matches, so
+//     the next scan only has to search the chunks that changed and what
+//     was appended.
+//
+////////////////////////////////////////////////////////////////////////
+
+#ifndef RESCAN_H
+#define RESCAN_H
+
+#include "readthrd.h"
+
+#include <sys/stat.h>
+#include <stdio.h>
+#include <stdint.h>
+
+#define RESCAN_MAGIC "TSRSCN03"
+
+struct rescan_chunk {
+    uint64_t offset;
+    uint64_t hash;
+    uint32_t bytes;
+    uint32_t reserved;
+};
+
+struct rescan_state {
+    struct rescan_chunk *chunks;
+    size_t nchunks;
+    size_t chunks_alloc;
+
+    // Absolute offsets, in file order, including the matches spanning
+    // two chunks
+    uint64_t *matches;
+    size_t nmatches;
+    size_t matches_alloc;
+
+    uint64_t dev;
+    uint64_t ino;
+    uint64_t size;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+};
+
+struct rescan {
+    char *fpath;
+    char phrase[24];
+    uint64_t chunk_size;
+
+    // What the last scan found and what this one has so far
+    struct rescan_state old;
+    struct rescan_state new;
+
+    // The ranges this scan searches
+    struct readthrd_range *ranges;
+    size_t nranges;
+
+    // The old matches of the chunks which aren't searched again, and
+    // how many of them are in the new state so far
+    uint64_t *known;
+    size_t nknown;
+    size_t known_next;
+
+    // The chunks read from here on are recorded as they are searched,
+    // the ones before it were fingerprinted when the scan was planned
+    size_t record_from;
+
+    unsigned long reused_chunks;
+    size_t reused_bytes;
+};
+
+// Loads the state left by the last scan, if there is one for the same
+// phrase and chunk size, otherwise the whole input will be read.
+int rescan_open(struct rescan *rs, const char *fpath, const char *phrase,
+                size_t chunk_size);
+void rescan_free(struct rescan *rs);
+
+// Checks the input (with the given stat) against the last scan and
+// plans the ranges to search (in rs->ranges), returning how many there
+// are or -1 on error. If the size or mtime changed every chunk of the
+// last scan is fingerprinted again and only the ones that differ (with
+// the chunk before, for the matches running into them) are searched,
+// along with the last chunk and whatever was appended. The old matches
+// of the other chunks are in rs->known. A file that was replaced or cut
+// short is searched again from the start.
+ssize_t rescan_plan(struct rescan *rs, const char *input,
+                    const struct stat *st);
+
+// Called by the completion thread, in chunk order, with the merged
+// results of every item read
+int rescan_record(struct rescan *rs, struct readthrd_item *item);
+
+// Replaces the state file with what this scan found
+int rescan_save(struct rescan *rs);
+
+void rescan_print(struct rescan *rs, FILE *out);
+void rescan_json(struct rescan *rs, struct json *j);
+
+#endif
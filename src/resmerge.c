@@ -0,0 +1,202 @@
+////////////////////////////////////////////////////////////////////////
+//
+// Copyright 2015 PMC-Sierra, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you
+// may not use this file except in compliance with the License. You may
+// obtain a copy of the License at
+// http://www.apache.org/licenses/LICENSE-2.0 Unless required by
+// applicable law or agreed to in writing, software distributed under the
+// License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+// CONDITIONS OF ANY KIND, either express or implied. See the License for
+// the specific language governing permissions and limitations under the
+// License.
+//
+////////////////////////////////////////////////////////////////////////
+
+////////////////////////////////////////////////////////////////////////
+//
+//   Author: Logan Gunthorpe
+//
+//   Description:
+//     Merge the partial result files written by textswap --partial for
+//     several shards of the same input.
+//
+////////////////////////////////////////////////////////////////////////
+
+#include "partial.h"
+
+#include <argconfig/argconfig.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+
+const char program_desc[] =
+    "Merge textswap partial result files into one";
+
+struct config {
+    char *output;
+    int verbose;
+};
+
+static const struct config defaults = {
+};
+
+static const struct argconfig_commandline_options command_line_options[] = {
+    {"o",           "FILE", CFG_STRING, &defaults.output, required_argument, NULL},
+    {"output",      "FILE", CFG_STRING, &defaults.output, required_argument,
+            "write the merged results to a partial result file"},
+    {"v",           "", CFG_INCREMENT, NULL, no_argument, NULL},
+    {"verbose",     "", CFG_INCREMENT, &defaults.verbose, no_argument,
+            "print the offset of every match"},
+    {0}
+};
+
+struct shard {
+    struct partial p;
+    const char *fpath;
+};
+
+static int cmp_shards(const void *a, const void *b)
+{
+    const struct shard *x = a;
+    const struct shard *y = b;
+
+    if (x->p.hdr.offset < y->p.hdr.offset)
+        return -1;
+    return x->p.hdr.offset > y->p.hdr.offset;
+}
+
+// The shards cover disjoint ranges so, once they are ordered by their
+// offsets, concatenating their (already sorted) results is a merge.
+static int copy_shard(struct shard *s, struct partial *out, int verbose)
+{
+    struct partial *in = &s->p;
+    const char *fpath = s->fpath;
+    uint64_t end = in->hdr.offset + in->hdr.length;
+    uint64_t prev = 0, off;
+    uint64_t count = 0;
+    int ret;
+
+    while ((ret = partial_next(in, &off)) > 0) {
+        if (off < in->hdr.offset || off >= end || (count && off <= prev)) {
+            fprintf(stderr, "%s: offset %"PRIu64" out of order or outside "
+                    "the shard\n", fpath, off);
+            return -1;
+        }
+
+        if (verbose)
+            printf("%10"PRIu64"\n", off);
+
+        if (out != NULL && partial_add(out, off)) {
+            perror("Writing output");
+            return -1;
+        }
+
+        prev = off;
+        count++;
+    }
+
+    if (ret < 0) {
+        fprintf(stderr, "%s: %s\n", fpath, strerror(errno));
+        return -1;
+    }
+
+    if (count != in->hdr.count) {
+        fprintf(stderr, "%s: truncated, expected %"PRIu64" matches but found "
+                "%"PRIu64"\n", fpath, in->hdr.count, count);
+        return -1;
+    }
+
+    return 0;
+}
+
+int main (int argc, char *argv[])
+{
+    struct config cfg;
+    int ret = 0;
+
+    argconfig_append_usage("PARTIAL [PARTIAL...]");
+    int args = argconfig_parse(argc, argv, program_desc, command_line_options,
+                               &defaults, &cfg, sizeof(cfg));
+
+    if (args < 1) {
+        argconfig_print_help(argv[0], program_desc, command_line_options);
+        return 1;
+    }
+
+    struct shard *shards = calloc(args, sizeof(*shards));
+    if (shards == NULL) {
+        perror("Allocating shards");
+        return 1;
+    }
+
+    for (int i = 0; i < args; i++) {
+        shards[i].fpath = argv[i + 1];
+        if (partial_open(&shards[i].p, shards[i].fpath)) {
+            fprintf(stderr, "Unable to open '%s': %s\n", shards[i].fpath,
+                    strerror(errno));
+            return 1;
+        }
+
+        if (strcmp(shards[i].p.hdr.phrase, shards[0].p.hdr.phrase) != 0) {
+            fprintf(stderr, "'%s' was searched for '%s', not '%s'\n",
+                    shards[i].fpath, shards[i].p.hdr.phrase,
+                    shards[0].p.hdr.phrase);
+            return 1;
+        }
+    }
+
+    qsort(shards, args, sizeof(*shards), cmp_shards);
+
+    uint64_t start = shards[0].p.hdr.offset;
+    uint64_t end = start;
+    uint64_t total = 0;
+
+    for (int i = 0; i < args; i++) {
+        struct partial_header *h = &shards[i].p.hdr;
+
+        if (h->offset < end) {
+            fprintf(stderr, "'%s' overlaps '%s'\n", shards[i].fpath,
+                    shards[i - 1].fpath);
+            return 1;
+        } else if (h->offset > end) {
+            fprintf(stderr, "Warning: nothing covers %"PRIu64" to %"PRIu64"\n",
+                    end, h->offset);
+        }
+
+        end = h->offset + h->length;
+        total += h->count;
+    }
+
+    struct partial out;
+    if (cfg.output != NULL &&
+        partial_create(&out, cfg.output, shards[0].p.hdr.phrase, start,
+                       end - start)) {
+        fprintf(stderr, "Unable to create '%s': %s\n", cfg.output,
+                strerror(errno));
+        return 1;
+    }
+
+    for (int i = 0; i < args; i++) {
+        if (copy_shard(&shards[i], cfg.output ? &out : NULL, cfg.verbose))
+            ret = 1;
+        fclose(shards[i].p.f);
+    }
+
+    if (cfg.output != NULL && partial_close(&out)) {
+        fprintf(stderr, "Unable to write '%s': %s\n", cfg.output,
+                strerror(errno));
+        ret = 1;
+    }
+
+    printf("Shards: %d covering %"PRIu64" to %"PRIu64"\n", args, start, end);
+    printf("Matches: %"PRIu64"\n", total);
+
+    free(shards);
+
+    return ret;
+}
@@ -0,0 +1,112 @@
+////////////////////////////////////////////////////////////////////////
+//
+// Copyright 2015 PMC-Sierra, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you
+// may not use this file except in compliance with the License. You may
+// obtain a copy of the License at
+// http://www.apache.org/licenses/LICENSE-2.0 Unless required by
+// applicable law or agreed to in writing, software distributed under the
+// License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+// CONDITIONS OF ANY KIND, either express or implied. See the License for
+// the specific language governing permissions and limitations under the
+// License.
+//
+////////////////////////////////////////////////////////////////////////
+
+////////////////////////////////////////////////////////////////////////
+//
+//   Author: Logan Gunthorpe
+//
+//   Description:
+//     Lock free latency histograms and CPU time accounting shared by
+//     the pipeline stages.
+//
+////////////////////////////////////////////////////////////////////////
+
+#include "stats.h"
+
+#include <capi/utils.h>
+
+#include <time.h>
+
+double stats_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void stats_hist_add(struct stats_hist *h, double secs)
+{
+    unsigned long us = secs > 0 ? secs * 1e6 : 0;
+    int b = 0;
+
+    while (b < STATS_HIST_BUCKETS - 1 && (1UL << b) <= us)
+        b++;
+
+    __sync_add_and_fetch(&h->buckets[b], 1);
+    __sync_add_and_fetch(&h->count, 1);
+    __sync_add_and_fetch(&h->total_us, us);
+
+    unsigned long max = h->max_us;
+    while (us > max) {
+        unsigned long prev = __sync_val_compare_and_swap(&h->max_us, max, us);
+        if (prev == max)
+            break;
+        max = prev;
+    }
+}
+
+void stats_hist_json(struct json *j, const char *key,
+                     const struct stats_hist *h)
+{
+    json_obj_start(j, key);
+    json_uint(j, "count", h->count);
+    json_double(j, "mean_us", h->count ? (double) h->total_us / h->count : 0);
+    json_uint(j, "max_us", h->max_us);
+
+    json_arr_start(j, "buckets");
+    for (int b = 0; b < STATS_HIST_BUCKETS; b++) {
+        if (!h->buckets[b])
+            continue;
+
+        json_obj_start(j, NULL);
+        if (b == STATS_HIST_BUCKETS - 1)
+            json_str(j, "lt_us", NULL);
+        else
+            json_uint(j, "lt_us", 1UL << b);
+        json_uint(j, "count", h->buckets[b]);
+        json_obj_end(j);
+    }
+    json_arr_end(j);
+
+    json_obj_end(j);
+}
+
+static void rusage_fields(struct json *j, const struct rusage *ru)
+{
+    struct timeval utime = ru->ru_utime;
+    struct timeval stime = ru->ru_stime;
+
+    json_double(j, "user_s", utils_timeval_to_secs(&utime));
+    json_double(j, "sys_s", utils_timeval_to_secs(&stime));
+}
+
+void stats_rusage_json(struct json *j, const char *key,
+                       const struct rusage *ru)
+{
+    json_obj_start(j, key);
+    rusage_fields(j, ru);
+    json_obj_end(j);
+}
+
+void stats_thread_json(struct json *j, const char *role, int index,
+                       const struct rusage *ru)
+{
+    json_obj_start(j, NULL);
+    json_str(j, "role", role);
+    json_int(j, "index", index);
+    rusage_fields(j, ru);
+    json_obj_end(j);
+}
@@ -0,0 +1,57 @@
+////////////////////////////////////////////////////////////////////////
+//
+// Copyright 2015 PMC-Sierra, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you
+// may not use this file except in compliance with the License. You may
+// obtain a copy of the License at
+// http://www.apache.org/licenses/LICENSE-2.0 Unless required by
+// applicable law or agreed to in writing, software distributed under the
+// License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+// CONDITIONS OF ANY KIND, either express or implied. See the License for
+// the specific language governing permissions and limitations under the
+// License.
+//
+////////////////////////////////////////////////////////////////////////
+
+////////////////////////////////////////////////////////////////////////
+//
+//   Author: Logan Gunthorpe
+//
+//   Description:
+//     Lock free latency histograms and CPU time accounting shared by
+//     the pipeline stages.
+//
+////////////////////////////////////////////////////////////////////////
+
+#ifndef STATS_H
+#define STATS_H
+
+#include "json.h"
+
+#include <sys/time.h>
+#include <sys/resource.h>
+
+// Bucket i counts samples under 2^i microseconds (and at least
+// 2^(i-1)), the last bucket catches everything larger.
+#define STATS_HIST_BUCKETS 32
+
+struct stats_hist {
+    unsigned long count;
+    unsigned long total_us;
+    unsigned long max_us;
+    unsigned long buckets[STATS_HIST_BUCKETS];
+};
+
+double stats_now(void);
+
+void stats_hist_add(struct stats_hist *h, double secs);
+void stats_hist_json(struct json *j, const char *key,
+                     const struct stats_hist *h);
+
+void stats_rusage_json(struct json *j, const char *key,
+                       const struct rusage *ru);
+void stats_thread_json(struct json *j, const char *role, int index,
+                       const struct rusage *ru);
+
+#endif
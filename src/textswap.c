@@ -26,6 +26,21 @@
 #include "textswap.h"
 #include "readthrd.h"
 #include "writethrd.h"
+#include "hybrid.h"
+#include "progress.h"
+#include "cpusample.h"
+#include "affinity.h"
+#include "bufpool.h"
+#include "membudget.h"
+#include "partial.h"
+#include "rescache.h"
+#include "rescan.h"
+#include "ngindex.h"
+#include "bloom.h"
+#include "filelist.h"
+#include "gunzip.h"
+#include "json.h"
+#include "stats.h"
 #include "version.h"
 
 #include <libcxl.h>
@@ -36,6 +51,7 @@
 
 #include <argconfig/argconfig.h>
 #include <argconfig/report.h>
+#include <argconfig/suffix.h>
 
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -47,6 +63,7 @@
 #include <pthread.h>
 
 #include <errno.h>
+#include <inttypes.h>
 #include <string.h>
 #include <stdio.h>
 
@@ -73,8 +90,43 @@ struct config {
     int read_only;
 
     int expected_matches;
+    unsigned long max_count;
 
     unsigned long read_size;
+    unsigned long offset;
+    int direct;
+    int stream;
+    int raw;
+    int gzip;
+    char *partial;
+    char *files_from;
+
+    char *incremental;
+    char *index;
+    char *bloom;
+
+    int no_cache;
+    char *cache_dir;
+    unsigned long cache_size;
+
+    int json;
+    unsigned progress;
+
+    char *cpu_log;
+    unsigned cpu_interval;
+
+    unsigned cpu_engines;
+    unsigned cpu_slowdown;
+
+    char *reader_cpus;
+    char *submit_cpus;
+    char *complete_cpus;
+    char *writer_cpus;
+    char *numa_node;
+
+    char *hugepages;
+    unsigned buffers;
+    unsigned long mem_budget;
 
     const char *finput;
     const char *foutput;
@@ -90,6 +142,9 @@ static const struct config defaults = {
     .queue_len     = 8,
     .croom         = -1,
     .expected_matches = -1,
+    .cpu_interval  = 100,
+    .cache_size    = 64 << 20,
+    .cpu_slowdown  = 1,
 };
 
 static const struct argconfig_commandline_options command_line_options[] = {
@@ -105,9 +160,16 @@ static const struct argconfig_commandline_options command_line_options[] = {
     {"E",              "NUM", CFG_POSITIVE, &defaults.expected_matches, required_argument, NULL},
     {"expected",       "NUM", CFG_POSITIVE, &defaults.expected_matches, required_argument,
             "test if the number of matches equals an expected value"},
+    {"json",        "", CFG_NONE, &defaults.json, no_argument,
+            "print the configuration, results and statistics as JSON lines"},
+    {"m",           "NUM", CFG_LONG_SUFFIX, &defaults.max_count, required_argument, NULL},
+    {"max-count",   "NUM", CFG_LONG_SUFFIX, &defaults.max_count, required_argument,
+            "stop after NUM matches (in file order)"},
     {"p",             "STRING", CFG_STRING, &defaults.phrase, required_argument, NULL},
     {"phrase",        "STRING", CFG_STRING, &defaults.phrase, required_argument,
             "the ASCII phrase to search for (set command to CMD_D_TX_SRCH)"},
+    {"progress",      "NUM", CFG_POSITIVE, &defaults.progress, required_argument,
+            "report progress every NUM seconds (0 to disable)"},
     {"q",              "NUM", CFG_POSITIVE, &defaults.queue_len, required_argument, NULL},
     {"queue",          "NUM", CFG_POSITIVE, &defaults.queue_len, required_argument,
             "number of wed queue entries"},
@@ -122,10 +184,64 @@ static const struct argconfig_commandline_options command_line_options[] = {
     {"s",             "STRING", CFG_STRING, &defaults.swap_phrase, required_argument, NULL},
     {"swap"  ,        "STRING", CFG_STRING, &defaults.swap_phrase, required_argument,
             "the ASCII phrae to replace the search phrase with"},
+    {"cpu-log",    "FILE", CFG_STRING, &defaults.cpu_log, required_argument,
+            "sample per thread CPU time, context switches and page faults to FILE"},
+    {"cpu-interval", "NUM", CFG_POSITIVE, &defaults.cpu_interval, required_argument,
+            "milliseconds between samples written to the cpu-log"},
+    {"cpu-engines", "NUM", CFG_POSITIVE, &defaults.cpu_engines, required_argument,
+            "also search chunks with NUM software engines, balanced against the AFU"},
+    {"reader-cpus", "LIST", CFG_STRING, &defaults.reader_cpus, required_argument,
+            "pin the read threads to LIST (eg. 0-3,8 or node:1)"},
+    {"submit-cpus", "LIST", CFG_STRING, &defaults.submit_cpus, required_argument,
+            "pin the wqueue submit thread to LIST"},
+    {"complete-cpus", "LIST", CFG_STRING, &defaults.complete_cpus, required_argument,
+            "pin the wqueue completion thread to LIST"},
+    {"writer-cpus", "LIST", CFG_STRING, &defaults.writer_cpus, required_argument,
+            "pin the write threads to LIST"},
+    {"numa-node", "NODE", CFG_STRING, &defaults.numa_node, required_argument,
+            "pin the threads without a CPU list to a NUMA node: a number, "
+            "'device' for the CAPI card's node or 'input' for the input's"},
+    {"hugepages", "MODE", CFG_STRING, &defaults.hugepages, required_argument,
+            "take the chunk buffers from a pre-faulted pool backed by MODE "
+            "pages: 4k, thp, 2M, 1G or auto"},
+    {"buffers", "NUM", CFG_POSITIVE, &defaults.buffers, required_argument,
+            "number of buffers in the --hugepages pool (default is enough "
+            "to keep every stage busy)"},
+    {"mem-budget", "NUM", CFG_LONG_SUFFIX, &defaults.mem_budget, required_argument,
+            "cap the memory held by chunk buffers in flight (bytes, 0 for no cap)"},
+    {"cpu-slowdown", "NUM", CFG_POSITIVE, &defaults.cpu_slowdown, required_argument,
+            "make the software engines NUM times slower (for testing the balancing)"},
     {"croom",      "NUM",  CFG_LONG_SUFFIX, &defaults.croom, required_argument,
             "croom tag credits to permit (per direction). Set to < 0 to use default"},
     {"size",        "NUM",  CFG_LONG_SUFFIX, &defaults.read_size, required_argument,
             "stop reading the file after a specific number of bytes"},
+    {"offset",      "NUM",  CFG_LONG_SUFFIX, &defaults.offset, required_argument,
+            "start reading the file at this offset"},
+    {"length",      "NUM",  CFG_LONG_SUFFIX, &defaults.read_size, required_argument,
+            "only scan a shard of NUM bytes from --offset (same as --size)"},
+    {"partial",     "FILE", CFG_STRING, &defaults.partial, required_argument,
+            "write the offsets of the matches to a partial result file for resmerge"},
+    {"direct",      "", CFG_NONE, &defaults.direct, no_argument,
+            "read with O_DIRECT (always done for block devices)"},
+    {"no-cache",    "", CFG_NONE, &defaults.no_cache, no_argument,
+            "don't answer from, or add to, the result cache"},
+    {"cache-dir",   "DIR", CFG_STRING, &defaults.cache_dir, required_argument,
+            "keep the result cache in DIR instead of ~/.cache/textswap"},
+    {"cache-size",  "NUM", CFG_LONG_SUFFIX, &defaults.cache_size, required_argument,
+            "evict the least recently used results once the cache is bigger than NUM bytes"},
+    {"raw",         "", CFG_NONE, &defaults.raw, no_argument,
+            "search gzip compressed inputs as they are instead of decompressing them"},
+    {"incremental", "FILE", CFG_STRING, &defaults.incremental, required_argument,
+            "keep the fingerprint and matches of every chunk in FILE and only search "
+            "the chunks which changed since the last scan"},
+    {"index",       "FILE", CFG_STRING, &defaults.index, required_argument,
+            "only search the blocks which the trigram index FILE (see "
+            "'textswap index') says could hold the phrase"},
+    {"bloom",       "FILE", CFG_STRING, &defaults.bloom, required_argument,
+            "keep Bloom filters of every chunk's trigrams in FILE: built by a "
+            "full search, used by later ones to skip the chunks which can't match"},
+    {"files-from",  "FILE", CFG_STRING, &defaults.files_from, required_argument,
+            "also search the files listed, one per line, in FILE ('-' for stdin)"},
     {"S",           "", CFG_NONE, &defaults.software, no_argument, NULL},
     {"software",    "", CFG_NONE, &defaults.software, no_argument,
             "use sotfware emulation"},
@@ -154,13 +270,449 @@ static void print_cputime(void)
     fprintf(stderr, "   Tot    %.1fs user, %.1fs system\n", user, sys);
 }
 
+static void print_json_config(struct json *j, struct config *cfg)
+{
+    json_obj_start(j, "config");
+    json_str(j, "input", cfg->finput);
+    json_str(j, "output", cfg->foutput);
+    json_str(j, "device", cfg->device);
+    json_bool(j, "software", cfg->software);
+    json_str(j, "mode", cfg->copy ? "copy" : cfg->read_only ? "search" : "swap");
+    json_str(j, "phrase", cfg->phrase);
+    json_str(j, "swap_phrase", cfg->swap_phrase);
+    json_uint(j, "read_threads", cfg->read_threads);
+    json_uint(j, "write_threads", cfg->write_threads);
+    json_uint(j, "chunk", cfg->chunk);
+    json_uint(j, "queue_len", cfg->queue_len);
+    json_int(j, "croom", cfg->croom);
+    json_uint(j, "read_size", cfg->read_size);
+    json_uint(j, "offset", cfg->offset);
+    json_bool(j, "direct", cfg->direct);
+    json_bool(j, "stream", cfg->stream);
+    json_str(j, "compression", gunzip_format_name(cfg->gzip));
+    json_bool(j, "read_discard", cfg->read_discard);
+    json_bool(j, "write_discard", cfg->write_discard);
+    json_uint(j, "cpu_engines", cfg->cpu_engines);
+    json_uint(j, "max_count", cfg->max_count);
+    json_bool(j, "cache", !cfg->no_cache);
+    affinity_json(j);
+    json_obj_end(j);
+}
+
+static void print_json(struct json *j, struct config *cfg,
+                       struct readthrd *rt, struct writethrd *wt,
+                       struct hybrid *hybrid, struct bufpool *pool,
+                       struct membudget *budget, struct filelist *files,
+                       struct rescan *rescan, struct ngindex *index,
+                       struct bloom *bloom, size_t bytes, double elapsed, int have_matches)
+{
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+
+    json_obj_start(j, NULL);
+    json_str(j, "type", "result");
+    json_str(j, "version", VERSION);
+    print_json_config(j, cfg);
+
+    json_bool(j, "cached", 0);
+    json_uint(j, "bytes", bytes);
+    json_uint(j, "holes_skipped", readthrd_hole_bytes(rt));
+    json_double(j, "elapsed_s", elapsed);
+    json_double(j, "rate_Bps", elapsed > 0 ? bytes / elapsed : 0);
+
+    if (have_matches) {
+        json_uint(j, "matches", writethrd_matches(wt));
+        if (cfg->expected_matches >= 0) {
+            json_int(j, "expected", cfg->expected_matches);
+            json_bool(j, "good",
+                      writethrd_matches(wt) == cfg->expected_matches);
+        }
+
+        if (files)
+            filelist_json(files, j);
+    }
+
+    hybrid_json(hybrid, j);
+    rescan_json(rescan, j);
+    ngindex_json(index, j);
+    bloom_json(bloom, j);
+    bufpool_json(pool, j);
+    membudget_json(budget, j);
+    stats_rusage_json(j, "cpu", &ru);
+
+    json_arr_start(j, "threads");
+    readthrd_json_threads(rt, j);
+    hybrid_json_threads(hybrid, j);
+    writethrd_json_threads(wt, j);
+    json_arr_end(j);
+
+    json_obj_start(j, "stages");
+    readthrd_json_stages(rt, j);
+    writethrd_json_stages(wt, j);
+    json_obj_end(j);
+
+    json_obj_end(j);
+}
+
+static int close_partial(struct config *cfg, struct partial *partial,
+                         size_t file_size)
+{
+    size_t end = file_size;
+    if (cfg->read_size && cfg->offset + cfg->read_size < end)
+        end = cfg->offset + cfg->read_size;
+    partial->hdr.length = end > cfg->offset ? end - cfg->offset : 0;
+
+    if (partial_close(partial)) {
+        fprintf(stderr, "Unable to write '%s': %s\n", cfg->partial,
+                strerror(errno));
+        return 1;
+    }
+
+    return 0;
+}
+
+// Report the results of an earlier search of the unchanged file
+// without reading it
+static int answer_from_cache(struct config *cfg, struct rescache *rc,
+                             struct partial *partial, struct json *j)
+{
+    size_t count = rc->count;
+    int ret = 0;
+
+    if (cfg->max_count && count > cfg->max_count)
+        count = cfg->max_count;
+
+    for (size_t i = 0; i < count; i++) {
+        if (cfg->verbose >= 1 && !cfg->json)
+            printf("%10"PRIu64"\n", rc->offsets[i]);
+
+        if (cfg->partial && partial_add(partial, rc->offsets[i])) {
+            perror("Writing partial results");
+            return 1;
+        }
+    }
+
+    if (cfg->partial && close_partial(cfg, partial, rc->bytes))
+        return 1;
+
+    if (cfg->expected_matches >= 0 && count != cfg->expected_matches)
+        ret = 7;
+
+    if (cfg->json) {
+        json_obj_start(j, NULL);
+        json_str(j, "type", "result");
+        json_str(j, "version", VERSION);
+        print_json_config(j, cfg);
+
+        json_bool(j, "cached", 1);
+        json_uint(j, "bytes", rc->bytes);
+        json_uint(j, "matches", count);
+        if (cfg->expected_matches >= 0) {
+            json_int(j, "expected", cfg->expected_matches);
+            json_bool(j, "good", count == cfg->expected_matches);
+        }
+        json_obj_end(j);
+        return ret;
+    }
+
+    printf("Cached Result: %s\n", rc->path);
+    printf("Matches Found: %zu", count);
+    if (cfg->expected_matches >= 0)
+        printf(ret ? " (Bad!)" : " (Good)");
+    printf("\n");
+
+    return ret;
+}
+
+static int set_role_cpus(enum affinity_role role, const char *list)
+{
+    cpu_set_t set;
+
+    if (list == NULL)
+        return 0;
+
+    if (affinity_parse(list, &set)) {
+        fprintf(stderr, "Invalid CPU list: '%s'\n", list);
+        return -1;
+    }
+
+    affinity_set(role, &set);
+    return 0;
+}
+
+static int setup_affinity(struct config *cfg, const char *device)
+{
+    if (set_role_cpus(AFFINITY_READER, cfg->reader_cpus) ||
+        set_role_cpus(AFFINITY_SUBMIT, cfg->submit_cpus) ||
+        set_role_cpus(AFFINITY_COMPLETE, cfg->complete_cpus) ||
+        set_role_cpus(AFFINITY_WRITER, cfg->writer_cpus))
+        return -1;
+
+    if (cfg->numa_node == NULL)
+        return 0;
+
+    int node = -1;
+    const char *path = NULL;
+    char *end;
+
+    if (strcmp(cfg->numa_node, "device") == 0) {
+        path = device;
+    } else if (strcmp(cfg->numa_node, "input") == 0) {
+        path = cfg->finput;
+    } else {
+        node = strtol(cfg->numa_node, &end, 10);
+        if (end == cfg->numa_node || *end || node < 0) {
+            fprintf(stderr, "Invalid NUMA node: '%s'\n", cfg->numa_node);
+            return -1;
+        }
+    }
+
+    if (path != NULL) {
+        node = affinity_path_node(path);
+        if (node < 0) {
+            fprintf(stderr, "Unable to find the NUMA node for '%s', "
+                    "threads will not be pinned\n", path);
+            return 0;
+        }
+    }
+
+    cpu_set_t set;
+    if (affinity_node_cpus(node, &set)) {
+        fprintf(stderr, "Unable to find the CPUs of NUMA node %d\n", node);
+        return -1;
+    }
+
+    for (int i = 0; i < AFFINITY_NUM_ROLES; i++)
+        if (!affinity_is_set(i))
+            affinity_set(i, &set);
+
+    return 0;
+}
+
+static size_t chunk_memsize(struct config *cfg)
+{
+    if (cfg->copy)
+        return cfg->chunk;
+
+    return cfg->chunk * sizeof(uint32_t);
+}
+
+static struct bufpool *start_bufpool(struct config *cfg)
+{
+    int pages = bufpool_parse_pages(cfg->hugepages);
+    if (pages < 0) {
+        fprintf(stderr, "Invalid --hugepages mode: '%s'\n", cfg->hugepages);
+        return NULL;
+    }
+
+    unsigned count = cfg->buffers;
+    if (!count)
+        count = cfg->read_threads * 4 + cfg->queue_len +
+            cfg->cpu_engines * 2 + cfg->write_threads * 2;
+
+    size_t buf_size = chunk_memsize(cfg);
+
+    // The pool is allocated up front so it is the pool itself that
+    // has to fit in the budget
+    if (cfg->mem_budget && count * buf_size > cfg->mem_budget)
+        count = cfg->mem_budget / buf_size;
+
+    // The pool is faulted in by this thread so, to have it land on the
+    // same node as the readers that fill it, borrow their CPUs while
+    // it's created.
+    cpu_set_t saved;
+    pthread_getaffinity_np(pthread_self(), sizeof(saved), &saved);
+    affinity_pin(AFFINITY_READER);
+
+    struct bufpool *pool = bufpool_new(buf_size, count, pages);
+    if (pool == NULL)
+        perror("Allocating buffers");
+
+    pthread_setaffinity_np(pthread_self(), sizeof(saved), &saved);
+
+    return pool;
+}
+
+// Direct reads need chunks made of whole blocks and, as they bypass
+// the page cache's readahead, are best issued at least the device's
+// optimal IO size at a time.
+static int setup_direct(struct config *cfg, int *read_flags)
+{
+    struct readthrd_geometry geom;
+
+    if (readthrd_geometry(cfg->finput, *read_flags, &geom))
+        return -1;
+
+    cfg->direct = geom.direct;
+    if (!geom.direct)
+        return 0;
+
+    *read_flags |= READTHREAD_DIRECT;
+
+    if (cfg->offset % geom.block_size) {
+        fprintf(stderr, "--offset must be a multiple of the block size (%u) "
+                "for direct reads\n", geom.block_size);
+        return -1;
+    }
+
+    unsigned long chunk = cfg->chunk;
+    if (geom.io_opt > chunk)
+        chunk = geom.io_opt;
+    chunk = (chunk + geom.block_size - 1) / geom.block_size * geom.block_size;
+
+    if (chunk != cfg->chunk) {
+        fprintf(stderr, "Using %lu byte chunks for direct reads\n", chunk);
+        cfg->chunk = chunk;
+    }
+
+    return 0;
+}
+
+static const char index_desc[] =
+    "Build a trigram index of the blocks of a file for 'textswap --index'";
+
+struct index_config {
+    unsigned long chunk;
+    unsigned bits;
+    unsigned read_threads;
+};
+
+static const struct index_config index_defaults = {
+    .chunk         = 1 << 20,
+    .bits          = NGINDEX_DEFAULT_BITS,
+    .read_threads  = 4,
+};
+
+static const struct argconfig_commandline_options index_options[] = {
+    {"c",          "NUM",  CFG_LONG_SUFFIX, &index_defaults.chunk, required_argument, NULL},
+    {"chunk",      "NUM",  CFG_LONG_SUFFIX, &index_defaults.chunk, required_argument,
+            "size of the blocks indexed, the least a search can skip (bytes)"},
+    {"buckets",    "BITS", CFG_POSITIVE, &index_defaults.bits, required_argument,
+            "hash the trigrams into 2^BITS buckets (8 to 28)"},
+    {"r",              "NUM", CFG_POSITIVE, &index_defaults.read_threads, required_argument, NULL},
+    {"read-threads",   "NUM", CFG_POSITIVE, &index_defaults.read_threads, required_argument,
+            "number of read threads"},
+    {0}
+};
+
+// The blocks are read by the normal read threads, with the data
+// discarded after the builder has seen it, so no AFU is needed
+static int index_main(int argc, char *argv[])
+{
+    struct index_config cfg;
+    struct stat st, after;
+    char *fpath;
+    int ret = 1;
+
+    argconfig_append_usage("INPUT [INDEX]  (INDEX defaults to INPUT.tsi)");
+    int args = argconfig_parse(argc, argv, index_desc, index_options,
+                               &index_defaults, &cfg, sizeof(cfg));
+
+    if (args < 1 || args > 2) {
+        argconfig_print_help(argv[0], index_desc, index_options);
+        return 1;
+    }
+
+    if (cfg.chunk < NGINDEX_MIN_BLOCK || cfg.chunk > INT32_MAX ||
+        cfg.bits < 8 || cfg.bits > 28) {
+        fprintf(stderr, "The block size must be at least %d bytes and "
+                "--buckets between 8 and 28\n", NGINDEX_MIN_BLOCK);
+        return 1;
+    }
+
+    const char *input = argv[1];
+    if (stat(input, &st) || !S_ISREG(st.st_mode)) {
+        fprintf(stderr, "Only a regular file can be indexed: '%s'\n", input);
+        return 1;
+    }
+
+    if (args == 2)
+        fpath = strdup(argv[2]);
+    else if (asprintf(&fpath, "%s.tsi", input) < 0)
+        fpath = NULL;
+
+    if (fpath == NULL) {
+        perror("Index path");
+        return 1;
+    }
+
+    struct ngindex_builder *b = ngindex_builder_new(cfg.bits);
+    if (b == NULL) {
+        perror("Starting index");
+        goto free_fpath;
+    }
+
+    struct readthrd *rt = readthrd_start(input, cfg.read_threads,
+                                         READTHREAD_DISCARD, NULL);
+    if (rt == NULL) {
+        perror("Starting Read Threads");
+        goto free_builder;
+    }
+
+    readthrd_set_visit(rt, ngindex_visit, b);
+
+    struct timeval start_time, end_time;
+    gettimeofday(&start_time, NULL);
+
+    size_t bytes = readthrd_run(rt, cfg.chunk, 0, 0);
+    readthrd_join(rt);
+
+    if (stat(input, &after) || after.st_size != st.st_size ||
+        after.st_mtim.tv_sec != st.st_mtim.tv_sec ||
+        after.st_mtim.tv_nsec != st.st_mtim.tv_nsec) {
+        fprintf(stderr, "'%s' changed while it was being indexed\n", input);
+        goto free_threads;
+    }
+
+    if (ngindex_write(b, fpath, &st)) {
+        fprintf(stderr, "Unable to write '%s': %s\n", fpath,
+                strerror(errno));
+        goto free_threads;
+    }
+
+    gettimeofday(&end_time, NULL);
+
+    printf("Index: %s\n", fpath);
+    printf("Transfer rate:\n  ");
+    report_transfer_bin_rate(stdout, &start_time, &end_time, bytes);
+    printf("\n");
+    ret = 0;
+
+free_threads:
+    readthrd_free(rt);
+free_builder:
+    ngindex_builder_free(b);
+free_fpath:
+    free(fpath);
+    return ret;
+}
+
 int main (int argc, char *argv[])
 {
     int ret = 0;
     struct config cfg;
     struct writethrd *wt = NULL;
+    struct hybrid *hybrid = NULL;
+    struct bufpool *pool = NULL;
+    struct membudget *budget = NULL;
+    struct partial partial;
+    struct rescache cache = {0};
+    struct rescan rescan = {0};
+    int use_cache = 0;
+    struct filelist files;
+    struct progress *prog = NULL;
+    struct cpusample *cs = NULL;
+    struct ngindex *index = NULL;
+    struct bloom *bloom = NULL;
+    struct readthrd_range *ranges = NULL;
+    ssize_t nranges = 0;
+    struct json json;
+
+    if (argc > 1 && strcmp(argv[1], "index") == 0)
+        return index_main(argc - 1, &argv[1]);
 
-    argconfig_append_usage("INPUT [COPY_OUTPUT]");
+    argconfig_append_usage("INPUT... | -C INPUT COPY_OUTPUT  (INPUT may be - "
+                           "for stdin)");
     int args = argconfig_parse(argc, argv, program_desc, command_line_options,
                                &defaults, &cfg, sizeof(cfg));
 
@@ -176,24 +728,73 @@ int main (int argc, char *argv[])
         return 0;
     }
 
-    if (args < 1 || args > 2) {
+    if (args < 1 && cfg.files_from == NULL) {
         argconfig_print_help(argv[0], program_desc, command_line_options);
         return 1;
     }
 
-    if (args == 2 && !cfg.copy) {
+    if (cfg.copy && (args < 1 || args > 2 || cfg.files_from)) {
         argconfig_print_help(argv[0], program_desc, command_line_options);
         return 1;
     }
 
-    cfg.foutput = cfg.finput = argv[1];
-    if (args == 2)
+    if (cfg.cpu_engines && (cfg.copy || cfg.read_discard)) {
+        fprintf(stderr, "--cpu-engines can only be used when searching\n");
+        return 1;
+    }
+
+    if (cfg.partial && (cfg.copy || cfg.read_discard || cfg.write_discard)) {
+        fprintf(stderr, "--partial can only be used when searching\n");
+        return 1;
+    }
+
+    if (cfg.max_count && (cfg.copy || cfg.read_discard)) {
+        fprintf(stderr, "--max-count can only be used when searching\n");
+        return 1;
+    }
+
+    // Every argument is an input unless copying, directories are
+    // expanded to the files under them
+    filelist_init(&files);
+    for (int i = 1; i <= (cfg.copy ? 1 : args); i++)
+        if (filelist_add(&files, argv[i]))
+            return 1;
+
+    if (cfg.files_from && filelist_read(&files, cfg.files_from))
+        return 1;
+
+    if (!files.count) {
+        fprintf(stderr, "No input files\n");
+        return 1;
+    }
+
+    int multi = files.count > 1 || files.expanded;
+
+    if (multi && !cfg.read_only && !cfg.read_discard && !cfg.write_discard) {
+        fprintf(stderr, "Several inputs can only be searched (-R)\n");
+        return 1;
+    }
+
+    if (multi && (cfg.offset || cfg.read_size || cfg.partial || cfg.direct ||
+                  files.special)) {
+        fprintf(stderr, "--offset, --length, --partial, --direct and block "
+                "devices only work with a single input\n");
+        return 1;
+    }
+
+    cfg.foutput = cfg.finput = files.files[0].path;
+    if (cfg.copy && args == 2)
         cfg.foutput = argv[2];
 
+    if (setup_affinity(&cfg, cfg.device))
+        return 1;
+
     int read_flags = 0;
     int write_flags = 0;
 
-    if (cfg.verbose >= 1) {
+    json_init(&json, stdout);
+
+    if (cfg.verbose >= 1 && !cfg.json) {
         write_flags |= WRITETHREAD_PRINT_OFFSETS;
         printf("Matches: \n");
     }
@@ -220,9 +821,222 @@ int main (int argc, char *argv[])
     if (cfg.read_only)
         write_flags |= WRITETHREAD_SEARCH_ONLY;
 
+    if (cfg.direct)
+        read_flags |= READTHREAD_DIRECT;
+
+    if (!cfg.raw)
+        read_flags |= READTHREAD_GUNZIP;
+
+    struct readthrd_geometry geom = {0};
+    if (!multi && readthrd_geometry(cfg.finput, read_flags & READTHREAD_GUNZIP,
+                                    &geom))
+        return 1;
+    cfg.stream = geom.stream;
+    cfg.gzip = geom.gzip;
+
+    if (cfg.gzip && !gunzip_available()) {
+        fprintf(stderr, "'%s' is gzip compressed but textswap was built "
+                "without zlib, use --raw to search it as it is\n", cfg.finput);
+        return 1;
+    }
+
+    // Nor can swaps be written back into a compressed input
+    if (cfg.gzip && !cfg.read_only && !cfg.copy && !cfg.read_discard &&
+        !cfg.write_discard) {
+        fprintf(stderr, "A gzip input can only be searched (-R) or "
+                "decompressed (-C)\n");
+        return 1;
+    }
+
+    if (cfg.gzip && (cfg.offset || cfg.direct)) {
+        fprintf(stderr, "--offset and --direct can't be used with a gzip "
+                "input\n");
+        return 1;
+    }
+
+    if (cfg.gzip && !cfg.copy)
+        write_flags |= WRITETHREAD_SEARCH_ONLY;
+
+    // There's nowhere to write the swaps back to in a stream
+    if (cfg.stream && !cfg.read_only && !cfg.copy && !cfg.read_discard &&
+        !cfg.write_discard) {
+        fprintf(stderr, "A stream can only be searched (-R) or copied (-C)\n");
+        return 1;
+    }
+
+    if (cfg.stream && (cfg.offset || cfg.direct)) {
+        fprintf(stderr, "--offset and --direct can't be used with a stream\n");
+        return 1;
+    }
+
+    if (cfg.stream && !cfg.copy)
+        write_flags |= WRITETHREAD_SEARCH_ONLY;
+
+    if (cfg.incremental && (!cfg.read_only || cfg.copy || cfg.read_discard ||
+                            cfg.write_discard || multi || cfg.stream ||
+                            cfg.gzip || geom.blockdev || cfg.max_count ||
+                            cfg.offset || cfg.read_size)) {
+        fprintf(stderr, "--incremental can only be used to search (-R) a "
+                "single uncompressed file, without --max-count, --offset "
+                "or --length\n");
+        return 1;
+    }
+
+    if (cfg.index && (!cfg.read_only || cfg.copy || cfg.read_discard ||
+                      cfg.write_discard || multi || cfg.stream || cfg.gzip ||
+                      geom.blockdev || cfg.incremental)) {
+        fprintf(stderr, "--index can only be used to search (-R) a single "
+                "uncompressed file, without --incremental\n");
+        return 1;
+    }
+
+    if (cfg.bloom && (!cfg.read_only || cfg.copy || cfg.read_discard ||
+                      cfg.write_discard || multi || cfg.stream || cfg.gzip ||
+                      geom.blockdev || cfg.incremental || cfg.index)) {
+        fprintf(stderr, "--bloom can only be used to search (-R) a single "
+                "uncompressed file, without --incremental or --index\n");
+        return 1;
+    }
+
+    if (!multi && setup_direct(&cfg, &read_flags))
+        return 1;
+
+    // The shard's length is filled in once the input's size is known
+    if (cfg.partial && partial_create(&partial, cfg.partial, cfg.phrase,
+                                      cfg.offset, 0)) {
+        fprintf(stderr, "Unable to create '%s': %s\n", cfg.partial,
+                strerror(errno));
+        return 1;
+    }
+
+    // Only searches of a whole regular file (or a window of one) are
+    // cached, the key can't tell if anything else has changed
+    if (!cfg.no_cache && cfg.read_only && !cfg.copy && !cfg.read_discard &&
+        !cfg.write_discard && !multi && !cfg.stream && !geom.blockdev)
+        use_cache = !rescache_init(&cache, cfg.cache_dir, cfg.cache_size,
+                                   cfg.finput, cfg.phrase, cfg.offset,
+                                   cfg.read_size,
+                                   cfg.gzip ? RESCACHE_GUNZIP : 0);
+
+    if (use_cache && rescache_lookup(&cache)) {
+        ret = answer_from_cache(&cfg, &cache, &partial, &json);
+        rescache_free(&cache);
+        filelist_free(&files);
+        return ret;
+    }
+
+    // Every match is still found by the normal search, the index only
+    // leaves out the blocks which can't hold one
+    if (cfg.index) {
+        struct stat st;
+
+        if (stat(cfg.finput, &st) ||
+            (index = ngindex_open(cfg.index, &st)) == NULL) {
+            if (errno == ESTALE)
+                fprintf(stderr, "'%s' has changed since '%s' was built, "
+                        "run textswap index again\n", cfg.finput, cfg.index);
+            else
+                fprintf(stderr, "Unable to load '%s': %s\n", cfg.index,
+                        strerror(errno));
+            return 1;
+        }
+
+        nranges = ngindex_query(index, cfg.phrase, &ranges);
+        if (nranges < 0) {
+            perror("Querying index");
+            ngindex_close(index);
+            return 1;
+        }
+    }
+
+    // A missing or stale sidecar is rebuilt by a search of the whole
+    // file, otherwise its filters pick the chunks to read
+    if (cfg.bloom) {
+        struct stat st;
+
+        if (stat(cfg.finput, &st)) {
+            perror("Bloom filter input");
+            return 1;
+        }
+
+        bloom = bloom_open(cfg.bloom, &st);
+        if (bloom != NULL) {
+            nranges = bloom_query(bloom, cfg.phrase, &ranges);
+            if (nranges < 0) {
+                perror("Querying bloom filters");
+                bloom_free(bloom);
+                return 1;
+            }
+        } else if (errno != ENOENT && errno != ESTALE && errno != EINVAL) {
+            fprintf(stderr, "Unable to load '%s': %s\n", cfg.bloom,
+                    strerror(errno));
+            return 1;
+        } else if (!cfg.offset && !cfg.read_size && !cfg.max_count) {
+            bloom = bloom_new(cfg.finput, &st, cfg.chunk);
+            if (bloom == NULL) {
+                perror("Starting bloom filters");
+                return 1;
+            }
+        }
+    }
+
+    // Only the chunks which changed since the last scan and what was
+    // appended are searched
+    if (cfg.incremental) {
+        struct stat st;
+
+        if (rescan_open(&rescan, cfg.incremental, cfg.phrase, cfg.chunk)) {
+            fprintf(stderr, "Unable to load '%s': %s\n", cfg.incremental,
+                    strerror(errno));
+            return 1;
+        }
+
+        if (stat(cfg.finput, &st) ||
+            rescan_plan(&rescan, cfg.finput, &st) < 0) {
+            fprintf(stderr, "Unable to check '%s': %s\n", cfg.finput,
+                    strerror(errno));
+            rescan_free(&rescan);
+            return 1;
+        }
+
+        read_flags |= READTHREAD_FINGERPRINT;
+    }
+
+    if (cfg.cpu_log != NULL) {
+        cs = cpusample_start(cfg.cpu_log, cfg.cpu_interval);
+        if (cs == NULL)
+            return 1;
+    }
+
+    if (cfg.mem_budget && cfg.mem_budget < chunk_memsize(&cfg)) {
+        fprintf(stderr, "--mem-budget must fit at least one chunk buffer "
+                "(%zu bytes)\n", chunk_memsize(&cfg));
+        cpusample_stop(cs);
+        return 1;
+    }
+
+    if (cfg.mem_budget) {
+        budget = membudget_new(cfg.mem_budget);
+        if (budget == NULL) {
+            perror("Allocating memory budget");
+            cpusample_stop(cs);
+            return 1;
+        }
+    }
+
+    if (cfg.hugepages != NULL) {
+        pool = start_bufpool(&cfg);
+        if (pool == NULL) {
+            membudget_free(budget);
+            cpusample_stop(cs);
+            return 1;
+        }
+    }
+
     if (!cfg.read_discard) {
         if (wqueue_init(cfg.device, &MMIO->wq, cfg.queue_len)) {
             perror("Initializing wqueue");
+            cpusample_stop(cs);
             return 1;
         }
         if (!cfg.software && cfg.croom >= 0)
@@ -230,8 +1044,18 @@ int main (int argc, char *argv[])
 
         textswap_set_phrase(wqueue_afu(), cfg.phrase);
 
+        if (cfg.cpu_engines) {
+            hybrid = hybrid_start(cfg.phrase, cfg.cpu_engines,
+                                  cfg.cpu_slowdown, cfg.queue_len);
+            if (hybrid == NULL) {
+                perror("Starting CPU Engines");
+                ret = 1;
+                goto wqueue_cleanup;
+            }
+        }
+
         wt = writethrd_start(cfg.foutput, cfg.swap_phrase, cfg.write_threads,
-                             write_flags);
+                             write_flags, hybrid);
         if (wt == NULL) {
             perror("Starting Write Threads");
             ret = 1;
@@ -239,21 +1063,94 @@ int main (int argc, char *argv[])
         }
     }
 
-    struct readthrd *rt = readthrd_start(cfg.finput, cfg.read_threads,
-                                         read_flags);
+    struct readthrd *rt;
+    if (multi)
+        rt = readthrd_start_files(&files, cfg.read_threads, read_flags,
+                                  hybrid);
+    else
+        rt = readthrd_start(cfg.finput, cfg.read_threads, read_flags, hybrid);
+
     if (rt == NULL) {
         perror("Starting Read Threads");
         ret = 1;
         goto wqueue_cleanup;
     }
 
+    readthrd_set_bufpool(rt, pool);
+    readthrd_set_membudget(rt, budget);
+
+    if (index || (bloom && bloom_loaded(bloom)))
+        readthrd_set_ranges(rt, ranges, nranges);
+    else if (cfg.incremental)
+        readthrd_set_ranges(rt, rescan.ranges, rescan.nranges);
+    else if (bloom)
+        readthrd_set_visit(rt, bloom_visit, bloom);
+
+    if (cfg.max_count)
+        writethrd_set_max_count(wt, cfg.max_count, rt);
+
+    if (cfg.partial)
+        writethrd_set_partial(wt, &partial);
+
+    // A list cut short by --max-count can't answer a later search
+    if (use_cache && !cfg.max_count)
+        writethrd_set_cache(wt, &cache);
+
+    if (cfg.incremental) {
+        writethrd_set_rescan(wt, &rescan);
+        writethrd_set_known(wt, rescan.known, rescan.nknown);
+    }
+
+    if (multi && wt)
+        writethrd_set_files(wt, &files);
+
+    // Read on past the end of a shard so the matches which start in it
+    // but finish in the next one are found (and only by this shard).
+    size_t length = cfg.read_size;
+    if (length && !cfg.copy && wt) {
+        writethrd_set_limit(wt, cfg.offset + length);
+        length += strlen(cfg.phrase) - 1;
+    }
+
+    if (cfg.progress)
+        prog = progress_start(rt, wt, cfg.progress, cfg.json ? &json : NULL);
+
     struct timeval start_time;
     gettimeofday(&start_time, NULL);
 
-    size_t file_size = readthrd_run(rt, cfg.chunk, cfg.read_size);
+    size_t file_size = readthrd_run(rt, cfg.chunk, cfg.offset, length);
     readthrd_join(rt);
 
     writethrd_join(wt);
+    hybrid_join(hybrid);
+
+    if (cfg.partial && close_partial(&cfg, &partial,
+                                     readthrd_file_size(rt)))
+        ret = 1;
+
+    if (use_cache && !cfg.max_count) {
+        cache.bytes = readthrd_file_size(rt);
+        if (rescache_store(&cache))
+            fprintf(stderr, "Unable to add to the result cache '%s': %s\n",
+                    cache.dir, strerror(errno));
+    }
+
+    if (bloom && !bloom_loaded(bloom) && bloom_save(bloom, cfg.bloom)) {
+        fprintf(stderr, "Unable to write '%s': %s\n", cfg.bloom,
+                strerror(errno));
+        ret = 1;
+    }
+
+    if (cfg.incremental && rescan_save(&rescan)) {
+        fprintf(stderr, "Unable to write '%s': %s\n", cfg.incremental,
+                strerror(errno));
+        ret = 1;
+    }
+
+    struct timeval end_time;
+    gettimeofday(&end_time, NULL);
+
+    progress_stop(prog);
 
     if (cfg.verbose >= 2) {
         readthrd_print_cputime(rt);
@@ -261,36 +1158,84 @@ int main (int argc, char *argv[])
         print_cputime();
     }
 
+    int have_matches = !cfg.copy && !cfg.read_discard && !cfg.write_discard;
+
+    if (have_matches && cfg.expected_matches >= 0 &&
+        writethrd_matches(wt) != cfg.expected_matches)
+        ret = 7;
+
+    if (cfg.json) {
+        print_json(&json, &cfg, rt, wt, hybrid, pool, budget,
+                   multi && wt ? &files : NULL,
+                   cfg.incremental ? &rescan : NULL, index, bloom,
+                   file_size,
+                   utils_timeval_to_secs(&end_time) -
+                   utils_timeval_to_secs(&start_time),
+                   have_matches);
+        goto free_threads;
+    }
+
     printf("Transfer rate:\n  ");
-    struct timeval end_time;
-    gettimeofday(&end_time, NULL);
     report_transfer_bin_rate(stdout, &start_time, &end_time, file_size);
     printf("\n");
 
-    if (!cfg.copy && !cfg.read_discard && !cfg.write_discard) {
+    if (readthrd_hole_bytes(rt)) {
+        double holes = readthrd_hole_bytes(rt);
+        const char *suffix = suffix_dbinary_get(&holes);
+        printf("Holes Skipped: %.2f%sB\n", holes, suffix);
+    }
+
+    if (have_matches) {
         if (cfg.read_only)
             printf("Matches Found: %ld", writethrd_matches(wt));
         else
             printf("Matches Replaced: %ld", writethrd_matches(wt));
 
-        if (cfg.expected_matches >= 0) {
-            if (writethrd_matches(wt) == cfg.expected_matches) {
-                printf(" (Good)");
-            } else {
-                printf(" (Bad!)");
-                ret = 7;
-            }
-        }
+        if (cfg.expected_matches >= 0)
+            printf(ret ? " (Bad!)" : " (Good)");
 
         printf("\n");
+
+        if (multi)
+            filelist_print_matches(&files, stdout);
     }
 
+    if (cfg.incremental)
+        rescan_print(&rescan, stdout);
+
+    if (index)
+        ngindex_print(index, stdout);
+
+    if (bloom)
+        bloom_print(bloom, stdout);
+
+    if (hybrid)
+        hybrid_print(hybrid, stdout);
+
+    if (pool)
+        bufpool_print(pool, stdout);
+
+    if (budget)
+        membudget_print(budget, stdout);
+
+free_threads:
     readthrd_free(rt);
     writethrd_free(wt);
+    hybrid_free(hybrid);
 
 wqueue_cleanup:
     if (!cfg.read_discard)
         wqueue_cleanup();
 
+    bufpool_free(pool);
+    membudget_free(budget);
+    cpusample_stop(cs);
+    filelist_free(&files);
+    rescache_free(&cache);
+    rescan_free(&rescan);
+    ngindex_close(index);
+    bloom_free(bloom);
+    free(ranges);
+
     return ret;
 }
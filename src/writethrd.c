@@ -27,6 +27,14 @@
 
 #include "writethrd.h"
 #include "readthrd.h"
+#include "hybrid.h"
+#include "stats.h"
+#include "cpusample.h"
+#include "affinity.h"
+#include "partial.h"
+#include "rescache.h"
+#include "rescan.h"
+#include "filelist.h"
 
 #include <capi/worker.h>
 #include <capi/macro.h>
@@ -51,16 +59,44 @@ struct writethrd {
     const char *fpath;
     struct fifo *fifo;
     int flags;
+    int sync;
     unsigned long matches;
     char swap_phrase[17];
+    struct hybrid *hybrid;
+
+    unsigned long max_count;
+    unsigned long counted;
+    int stopped;
+    struct readthrd *rt;
+
+    size_t limit;
+    struct partial *partial;
+    struct rescache *cache;
+    struct rescan *rescan;
+    struct filelist *files;
+
+    const uint64_t *known;
+    size_t nknown;
+    size_t known_next;
 
     pthread_t wqueue_thrd;
     struct rusage wqueue_rusage;
+
+    int num_threads;
+    unsigned thread_seq;
+    struct rusage *write_rusage;
+    struct stats_hist proc_hist;
+    struct stats_hist write_hist;
+    size_t bytes_done;
+    unsigned long chunks_done;
 };
 
 static void *copy_thread(void *arg)
 {
     struct writethrd *wt = container_of(arg, struct writethrd, worker);
+    unsigned tid = __sync_fetch_and_add(&wt->thread_seq, 1);
+    cpusample_register("copy", tid);
+    affinity_pin(AFFINITY_WRITER);
 
     int fd = open(wt->fpath, O_WRONLY);
     if (fd < 0) {
@@ -70,17 +106,24 @@ static void *copy_thread(void *arg)
 
     struct readthrd_item *item;
     while ((item = fifo_pop(wt->fifo)) != NULL) {
+        double start = stats_now();
+
         lseek(fd, item->offset, SEEK_SET);
         if (write(fd, item->buf, item->real_bytes) < 0) {
             perror("Copy Thread Write");
             exit(EIO);
         }
 
-        free(item->buf);
-        free(item);
+        stats_hist_add(&wt->write_hist, stats_now() - start);
+
+        readthrd_item_free(item);
     }
 
+    if (wt->sync)
+        fdatasync(fd);
+
     close(fd);
+    getrusage(RUSAGE_THREAD, &wt->write_rusage[tid]);
     worker_finish_thread(&wt->worker);
 
     return NULL;
@@ -89,8 +132,12 @@ static void *copy_thread(void *arg)
 static void *swap_thread(void *arg)
 {
     struct writethrd *wt = container_of(arg, struct writethrd, worker);
+    unsigned tid = __sync_fetch_and_add(&wt->thread_seq, 1);
     int fd = -1;
 
+    cpusample_register("swap", tid);
+    affinity_pin(AFFINITY_WRITER);
+
     if (!(wt->flags & WRITETHREAD_SEARCH_ONLY)) {
         fd = open(wt->fpath, O_WRONLY);
         if (fd < 0) {
@@ -103,18 +150,26 @@ static void *swap_thread(void *arg)
     struct readthrd_item *item;
     unsigned long matches = 0;
     while ((item = fifo_pop(wt->fifo)) != NULL) {
+        double start = stats_now();
 
-        uint32_t *indexes = item->buf;
-        for (int i = 0; i < item->result_bytes / sizeof(*indexes); i++) {
+        int32_t *indexes = item->buf;
+        for (size_t i = 0; i < item->result_bytes / sizeof(*indexes); i++) {
             if (indexes[i] == INT32_MAX)
                 break;
 
-            int idx = indexes[i] + item->offset;
+            // The index is relative to (and may be negative, when the
+            // match started in the previous chunk) the chunk's offset
+            // which can be well past 2GB.
+            off_t idx;
+            unsigned file = readthrd_item_locate(item, indexes[i], &idx);
 
             matches++;
 
-            if (wt->flags & WRITETHREAD_PRINT_OFFSETS)
-                printf("%10"PRId32"\n", idx);
+            if (wt->flags & WRITETHREAD_PRINT_OFFSETS && wt->files)
+                printf("%s:%"PRId64"\n", wt->files->files[file].path,
+                       (int64_t) idx);
+            else if (wt->flags & WRITETHREAD_PRINT_OFFSETS)
+                printf("%10"PRId64"\n", (int64_t) idx);
 
             if (wt->flags & WRITETHREAD_SEARCH_ONLY)
                 continue;
@@ -126,40 +181,185 @@ static void *swap_thread(void *arg)
             }
         }
 
-        free(item->buf);
-        free(item);
+        stats_hist_add(&wt->write_hist, stats_now() - start);
+
+        readthrd_item_free(item);
     }
 
     __sync_add_and_fetch(&wt->matches, matches);
 
+    if (fd >= 0 && wt->sync)
+        fdatasync(fd);
+
     if (fd >= 0)
         close(fd);
+    getrusage(RUSAGE_THREAD, &wt->write_rusage[tid]);
     worker_finish_thread(&wt->worker);
 
     return NULL;
 }
 
 
-static void *wqueue_thread(void *arg)
+// Only keep the results of an item that start in [lo, hi) relative
+// to its offset.
+static void filter_results(struct readthrd_item *item, int32_t lo, int32_t hi)
 {
-    struct writethrd *wt = arg;
+    int32_t *res = item->buf;
+    size_t n = 0, i;
+
+    for (i = 0; i < item->result_bytes / sizeof(*res); i++) {
+        if (res[i] == INT32_MAX)
+            break;
+        if (res[i] >= lo && res[i] < hi)
+            res[n++] = res[i];
+    }
 
-    int last = 0;
-    unsigned next_index = 0;
-    while(!last) {
-        struct wqueue_item it;
-        int error_code = wqueue_pop(&it);
-        int dirty = it.flags & WQ_DIRTY_FLAG || wt->flags & WRITETHREAD_ALWAYS_WRITE;
+    for (; n < i; n++)
+        res[n] = INT32_MAX;
+}
+
+static struct readthrd_item *pop_item(struct writethrd *wt)
+{
+    if (wt->hybrid)
+        return hybrid_pop(wt->hybrid);
+
+    struct wqueue_item it;
+    int error_code = wqueue_pop(&it);
+    struct readthrd_item *item = it.opaque;
+
+    if (error_code) {
+        fprintf(stderr, "Error 0x%04x processing buffer %d (at 0x%p)\n",
+                error_code, item->index, item->buf);
+
+        exit(EIO);
+    }
+
+    item->dirty = it.flags & WQ_DIRTY_FLAG;
+    item->result_bytes = it.dst_len;
+    item->proc_secs = wqueue_calc_duration(&it);
+
+    // The AFU treats consecutive chunks as contiguous. When a hole was
+    // skipped between them the matches it reports as starting in the
+    // previous chunk aren't real.
+    if (!item->contig && item->dirty && !(wt->flags & WRITETHREAD_COPY))
+        filter_results(item, 0, INT32_MAX);
+
+    return item;
+}
+
+// Count the results of an item (which arrive in file order) and, once
+// the maximum is reached, cut them off and stop the readers.
+static void check_max_count(struct writethrd *wt, struct readthrd_item *item)
+{
+    if (!item->dirty)
+        return;
+
+    int32_t *res = item->buf;
+    size_t n = item->result_bytes / sizeof(*res);
+
+    for (size_t i = 0; i < n && res[i] != INT32_MAX; i++) {
+        if (wt->counted++ < wt->max_count)
+            continue;
+
+        res[i] = INT32_MAX;
+        wt->stopped = 1;
+        readthrd_stop(wt->rt);
+        return;
+    }
+
+    if (wt->counted >= wt->max_count) {
+        wt->stopped = 1;
+        readthrd_stop(wt->rt);
+    }
+}
+
+static void record_partial(struct writethrd *wt, struct readthrd_item *item)
+{
+    if (!item->dirty)
+        return;
+
+    int32_t *res = item->buf;
+    for (size_t i = 0; i < item->result_bytes / sizeof(*res); i++) {
+        if (res[i] == INT32_MAX)
+            break;
+
+        if (partial_add(wt->partial, (int64_t) item->offset + res[i])) {
+            perror("Writing partial results");
+            exit(EIO);
+        }
+    }
+}
+
+static void record_cache(struct writethrd *wt, struct readthrd_item *item)
+{
+    if (!item->dirty)
+        return;
+
+    int32_t *res = item->buf;
+    for (size_t i = 0; i < item->result_bytes / sizeof(*res); i++) {
+        if (res[i] == INT32_MAX)
+            break;
+
+        rescache_add(wt->cache, (int64_t) item->offset + res[i]);
+    }
+}
+
+// Items come back in order so each file's matches can be totaled
+// here without any locking.
+static void count_file_matches(struct writethrd *wt,
+                               struct readthrd_item *item)
+{
+    if (!item->dirty)
+        return;
+
+    int32_t *res = item->buf;
+    size_t n = item->result_bytes / sizeof(*res);
+    off_t offset;
 
-        struct readthrd_item *item = it.opaque;
+    for (size_t i = 0; i < n && res[i] != INT32_MAX; i++)
+        wt->files->files[readthrd_item_locate(item, res[i], &offset)].matches++;
+}
+
+// The known matches are handled in order with the ones found, as if
+// they were results of the chunks they start in
+static void emit_known(struct writethrd *wt, uint64_t before)
+{
+    unsigned long count = 0;
 
-        if (error_code) {
-            fprintf(stderr, "Error 0x%04x processing buffer %d (at 0x%p)\n",
-                    error_code, item->index, item->buf);
+    for (; wt->known_next < wt->nknown &&
+           wt->known[wt->known_next] < before; wt->known_next++) {
+        uint64_t offset = wt->known[wt->known_next];
 
+        if (wt->flags & WRITETHREAD_PRINT_OFFSETS)
+            printf("%10"PRIu64"\n", offset);
+
+        if (wt->partial && partial_add(wt->partial, offset)) {
+            perror("Writing partial results");
             exit(EIO);
         }
 
+        if (wt->cache)
+            rescache_add(wt->cache, offset);
+
+        count++;
+    }
+
+    __sync_add_and_fetch(&wt->matches, count);
+}
+
+static void *wqueue_thread(void *arg)
+{
+    struct writethrd *wt = arg;
+
+    cpusample_register("wqueue_complete", 0);
+    affinity_pin(AFFINITY_COMPLETE);
+
+    int last = 0;
+    unsigned next_index = 0;
+    while(!last) {
+        struct readthrd_item *item = pop_item(wt);
+        int dirty = item->dirty || wt->flags & WRITETHREAD_ALWAYS_WRITE;
+
         if (wt->flags & WRITETHREAD_VERBOSE)
             printf("Got Buffer %d: %p for %zd (%d)\n", item->index,
                    item->buf, item->offset, dirty);
@@ -170,16 +370,52 @@ static void *wqueue_thread(void *arg)
         }
 
         last = item->last;
-        item->result_bytes = it.dst_len;
+
+        stats_hist_add(&wt->proc_hist, item->proc_secs);
+        __sync_add_and_fetch(&wt->bytes_done, item->real_bytes);
+        __sync_add_and_fetch(&wt->chunks_done, 1);
+
+        if (wt->stopped) {
+            readthrd_item_free(item);
+            continue;
+        }
+
+        if (wt->nknown && !item->pack)
+            emit_known(wt, item->offset);
+
+        // Before the limit cuts anything off: the chunk's matches are
+        // the same whichever shard it's read for
+        if (wt->rescan && rescan_record(wt->rescan, item)) {
+            perror("Recording incremental state");
+            exit(ENOMEM);
+        }
+
+        // Matches starting past the limit belong to the next shard
+        if (wt->limit && item->offset + item->bytes > wt->limit &&
+            item->dirty && !(wt->flags & WRITETHREAD_COPY))
+            filter_results(item, INT32_MIN,
+                           (int64_t) wt->limit - (int64_t) item->offset);
+
+        if (wt->max_count)
+            check_max_count(wt, item);
+
+        if (wt->partial)
+            record_partial(wt, item);
+
+        if (wt->cache)
+            record_cache(wt, item);
+
+        if (wt->files)
+            count_file_matches(wt, item);
 
         if (wt->flags & WRITETHREAD_DISCARD || !dirty) {
-            free(item->buf);
-            free(item);
+            readthrd_item_free(item);
         } else {
             fifo_push(wt->fifo, item);
         }
     }
 
+    emit_known(wt, UINT64_MAX);
     fifo_close(wt->fifo);
     getrusage(RUSAGE_THREAD, &wt->wqueue_rusage);
 
@@ -212,23 +448,36 @@ static int next_power_of_2(int x)
 }
 
 struct writethrd *writethrd_start(const char *fpath, const char *swap_phrase,
-                                  int num_threads, int flags)
+                                  int num_threads, int flags,
+                                  struct hybrid *hybrid)
 {
     if (!(flags & WRITETHREAD_SEARCH_ONLY) &&
         check_file(fpath, flags & WRITETHREAD_TRUNCATE))
         return NULL;
 
-    struct writethrd *wt = malloc(sizeof(*wt));
+    struct writethrd *wt = calloc(1, sizeof(*wt));
     if (wt == NULL)
         return NULL;
 
+    wt->num_threads = num_threads;
+    wt->write_rusage = calloc(num_threads, sizeof(*wt->write_rusage));
+    if (wt->write_rusage == NULL)
+        goto error_out;
+
     wt->fifo = fifo_new(next_power_of_2(num_threads*2));
     if (wt->fifo == NULL)
-        goto error_out;
+        goto error_rusage_out;
     fifo_open(wt->fifo);
 
     wt->fpath = fpath;
     wt->flags = flags;
+    wt->hybrid = hybrid;
+
+    // Writes to a block device only land in its page cache, make sure
+    // they reach the device before reporting success.
+    struct stat s;
+    if (!stat(fpath, &s) && S_ISBLK(s.st_mode))
+        wt->sync = 1;
     wt->matches = 0;
 
     strncpy(wt->swap_phrase, swap_phrase, sizeof(wt->swap_phrase) - 1);
@@ -251,11 +500,52 @@ error_wqueue_stop:
     pthread_cancel(wt->wqueue_thrd);
 error_fifo_out:
     fifo_free(wt->fifo);
+error_rusage_out:
+    free(wt->write_rusage);
 error_out:
     free(wt);
     return NULL;
 }
 
+void writethrd_set_max_count(struct writethrd *wt, unsigned long max_count,
+                             struct readthrd *rt)
+{
+    wt->max_count = max_count;
+    wt->rt = rt;
+}
+
+void writethrd_set_limit(struct writethrd *wt, size_t limit)
+{
+    wt->limit = limit;
+}
+
+void writethrd_set_partial(struct writethrd *wt, struct partial *partial)
+{
+    wt->partial = partial;
+}
+
+void writethrd_set_cache(struct writethrd *wt, struct rescache *cache)
+{
+    wt->cache = cache;
+}
+
+void writethrd_set_rescan(struct writethrd *wt, struct rescan *rs)
+{
+    wt->rescan = rs;
+}
+
+void writethrd_set_known(struct writethrd *wt, const uint64_t *offsets,
+                         size_t count)
+{
+    wt->known = offsets;
+    wt->nknown = count;
+}
+
+void writethrd_set_files(struct writethrd *wt, struct filelist *files)
+{
+    wt->files = files;
+}
+
 void writethrd_join(struct writethrd *wt)
 {
     if (wt == NULL) return;
@@ -264,6 +554,18 @@ void writethrd_join(struct writethrd *wt)
     worker_join(&wt->worker);
 }
 
+void writethrd_cancel(struct writethrd *wt)
+{
+    if (wt == NULL) return;
+
+    pthread_cancel(wt->wqueue_thrd);
+    pthread_join(wt->wqueue_thrd, NULL);
+
+    // The completion thread would have closed it after the last item
+    fifo_close(wt->fifo);
+    worker_join(&wt->worker);
+}
+
 void writethrd_print_cputime(struct writethrd *wt)
 {
     if (wt == NULL) return;
@@ -272,12 +574,32 @@ void writethrd_print_cputime(struct writethrd *wt)
     worker_print_cputime(&wt->worker, &wt->wqueue_rusage, "W");
 }
 
+void writethrd_json_threads(struct writethrd *wt, struct json *j)
+{
+    if (wt == NULL) return;
+
+    stats_thread_json(j, "wqueue_complete", 0, &wt->wqueue_rusage);
+
+    const char *role = wt->flags & WRITETHREAD_COPY ? "copy" : "swap";
+    for (int i = 0; i < wt->num_threads; i++)
+        stats_thread_json(j, role, i, &wt->write_rusage[i]);
+}
+
+void writethrd_json_stages(struct writethrd *wt, struct json *j)
+{
+    if (wt == NULL) return;
+
+    stats_hist_json(j, "process", &wt->proc_hist);
+    stats_hist_json(j, "write", &wt->write_hist);
+}
+
 void writethrd_free(struct writethrd *wt)
 {
     if (wt == NULL) return;
 
     worker_free(&wt->worker);
     fifo_free(wt->fifo);
+    free(wt->write_rusage);
     free(wt);
 }
 
@@ -285,3 +607,17 @@ unsigned long writethrd_matches(struct writethrd *wt)
 {
     return wt->matches;
 }
+
+size_t writethrd_bytes_done(struct writethrd *wt)
+{
+    if (wt == NULL) return 0;
+
+    return wt->bytes_done;
+}
+
+unsigned long writethrd_chunks_done(struct writethrd *wt)
+{
+    if (wt == NULL) return 0;
+
+    return wt->chunks_done;
+}
@@ -28,9 +28,19 @@
 #ifndef WRITETHRD_H
 #define WRITETHRD_H
 
+#include "json.h"
+
 #include <stdlib.h>
+#include <stdint.h>
 #include <capi/fifo.h>
 
+struct hybrid;
+struct readthrd;
+struct partial;
+struct rescache;
+struct rescan;
+struct filelist;
+
 enum {
     WRITETHREAD_DISCARD = 1,
     WRITETHREAD_TRUNCATE = 2,
@@ -42,11 +52,47 @@ enum {
 };
 
 struct writethrd *writethrd_start(const char *fpath, const char *swap_phrase,
-                                  int num_threads, int flags);
+                                  int num_threads, int flags,
+                                  struct hybrid *hybrid);
+
+// Stop after max_count matches (counted in file order): the results
+// past that are dropped and the read threads are told to stop. Must be
+// called before any chunks are read.
+void writethrd_set_max_count(struct writethrd *wt, unsigned long max_count,
+                             struct readthrd *rt);
+
+// Drop the matches which start at or after limit (an absolute offset).
+// Used when the read extends past the end of a shard so the matches
+// crossing its end are still found.
+void writethrd_set_limit(struct writethrd *wt, size_t limit);
+
+// Also record every match, in order, to a partial result file
+void writethrd_set_partial(struct writethrd *wt, struct partial *partial);
+// And to the result cache, so the entry can be stored after the run
+void writethrd_set_cache(struct writethrd *wt, struct rescache *cache);
+// And the fingerprint and matches of every chunk to the incremental
+// state
+void writethrd_set_rescan(struct writethrd *wt, struct rescan *rs);
+// Matches already known without searching (those of the chunks an
+// incremental scan doesn't search again), in file order. They are
+// counted, printed and recorded to the partial and cache in order with
+// the ones found. The array must last until writethrd_join.
+void writethrd_set_known(struct writethrd *wt, const uint64_t *offsets,
+                         size_t count);
+// Total the matches of each input in the list (from the items' file
+// index) and prefix the printed offsets with the file's path
+void writethrd_set_files(struct writethrd *wt, struct filelist *files);
 void writethrd_join(struct writethrd *wt);
+// Stop and join the threads when no items will ever be pushed (eg. the
+// readthrd failed to start), writethrd_join would wait forever.
+void writethrd_cancel(struct writethrd *wt);
 void writethrd_print_cputime(struct writethrd *wt);
+void writethrd_json_threads(struct writethrd *wt, struct json *j);
+void writethrd_json_stages(struct writethrd *wt, struct json *j);
 void writethrd_free(struct writethrd *wt);
 unsigned long writethrd_matches(struct writethrd *wt);
+size_t writethrd_bytes_done(struct writethrd *wt);
+unsigned long writethrd_chunks_done(struct writethrd *wt);
 
 
 
@@ -0,0 +1,123 @@
+////////////////////////////////////////////////////////////////////////
+//
+// Copyright 2015 PMC-Sierra, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you
+// may not use this file except in compliance with the License. You may
+// obtain a copy of the License at
+// http://www.apache.org/licenses/LICENSE-2.0 Unless required by
+// applicable law or agreed to in writing, software distributed under the
+// License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+// CONDITIONS OF ANY KIND, either express or implied. See the License for
+// the specific language governing permissions and limitations under the
+// License.
+//
+////////////////////////////////////////////////////////////////////////
+
+////////////////////////////////////////////////////////////////////////
+//
+//   Author: Logan Gunthorpe
+//
+//   Description:
+//     XXH64, a fast non-cryptographic hash used to fingerprint chunks.
+//
+////////////////////////////////////////////////////////////////////////
+
+#include "xxhash.h"
+
+#include <endian.h>
+#include <string.h>
+
+#define PRIME1 0x9E3779B185EBCA87ULL
+#define PRIME2 0xC2B2AE3D27D4EB4FULL
+#define PRIME3 0x165667B19E3779F9ULL
+#define PRIME4 0x85EBCA77C2B2AE63ULL
+#define PRIME5 0x27D4EB2F165667C5ULL
+
+static uint64_t rotl(uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+static uint64_t read64(const unsigned char *p)
+{
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return le64toh(v);
+}
+
+static uint32_t read32(const unsigned char *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return le32toh(v);
+}
+
+static uint64_t round64(uint64_t acc, uint64_t input)
+{
+    acc += input * PRIME2;
+    acc = rotl(acc, 31);
+    return acc * PRIME1;
+}
+
+static uint64_t merge_round(uint64_t acc, uint64_t val)
+{
+    acc ^= round64(0, val);
+    return acc * PRIME1 + PRIME4;
+}
+
+uint64_t xxh64(const void *buf, size_t len, uint64_t seed)
+{
+    const unsigned char *p = buf;
+    const unsigned char *end = p + len;
+    uint64_t h;
+
+    if (len >= 32) {
+        uint64_t v1 = seed + PRIME1 + PRIME2;
+        uint64_t v2 = seed + PRIME2;
+        uint64_t v3 = seed;
+        uint64_t v4 = seed - PRIME1;
+
+        do {
+            v1 = round64(v1, read64(p));
+            v2 = round64(v2, read64(p + 8));
+            v3 = round64(v3, read64(p + 16));
+            v4 = round64(v4, read64(p + 24));
+            p += 32;
+        } while (p + 32 <= end);
+
+        h = rotl(v1, 1) + rotl(v2, 7) + rotl(v3, 12) + rotl(v4, 18);
+        h = merge_round(h, v1);
+        h = merge_round(h, v2);
+        h = merge_round(h, v3);
+        h = merge_round(h, v4);
+    } else {
+        h = seed + PRIME5;
+    }
+
+    h += len;
+
+    for (; p + 8 <= end; p += 8) {
+        h ^= round64(0, read64(p));
+        h = rotl(h, 27) * PRIME1 + PRIME4;
+    }
+
+    if (p + 4 <= end) {
+        h ^= (uint64_t) read32(p) * PRIME1;
+        h = rotl(h, 23) * PRIME2 + PRIME3;
+        p += 4;
+    }
+
+    for (; p < end; p++) {
+        h ^= *p * PRIME5;
+        h = rotl(h, 11) * PRIME1;
+    }
+
+    h ^= h >> 33;
+    h *= PRIME2;
+    h ^= h >> 29;
+    h *= PRIME3;
+    h ^= h >> 32;
+
+    return h;
+}
@@ -0,0 +1,34 @@
+////////////////////////////////////////////////////////////////////////
+//
+// Copyright 2015 PMC-Sierra, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you
+// may not use this file except in compliance with the License. You may
+// obtain a copy of the License at
+// http://www.apache.org/licenses/LICENSE-2.0 Unless required by
+// applicable law or agreed to in writing, software distributed under the
+// License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+// CONDITIONS OF ANY KIND, either express or implied. See the License for
+// the specific language governing permissions and limitations under the
+// License.
+//
+////////////////////////////////////////////////////////////////////////
+
+////////////////////////////////////////////////////////////////////////
+//
+//   Author: Logan Gunthorpe
+//
+//   Description:
+//     XXH64, a fast non-cryptographic hash used to fingerprint chunks.
+//
+////////////////////////////////////////////////////////////////////////
+
+#ifndef XXHASH_H
+#define XXHASH_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+uint64_t xxh64(const void *buf, size_t len, uint64_t seed);
+
+#endif